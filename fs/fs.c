@@ -486,12 +486,24 @@ file_truncate_blocks(struct File *f, off_t newsize)
 	}
 }
 
+// Return the identity of file f: the disk address of its struct File,
+// which is the same for every open of the file.
+uint32_t
+file_ino(struct File *f)
+{
+	return (uintptr_t) f - DISKMAP;
+}
+
 // Set the size of file f, truncating or extending as necessary.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	if (f->f_size > newsize) {
+		// The freed blocks may go to other files, so running this
+		// file as a program must no longer map them.
+		sys_exec_invalidate(file_ino(f));
 		file_truncate_blocks(f, newsize);
+	}
 	f->f_size = newsize;
 	flush_block(f);
 	return 0;
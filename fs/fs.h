@@ -36,6 +36,7 @@ int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
+uint32_t file_ino(struct File *f);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
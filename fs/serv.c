@@ -305,6 +305,42 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 }
 
 
+// Answer the kernel's page-in request for the page at req->req_offset
+// of req->req_fileid, on behalf of the demand-paged environment 'envid'.
+// The kernel maps the block-cache page holding the data into 'envid',
+// and keys its image cache with the file identity we pass along.
+// By the time we answer, 'envid' may have died, so errors from
+// sys_exec_pagein are ignored.
+void
+serve_pagein(envid_t envid, struct Fsreq_pagein *req)
+{
+	struct OpenFile *o;
+	char *blk = NULL;
+	uint32_t ino = 0;
+	int r;
+
+	if (debug)
+		cprintf("serve_pagein %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		goto out;
+	if (req->req_offset < 0 || req->req_offset >= o->o_file->f_size
+	    || req->req_offset % BLKSIZE) {
+		r = -E_INVAL;
+		goto out;
+	}
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		goto out;
+
+	// Fault the block into the cache before handing it over.
+	*(volatile char *) blk;
+	r = req->req_offset;
+	ino = file_ino(o->o_file);
+
+out:
+	sys_exec_pagein(envid, r, blk, ino);
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
@@ -347,6 +383,13 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
+		// Page-ins are answered through the kernel, not with ipc_send
+		if (req == FSREQ_PAGEIN) {
+			serve_pagein(whom, &fsreq->pagein);
+			sys_page_unmap(0, fsreq);
+			continue;
+		}
+
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
@@ -44,6 +44,30 @@ enum EnvType {
 	ENV_TYPE_FS,		// File system server
 	ENV_TYPE_NS,		// Network server
 	ENV_TYPE_SERVICE,   // Service
+	NENVTYPE
+};
+
+// Registry of the environment providing each special EnvType, kept up
+// to date by the kernel and mapped read-only at USERVICES.  An entry is
+// 0 when no live environment of that type exists.
+struct ServiceTable {
+	envid_t st_envid[NENVTYPE];
+};
+
+// Number of file-backed segments of a demand-paged program
+#define NEXECREGION		4
+
+// Number of device events with a wait queue (WAIT_NET_RX, WAIT_NET_TX)
+#define NWAITQ			2
+
+// A loadable segment of a demand-paged program, faulted in from the
+// file server on first touch (see kern/exec.c).  Unused if er_end is 0.
+struct ExecRegion {
+	uintptr_t er_va;		// Start of the segment
+	uintptr_t er_filend;		// End of its file data
+	uintptr_t er_end;		// End of the segment
+	off_t er_offset;		// File offset of er_va
+	int er_perm;			// Page permissions
 };
 
 struct Env {
@@ -55,12 +79,15 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	int env_affinity;		// The only CPU allowed to run it, or -1
+	bool env_thread;		// Shares the address space it was made in
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_xstacktop;	// Top of the user exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -68,6 +95,29 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Blocking waits
+	physaddr_t env_futex_key;	// Physical address waited on, or 0
+	struct Env *env_futex_link;	// Next waiter on the same futex queue
+	uint32_t env_wait_events;	// WAIT_* sources of a sys_wait, or 0
+	uint32_t env_wait_deadline;	// time_msec() to give up at, or 0
+	uint32_t env_wait_queued;	// Device events whose queues it is on
+	struct Env *env_wait_link[NWAITQ]; // Next waiter on each of them
+
+	// Demand-paged program image
+	struct ExecRegion env_exec[NEXECREGION];
+	envid_t env_exec_pager;		// File server that pages it in
+	int env_exec_fileid;		// Program's file id on the pager
+	uint32_t env_exec_ino;		// Program's file identity, or 0
+	uintptr_t env_pagein_va;	// Page being paged in, or 0
+	bool env_pagein_queued;		// Waiting for the pager to receive
+	struct Env *env_pagein_link;	// Next waiter for a busy pager
+	bool env_syscall_restart;	// Its system call may be restarted
+
+	// x87/SSE registers (see kern/fpu.c)
+	int env_fpu_cpu;		// CPU whose registers hold them, or -1
+	bool env_fpu_used;		// env_fpu holds a saved state
+	uint8_t env_fpu[512] __attribute__((aligned(16)));	// FXSAVE area
 };
 
 #endif // !JOS_INC_ENV_H
@@ -28,6 +28,9 @@ enum {
 	E_E1000_TX_FULL, // "e1000 tx full",
 	E_E1000_RX_EMPTY, // "e1000 rx empty",
 
+	E_TIMEOUT	,	// Wait timed out
+	E_AGAIN		,	// Resource changed, try again
+
 	MAXERROR
 };
 
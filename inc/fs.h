@@ -70,7 +70,10 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Sent by the kernel on behalf of a faulting environment;
+	// answered with sys_exec_pagein
+	FSREQ_PAGEIN
 };
 
 union Fsipc {
@@ -108,6 +111,10 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_pagein {
+		int req_fileid;
+		off_t req_offset;
+	} pagein;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
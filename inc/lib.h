@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/uthread.h>
 
 #define USED(x)		(void)(x)
 
@@ -30,10 +31,24 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
+extern const volatile struct ServiceTable services;
 extern const volatile struct PageInfo pages[];
 
+// The calling environment, or the calling thread of a threaded program.
+// The kernel bases GS at its struct Env every time it runs it.
+#define thisenv		(&envs[ENVX(thisenvid())])
+
+static inline envid_t
+thisenvid(void)
+{
+	envid_t envid;
+
+	asm volatile("movl %%gs:%c1,%0"
+		     : "=r" (envid) : "i" (offsetof(struct Env, env_id)));
+	return envid;
+}
+
 // exit.c
 void	exit(void);
 
@@ -57,14 +72,31 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_range(envid_t env, void *va, size_t npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t npages);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
-int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv(void *rcv_pg, unsigned timeout);
 unsigned int sys_time_msec(void);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+envid_t	sys_spawn(const void *image, size_t size, const char **argv,
+		  const struct Fd *fd);
+int	sys_exec_pagein(envid_t envid, int32_t result, void *pg, uint32_t ino);
+int	sys_exec_invalidate(uint32_t ino);
+envid_t	sys_thread_create(void *eip, void *esp, void *xstacktop);
+int	sys_env_set_affinity(envid_t env, int cpu);
+envid_t	sys_service_lookup(enum EnvType type);
+int	sys_wait(uint32_t events, volatile uint32_t *addr, uint32_t val,
+		 void *rcv_pg, unsigned timeout);
 
 #define NOT_LAST_PKG false
 #define LAST_PKG true
 int sys_tx_pkg(void* buffer, uint32_t size);
+int sys_tx_batch(const struct jif_txd* txds, int n);
 int sys_rx_pkg(void* buffer, uint32_t size);
+int sys_rx_batch(void* va, int n);
+int sys_netmap_attach(void);
+int sys_netmap_sync(int flags);
 int sys_set_service();
 int sys_get_mac_address(uint64_t *mac);
 
@@ -84,10 +116,11 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 unsigned timeout);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -139,6 +172,10 @@ void	cputchar(int c);
 int	getchar(void);
 int	iscons(int fd);
 int	opencons(void);
+void	cwrite(const char *s, size_t n);
+void	cflush(void);
+int	csetbuf(int mode);
+void	creset(void);
 
 // pipe.c
 int	pipe(int pipefds[2]);
@@ -147,6 +184,33 @@ int	pipeisclosed(int pipefd);
 // wait.c
 void	wait(envid_t env);
 
+// kthread.c
+envid_t	kthread_create(void (*fn)(void *), void *arg);
+void	kthread_exit(void) __attribute__((noreturn));
+int	kthread_join(envid_t tid);
+
+// uthread.c
+int	uthread_run(void (*fn)(void *), void *arg, int nworkers);
+int	uthread_create(struct Uthread **ut_store, void (*fn)(void *),
+		       void *arg, size_t stacksize);
+struct Uthread *uthread_self(void);
+void	uthread_yield(void);
+void	uthread_exit(void) __attribute__((noreturn));
+int	uthread_join(struct Uthread *ut);
+void	uthread_detach(struct Uthread *ut);
+int	uthread_futex_wait(volatile uint32_t *addr, uint32_t val);
+int	uthread_futex_wake(volatile uint32_t *addr, int n);
+void	uthread_blocking(void);
+int32_t	uthread_ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+
+// usync.c
+void	umutex_lock(struct Umutex *m);
+bool	umutex_trylock(struct Umutex *m);
+void	umutex_unlock(struct Umutex *m);
+void	ucond_wait(struct Ucond *c, struct Umutex *m);
+void	ucond_signal(struct Ucond *c);
+void	ucond_broadcast(struct Ucond *c);
+
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
 #define	O_WRONLY	0x0001		/* open for writing only */
@@ -1,7 +1,26 @@
 #ifndef JOS_INC_MALLOC_H
 #define JOS_INC_MALLOC_H 1
 
+// Heap statistics, from malloc_stats().  The heap's memory that is not
+// in use, ms_slab + ms_large - ms_inuse, is lost to fragmentation:
+// partly filled slabs, cached empty ones, objects parked in per-thread
+// caches and rounding up to a size class.
+struct MallocStats {
+	size_t ms_inuse;	// Bytes handed out, rounded up to their class
+	size_t ms_slab;		// Bytes of slab pages, cached ones included
+	size_t ms_large;	// Bytes of page runs for large objects
+	size_t ms_nlarge;	// Large objects
+	size_t ms_tcache;	// Bytes of free objects in per-thread caches
+	uint32_t ms_nmalloc;	// Successful malloc calls
+	uint32_t ms_nfree;	// free calls
+	uint32_t ms_nsyscall;	// Page allocation and unmap system calls
+};
+
 void *malloc(size_t size);
 void free(void *addr);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *addr, size_t size);
+void malloc_stats(struct MallocStats *ms);
+void malloc_thread_flush(void);
 
 #endif
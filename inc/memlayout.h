@@ -16,7 +16,8 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_UENV   0x28     // user segment based at the running Env
+#define GD_TSS0   0x30     // Task segment selector for CPU 0
 
 /*
  * Virtual memory map:                                Permissions
@@ -50,7 +51,9 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |         RO SERVICES          | R-/R-  PGSIZE
+ *    USERVICES ---->  +------------------------------+ 0xeefff000
+ *                     |           RO ENVS            | R-/R-  PTSIZE-PGSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -114,6 +117,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only service registry, in the last page of the UENVS slot
+#define USERVICES	(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -137,6 +142,12 @@
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
+// Fd page of the program file of a demand-paged environment
+#define UEXECFD		(UTEMP - PGSIZE)
+// Netmap rings and buffer pool (see inc/ns.h), one PTSIZE slot between
+// the library's file descriptor table (0xD0000000 up to 0xD8020000) and
+// its kernel and user thread stacks (0xE0000000 up to 0xEE000000)
+#define UNETMAP		0xDC000000
 
 // Physical address of startup code for non-boot CPUs (APs)
 #define MPENTRY_PADDR	0x7000
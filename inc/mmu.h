@@ -69,6 +69,10 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// One of them marks pages that fork and spawn share with the child
+// instead of copying (file descriptors, pipes, the netmap pool).
+#define PTE_SHARE	0x400
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -89,6 +93,8 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_OSXMMEXCPT	0x00000400	// OS handles SIMD exceptions
+#define CR4_OSFXSR	0x00000200	// OS saves SSE state with FXSAVE
 #define CR4_PCE		0x00000100	// Performance counter enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
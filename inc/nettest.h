@@ -0,0 +1,22 @@
+// Frames for the network card tests (user/test*.c), which send from
+// 10.0.2.15 to QEMU's host at 10.0.2.2.
+
+#ifndef JOS_INC_NETTEST_H
+#define JOS_INC_NETTEST_H
+
+#include <inc/types.h>
+
+#define ETH_HLEN	14
+#define IP_HLEN		20
+#define UDP_HLEN	8
+#define TCP_HLEN	20
+#define ARP_LEN		60	// An ARP request, padded to the shortest frame
+
+void	put16(uint8_t *p, uint16_t v);
+void	nettest_mac(uint8_t *mac);
+void	nettest_arp(uint8_t *buf, const uint8_t *mac);
+uint8_t *nettest_ip(uint8_t *frame, uint8_t proto, int l4hlen, int len,
+		    uint16_t sport);
+uint16_t nettest_pseudo(const uint8_t *frame, int l4len);
+
+#endif	// !JOS_INC_NETTEST_H
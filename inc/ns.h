@@ -5,15 +5,96 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/memlayout.h>
 #include <lwip/sockets.h>
 
 #define MAX_PKG_SIZE 1518
+#define MAX_JUMBO_SIZE 9018	// Frames of a 9000-byte MTU
+#define MAX_TSO_SIZE (14 + 0xffff)	// The largest IPv4 packet, for JIF_TSO
 
 struct jif_pkt {
 	int jp_len;
+	uint32_t jp_flags;	// JIF_CSUM_* offloads, JIF_RX_MORE
 	char jp_data[0];
 };
 
+// A received frame too long for one page's receive buffer comes as a
+// run of pages, in order, all but the last flagged JIF_RX_MORE; only
+// the last carries the frame's JIF_CSUM_* flags.
+#define JIF_RX_MORE	0x10
+
+// Checksum offload flags.  On a packet to send, the card is to fill in
+// the checksum, which the sender zeroes (IP) or seeds with the sum of
+// the pseudo header (TCP, UDP).  On a packet received, the card found
+// the checksum right, or with JIF_CSUM_BAD, found one of them wrong.
+#define JIF_CSUM_IP	0x1	// IPv4 header checksum
+#define JIF_CSUM_L4	0x2	// TCP or UDP checksum
+#define JIF_CSUM_BAD	0x4
+
+// One fragment of a packet for sys_tx_batch: 'jt_len' bytes at 'jt_va',
+// which must not cross a page boundary, nor be changed until the card
+// has sent them.  A packet is a run of up to JIF_TX_MAXFRAG fragments,
+// all but the last flagged JIF_TX_MORE, which the card gathers as it
+// sends them.  The JIF_CSUM_* and JIF_TSO flags go on the first
+// fragment, which must hold the headers they name.
+struct jif_txd {
+	void *jt_va;
+	uint32_t jt_len;
+	uint32_t jt_flags;	// JIF_CSUM_* for the card to fill in, JIF_TX_MORE
+	uint32_t jt_mss;	// With JIF_TSO, the payload of each segment
+};
+
+#define JIF_TX_MORE	0x8	// The packet goes on in the next jif_txd
+#define JIF_TX_MAXFRAG	48
+
+// TCP segmentation offload: the packet is a TCP segment of up to
+// MAX_TSO_SIZE bytes, which the card cuts into segments of jt_mss bytes
+// of payload, each with a copy of its headers.  The card fills in the
+// IP length, ID and checksum and the TCP sequence number and checksum
+// of each; the sender seeds the TCP checksum with the pseudo header
+// summed without the length.
+#define JIF_TSO		0x20
+
+// Netmap mode: sys_netmap_attach maps a struct netmap_if and a pool of
+// NETMAP_NBUF packet buffers at NETMAP_VA into the caller, which then
+// moves packets by writing slots and calling sys_netmap_sync, with no
+// copies and no page mappings per packet.  The card's own descriptor
+// rings stay in the kernel, which checks every slot before using it.
+#define NETMAP_VA	UNETMAP
+#define NETMAP_BUFVA	(NETMAP_VA + PGSIZE)
+#define NETMAP_BUFSIZE	2048
+#define NETMAP_NBUF	256
+#define NETMAP_NTX	64	// One slot per transmit descriptor
+#define NETMAP_NRX	128	// One slot per receive descriptor
+#define NETMAP_BUF(i)	((char *) NETMAP_BUFVA + (i) * NETMAP_BUFSIZE)
+
+// Flags for sys_netmap_sync
+#define NETMAP_TX	0x1
+#define NETMAP_RX	0x2
+
+struct netmap_slot {
+	uint16_t ns_buf;	// Index of the buffer in the pool
+	uint16_t ns_len;	// Length of the packet in it
+};
+
+// Slots [nr_head, nr_tail) belong to the user: free buffers to fill on
+// the transmit ring, received packets on the receive ring.  The user
+// hands slots to the kernel by advancing nr_head; sys_netmap_sync
+// hands them back by advancing nr_tail.  The kernel keeps its own copy
+// of nr_tail, so writing it achieves nothing.
+struct netmap_ring {
+	uint32_t nr_head;
+	uint32_t nr_tail;
+	uint32_t nr_nslots;
+	struct netmap_slot nr_slot[NETMAP_NRX];
+};
+
+struct netmap_if {
+	struct netmap_ring ni_tx;	// Buffers 0 .. NETMAP_NTX-1
+	struct netmap_ring ni_rx;	// The next NETMAP_NRX buffers
+	// The rest of the pool is spare, for the user to swap into slots.
+};
+
 // Definitions for requests from clients to network server
 enum {
 	// The following messages pass a page containing an Nsipc.
@@ -34,9 +115,6 @@ enum {
 	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
 	// network server, to the output environment
 	NSREQ_OUTPUT,
-
-	// The following message passes no page
-	NSREQ_TIMER,
 };
 
 union Nsipc {
@@ -12,6 +12,11 @@ void	cputchar(int c);
 int	getchar(void);
 int	iscons(int fd);
 
+// Console output buffering modes for csetbuf() (lib/console.c)
+#define _IONBF		0	// Unbuffered
+#define _IOLBF		1	// Flushed at each newline
+#define _IOFBF		2	// Flushed when full
+
 // lib/printfmt.c
 void	printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...);
 void	vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list);
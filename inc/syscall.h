@@ -22,7 +22,29 @@ enum {
 	SYS_rx_pkg,
 	SYS_set_service,
 	SYS_get_mac_address,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_wait,
+	SYS_service_lookup,
+	SYS_env_set_affinity,
+	SYS_spawn,
+	SYS_exec_pagein,
+	SYS_exec_invalidate,
+	SYS_thread_create,
+	SYS_page_alloc_range,
+	SYS_page_unmap_range,
+	SYS_tx_batch,
+	SYS_rx_batch,
+	SYS_netmap_attach,
+	SYS_netmap_sync,
 	NSYSCALLS
 };
 
+// Event sources for SYS_wait, which returns the one that fired.
+#define WAIT_IPC	0x1	// An IPC message was received
+#define WAIT_FUTEX	0x2	// The futex word changed or was woken
+#define WAIT_NET_RX	0x4	// The network card received a packet
+#define WAIT_NET_TX	0x8	// The network card has room to transmit
+#define WAIT_ALL	(WAIT_IPC | WAIT_FUTEX | WAIT_NET_RX | WAIT_NET_TX)
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -0,0 +1,30 @@
+#ifndef JOS_INC_UTHREAD_H
+#define JOS_INC_UTHREAD_H 1
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// User-level threads, multiplexed over a pool of kernel threads
+// (see lib/uthread.c).
+
+#define UTHREAD_MAXWORKERS	8		// Kernel threads per program
+#define UTHREAD_STACKSIZE	(4 * PGSIZE)	// Default stack size
+#define UTHREAD_MAXSTACK	(64 * PGSIZE)	// Largest stack size
+
+struct Uthread;
+
+// A mutex that parks the user threads waiting for it.
+// um_state is 0 if unlocked, 1 if locked, 2 if locked with waiters.
+struct Umutex {
+	volatile uint32_t um_state;
+};
+
+// A condition variable.  uc_seq changes on every signal.
+struct Ucond {
+	volatile uint32_t uc_seq;
+};
+
+#define UMUTEX_INITIALIZER	{ 0 }
+#define UCOND_INITIALIZER	{ 0 }
+
+#endif	// !JOS_INC_UTHREAD_H
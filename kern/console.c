@@ -8,10 +8,16 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Serializes output to the console devices.  The output functions
+// below take it; sys_cputs calls cons_write without the big kernel
+// lock, so other CPUs need not wait on the serial port and printer.
+static struct spinlock cons_lock;
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -32,8 +38,13 @@ delay(void)
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TDI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
+#define   COM_IIR_FIFO	0xC0	//   FIFOs enabled (16550A)
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_ENABLE 0x01	//   Enable the FIFOs
+#define   COM_FCR_RXRESET 0x02	//   Clear the receive FIFO
+#define   COM_FCR_TXRESET 0x04	//   Clear the transmit FIFO
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -46,8 +57,23 @@ delay(void)
 #define   COM_LSR_TXRDY	0x20	//   Transmit buffer avail
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
+#define COM_TXFIFO	16	// Transmit FIFO size of a 16550A
+
 static bool serial_exists;
 
+// Serial output goes into a ring drained by the transmitter-empty
+// interrupt, so that console output need not wait for the UART a byte
+// at a time.  Protected by cons_lock.
+#define SERTXSIZE	4096
+
+static struct {
+	uint8_t buf[SERTXSIZE];
+	uint32_t rpos;
+	uint32_t wpos;		// rpos == wpos means empty
+} sertx;
+
+static int serial_txburst = 1;	// Bytes the UART takes when it is ready
+
 static int
 serial_proc_data(void)
 {
@@ -56,11 +82,33 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Move bytes from the ring to the UART if it has room, and ask for an
+// interrupt when it next does if any remain.  The caller holds cons_lock.
+static void
+serial_tx(void)
+{
+	int i;
+
+	if (!serial_exists)
+		return;
+	if (inb(COM1+COM_LSR) & COM_LSR_TXRDY)
+		for (i = 0; i < serial_txburst && sertx.rpos != sertx.wpos; i++)
+			outb(COM1+COM_TX, sertx.buf[sertx.rpos++ % SERTXSIZE]);
+	outb(COM1+COM_IER, COM_IER_RDI
+	     | (sertx.rpos != sertx.wpos ? COM_IER_TDI : 0));
+}
+
 void
 serial_intr(void)
 {
-	if (serial_exists)
-		cons_intr(serial_proc_data);
+	if (!serial_exists)
+		return;
+	// Reading IIR acknowledges a transmitter-empty interrupt.
+	(void) inb(COM1+COM_IIR);
+	cons_intr(serial_proc_data);
+	spin_lock(&cons_lock);
+	serial_tx();
+	spin_unlock(&cons_lock);
 }
 
 static void
@@ -68,19 +116,28 @@ serial_putc(int c)
 {
 	int i;
 
-	for (i = 0;
-	     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
-	     i++)
-		delay();
-
-	outb(COM1 + COM_TX, c);
+	if (!serial_exists)
+		return;
+
+	// If the ring is full, make room by waiting for the UART.
+	if (sertx.wpos - sertx.rpos == SERTXSIZE) {
+		for (i = 0;
+		     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
+		     i++)
+			delay();
+		outb(COM1 + COM_TX, sertx.buf[sertx.rpos++ % SERTXSIZE]);
+	}
+	sertx.buf[sertx.wpos++ % SERTXSIZE] = c;
 }
 
 static void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	// Turn on the FIFOs if there are any, so that the UART can take
+	// a burst of output per transmitter-empty interrupt
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RXRESET | COM_FCR_TXRESET);
+	if ((inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO)
+		serial_txburst = COM_TXFIFO;
 
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
@@ -205,7 +262,12 @@ cga_putc(int c)
 		crt_pos -= CRT_COLS;
 	}
 
-	/* move that little blinky thing */
+}
+
+// Move that little blinky thing, once per write rather than per character.
+static void
+cga_cursor(void)
+{
 	outb(addr_6845, 14);
 	outb(addr_6845 + 1, crt_pos >> 8);
 	outb(addr_6845, 15);
@@ -431,7 +493,7 @@ cons_getc(void)
 	return 0;
 }
 
-// output a character to the console
+// output a character to the console; the caller holds cons_lock
 static void
 cons_putc(int c)
 {
@@ -440,10 +502,23 @@ cons_putc(int c)
 	cga_putc(c);
 }
 
+// output 'n' characters to the console, holding cons_lock just once
+void
+cons_write(const char *s, size_t n)
+{
+	spin_lock(&cons_lock);
+	while (n-- > 0)
+		cons_putc(*s++);
+	serial_tx();
+	cga_cursor();
+	spin_unlock(&cons_lock);
+}
+
 // initialize the console devices
 void
 cons_init(void)
 {
+	spin_initlock(&cons_lock);
 	cga_init();
 	kbd_init();
 	serial_init();
@@ -458,7 +533,9 @@ cons_init(void)
 void
 cputchar(int c)
 {
-	cons_putc(c);
+	char ch = c;
+
+	cons_write(&ch, 1);
 }
 
 int
@@ -1,4 +1,5 @@
 #include <inc/error.h>
+#include <inc/string.h>
 #include <inc/ns.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -6,27 +7,64 @@
 #include <kern/picirq.h>
 #include <kern/e1000.h>
 #include <kern/sched.h>
+#include <kern/wait.h>
+#include <inc/syscall.h>
 
 // 82540EM
 
 // LAB 6: Your driver code here
 
-#define PTE_COW     0x800
-
 #define TX_DESC_NUM 64
 #define RX_DESC_NUM 128
 
-#define TX_BUF_ADDR (USTACKTOP-PTSIZE-(TX_DESC_NUM * PGSIZE))
-#define GET_TX_BUF(index) (TX_BUF_ADDR + (index * PGSIZE))
+// Interrupt moderation.  ITR spaces interrupts at least this many 256ns
+// units apart; RDTR holds the receive interrupt back until the wire has
+// been quiet this many 1.024us units, and RADV bounds how long it may
+// be held back.  0 turns each of them off.
+#define ITR_INTERVAL 488    // At most ~8000 interrupts a second
+#define RX_DELAY 32         // ~33us
+#define RX_ABS_DELAY 128    // ~131us
+
+// Receive interrupts, masked while consumers are draining the ring.
+#define RX_INTERRUPTS (E1000_IMS_RXT0 | E1000_IMS_RXO)
 
 static volatile uint32_t  *base_address;
 static struct e1000_tx_desc* tx_descriptors;
 static struct e1000_rx_desc* rx_descriptors;
 
+// The page each transmit descriptor points into.  We hold a reference
+// until the descriptor is reused, so the sender may unmap its buffer
+// as soon as the packet is queued.
+static struct PageInfo *tx_pages[TX_DESC_NUM];
+
+// The checksum context last loaded into the card.  Runs of packets with
+// the same header layout need only one context descriptor between them.
+static struct e1000_context_desc tx_ctx;
+static bool tx_ctx_valid;
+
 static int irq = -1;
 
-static struct Env* env_wait_receive = NULL;
-static struct Env* env_wait_send = NULL;
+// Set from a receive interrupt until somebody finds the ring empty:
+// until then whoever consumes the ring will see new packets anyway, so
+// they need not interrupt anyone.
+static bool rx_polling;
+
+// Set while e1000_rx_pkg drops the rest of a frame that spans several
+// receive descriptors.
+static bool rx_dropping;
+
+// Netmap mode (see inc/ns.h).  While an address space is attached, the
+// page-at-a-time paths are closed and both rings point into the pool.
+#define NM_NPAGES (1 + NETMAP_NBUF * NETMAP_BUFSIZE / PGSIZE)
+#define NM_BUFS_PER_PAGE (PGSIZE / NETMAP_BUFSIZE)
+
+static pde_t* nm_pgdir;                     // The attached address space
+static volatile struct netmap_if* nm_if;    // Its rings, which it may scribble on
+static struct PageInfo* nm_pages[NM_NPAGES];// The rings' page, then the pool
+static uint32_t nm_txcur, nm_txtail;        // Our own head and tail of each ring
+static uint32_t nm_rxcur, nm_rxtail;
+static uint16_t nm_rxbuf[RX_DESC_NUM];      // The buffer behind each receive descriptor
+static uint64_t rx_saved[RX_DESC_NUM];      // The page-mode receive buffers
 
 #define REG(id) ((uint32_t*) (base_address + (id / 4)))
 
@@ -49,7 +87,10 @@ int e1000_attach(struct pci_func *e1000){
     // Interrupt activation
     irq = e1000->irq_line;
     irq_setmask_8259A(irq_mask_8259A & ~(1<<irq));
-    *REG(E1000_IMS) = E1000_IMS_TXQE | E1000_IMS_RXSEQ | E1000_IMS_RXO | E1000_IMS_RXT0;
+    *REG(E1000_ITR) = ITR_INTERVAL;
+    *REG(E1000_RDTR) = RX_DELAY;
+    *REG(E1000_RADV) = RX_ABS_DELAY;
+    *REG(E1000_IMS) = E1000_IMS_TXQE | E1000_IMS_RXSEQ | RX_INTERRUPTS;
     *REG(E1000_ICS) = E1000_ICS_TXQE | E1000_ICS_RXSEQ | E1000_ICS_RXO | E1000_ICS_RXT0;
 
     cprintf("\nE1000 Status: 0x%x IRQ: %d\n",*REG(E1000_STATUS), irq);
@@ -116,19 +157,22 @@ int e1000_attach(struct pci_func *e1000){
     *REG(E1000_RDH) = 1;
     *REG(E1000_RDT) = 0;
 
-    // Set Rx buffers
+    // Check IP, TCP and UDP checksums of received packets
+    *REG(E1000_RXCSUM) = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
+
+    // Set Rx buffers, each a struct jif_pkt
     for (i = 0; i < RX_DESC_NUM; i++){
         if ((p = page_alloc(ALLOC_ZERO)) == 0 ){ // TODO: clean memory on error
             panic ("e1000_attach no mem");
         }
-        rx_descriptors[i].buffer_addr = page2pa(p) + 4;
+        rx_descriptors[i].buffer_addr = page2pa(p) + offsetof(struct jif_pkt, jp_data);
         rx_descriptors[i].status &= ~E1000_RXD_STAT_DD;
     }
 
     // Control
     *REG(E1000_RCTL) &= ~E1000_RCTL_BSEX; // Use pkg in range up to 2048
     *REG(E1000_RCTL) &= ~E1000_RCTL_SZ_256; // This will set pkg sizes to 2048 (bits [16:17] == 0
-    *REG(E1000_RCTL) &= ~E1000_RCTL_LPE; // Don't use jambo packages
+    *REG(E1000_RCTL) |= E1000_RCTL_LPE; // Take jumbo frames, over several descriptors
     *REG(E1000_RCTL) &= ~(0b11 << 6); // use E1000_RCTL_LBM_NO [6:7]
     *REG(E1000_RCTL) &= ~(E1000_RCTL_MPE); // Disable multi case
     *REG(E1000_RCTL) |= E1000_RCTL_SECRC; // Strip crc
@@ -139,89 +183,659 @@ int e1000_attach(struct pci_func *e1000){
     return 0;
 }
 
-int e1000_tx_pkg(void* buffer, uint32_t size){
+// Can the 'n' descriptors from 'tail' on be filled?  The one after
+// them must be free too: TDT must never catch up with TDH, or the card
+// would take a full ring for an empty one.
+static bool tx_free(uint32_t tail, int n){
+    int i;
+
+    for (i = 0; i <= n; i++){
+        if (!(tx_descriptors[(tail + i) % TX_DESC_NUM].upper.data & E1000_TXD_STAT_DD)){
+            return false;
+        }
+    }
+    return true;
+}
 
-    int result;
-    user_mem_assert(curenv, buffer, size, PTE_U);
+// Make 'pp' (which may be NULL) the page behind descriptor 'index'.
+static void tx_set_page(uint32_t index, struct PageInfo *pp){
+    if (tx_pages[index] != NULL){
+        page_decref(tx_pages[index]);
+    }
+    tx_pages[index] = pp;
+}
 
-    if (size > MAX_PKG_SIZE){
-        panic ("MAX_PKG_SIZE");
+// Fill in 'ctx' for the checksums 'flags' asks the card to insert in
+// the Ethernet frame whose first 'len' bytes are at 'frame', and must
+// hold its IPv4 header and its TCP or UDP checksum field, and for
+// JIF_TSO, cutting the frame of 'total' bytes into segments of 'mss'.
+// Returns the POPTS bits for the frame's data descriptor, 0 if 'flags'
+// asks for nothing, or -E_INVAL if the frame does not fit them.
+static int tx_csum(const uint8_t* frame, uint32_t len, uint32_t flags,
+                   uint32_t mss, uint32_t total, struct e1000_context_desc* ctx){
+
+    uint32_t l3 = 14, l4, cso, hdrlen;
+    int popts = 0;
+
+    memset(ctx, 0, sizeof(*ctx));
+    if (flags & JIF_TSO){
+        flags |= JIF_CSUM_IP | JIF_CSUM_L4;
+    }
+    if (!(flags & (JIF_CSUM_IP | JIF_CSUM_L4))){
+        return 0;
     }
+    if (len < l3 + 20 || frame[12] != 0x08 || frame[13] != 0x00 ||
+        (frame[l3] >> 4) != 4){
+        return -E_INVAL;
+    }
+    l4 = l3 + (frame[l3] & 0xF) * 4;
+    if (l4 < l3 + 20 || l4 > len){
+        return -E_INVAL;
+    }
+
+    ctx->cmd_and_length = E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_C |
+        E1000_TXD_CMD_IP | E1000_TXD_CMD_RS;
+    if (flags & JIF_CSUM_IP){
+        ctx->lower_setup.ip_fields.ipcss = l3;
+        ctx->lower_setup.ip_fields.ipcso = l3 + 10;
+        ctx->lower_setup.ip_fields.ipcse = l4 - 1;
+        popts |= E1000_TXD_POPTS_IXSM;
+    }
+    if (flags & JIF_CSUM_L4){
+        switch (frame[l3 + 9]){
+        case 6:     // TCP
+            cso = l4 + 16;
+            ctx->cmd_and_length |= E1000_TXD_CMD_TCP;
+            break;
+        case 17:    // UDP
+            cso = l4 + 6;
+            break;
+        default:
+            return -E_INVAL;
+        }
+        if (cso + 2 > len){
+            return -E_INVAL;
+        }
+        ctx->upper_setup.tcp_fields.tucss = l4;
+        ctx->upper_setup.tcp_fields.tucso = cso;
+        ctx->upper_setup.tcp_fields.tucse = 0;  // To the end of the frame
+        popts |= E1000_TXD_POPTS_TXSM;
+    }
+    if (flags & JIF_TSO){
+        hdrlen = l4 + (frame[l4 + 12] >> 4) * 4;
+        if (frame[l3 + 9] != 6 || hdrlen < l4 + 20 || hdrlen > len ||
+            mss == 0 || hdrlen + mss > MAX_JUMBO_SIZE || total <= hdrlen){
+            return -E_INVAL;
+        }
+        ctx->cmd_and_length |= E1000_TXD_CMD_TSE | (total - hdrlen);  // PAYLEN
+        ctx->tcp_seg_setup.fields.hdr_len = hdrlen;
+        ctx->tcp_seg_setup.fields.mss = mss;
+    }
+    return popts;
+}
+
+// Point the descriptors from 'tail' on at curenv's packet made of the
+// 'k' fragments in 'frags', with the checksum and segmentation
+// offloads in the first one's flags.  If those need a different
+// context from the card's, a context descriptor goes first.  Returns
+// the number of descriptors used, -E_E1000_TX_FULL if they are not all
+// free, or another error; either way nothing is queued.  'frags' is in
+// user memory, so each field is read just once.  The caller writes TDT.
+static int tx_fill(uint32_t tail, const struct jif_txd* frags, int k){
+
+    struct PageInfo *pp[JIF_TX_MAXFRAG];
+    void *va[JIF_TX_MAXFRAG];
+    uint32_t len[JIF_TX_MAXFRAG];
+    struct e1000_context_desc ctx;
+    uint32_t total = 0, flags = frags[0].jt_flags;
+    int popts, i, n;
+
+    for (i = 0; i < k; i++){
+        va[i] = frags[i].jt_va;
+        len[i] = frags[i].jt_len;
+        if (len[i] == 0 || PGOFF(va[i]) + len[i] > PGSIZE){
+            return -E_INVAL;
+        }
+        if ((uintptr_t) va[i] >= UTOP ||
+            (pp[i] = page_lookup(curenv->env_pgdir, va[i], NULL)) == NULL){
+            return -E_INVAL;
+        }
+        user_mem_assert(curenv, va[i], len[i], PTE_U);
+        total += len[i];
+    }
+    if (total > ((flags & JIF_TSO) ? MAX_TSO_SIZE : MAX_JUMBO_SIZE)){
+        return -E_INVAL;
+    }
+
+    if ((popts = tx_csum((uint8_t*) page2kva(pp[0]) + PGOFF(va[0]), len[0],
+                         flags, frags[0].jt_mss, total, &ctx)) < 0){
+        return popts;
+    }
+    n = popts && (!tx_ctx_valid || memcmp(&ctx, &tx_ctx, sizeof(ctx)) != 0);
+    if (!tx_free(tail, n + k)){
+        return -E_E1000_TX_FULL;
+    }
+    if (n){
+        tx_set_page(tail, NULL);
+        *(struct e1000_context_desc*) &tx_descriptors[tail] = ctx;
+        tx_ctx = ctx;
+        tx_ctx_valid = true;
+        tail = (tail + 1) % TX_DESC_NUM;
+    }
+
+    // Every descriptor reports back, so that tx_free can tell when
+    // each fragment's page is done with; only the last ends the packet.
+    // The card takes the offload options from the first.
+    for (i = 0; i < k; i++){
+        pp[i]->pp_ref++;
+        tx_set_page(tail, pp[i]);
+        tx_descriptors[tail].buffer_addr = page2pa(pp[i]) + PGOFF(va[i]);
+        tx_descriptors[tail].lower.data = len[i] | E1000_TXD_CMD_RS;
+        tx_descriptors[tail].upper.data = 0;
+        if (i == k - 1){
+            tx_descriptors[tail].lower.data |= E1000_TXD_CMD_EOP;
+        }
+        if (popts){
+            tx_descriptors[tail].lower.data |= E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_D;
+            if (i == 0){
+                tx_descriptors[tail].upper.data = popts << 8;  // POPTS
+            }
+        }
+        if (flags & JIF_TSO){
+            tx_descriptors[tail].lower.data |= E1000_TXD_CMD_TSE;
+        }
+        tail = (tail + 1) % TX_DESC_NUM;
+    }
+    return n + k;
+}
+
+// Queue as many of the packets in the 'n' fragments in 'txds' as there
+// are free descriptors for, and tell the card about all of them at
+// once.  Returns the number of fragments queued, which always make
+// whole packets, -E_E1000_TX_FULL if there was no room for any, or
+// another error if the first packet is bad.
+int e1000_tx_batch(const struct jif_txd* txds, int n){
 
-    uint32_t tx_tail = *REG(E1000_TDT);
-    uint32_t last = tx_tail - 1 > tx_tail ? TX_DESC_NUM - 1 : 0;
-    while (!(tx_descriptors[tx_tail].upper.data & E1000_TXD_STAT_DD)){
-        if (env_wait_send != NULL){
-            panic ("env_wait_send not empty");
+    uint32_t tail;
+    int i, k, r;
+
+    if (!base_address || nm_pgdir){
+        return -E_NOT_SUPP;
+    }
+    if (n <= 0 || n > TX_DESC_NUM){
+        return -E_INVAL;
+    }
+    user_mem_assert(curenv, txds, n * sizeof(txds[0]), PTE_U);
+
+    tail = *REG(E1000_TDT);
+    for (i = 0; i < n; i += k){
+        // The next packet's fragments
+        for (k = 1; i + k <= n && k <= JIF_TX_MAXFRAG; k++){
+            if (!(txds[i + k - 1].jt_flags & JIF_TX_MORE)){
+                break;
+            }
         }
-        env_wait_send = curenv;
-        curenv->env_status = ENV_NOT_RUNNABLE;
-        curenv->env_tf.tf_regs.reg_eax = 0;
-        sched_yield();
+        if (i + k > n || k > JIF_TX_MAXFRAG){
+            r = -E_INVAL;
+        } else {
+            r = tx_fill(tail, &txds[i], k);
+        }
+        if (r < 0){
+            if (i == 0 && r != -E_E1000_TX_FULL){
+                return r;
+            }
+            break;
+        }
+        tail = (tail + r) % TX_DESC_NUM;
+    }
+    if (i == 0){
+        return -E_E1000_TX_FULL;
     }
 
-    struct e1000_tx_desc* desc = tx_descriptors + tx_tail;
+    *REG(E1000_TDT) = tail;
+    return i;
+}
+
+int e1000_tx_pkg(void* buffer, uint32_t size){
 
-    struct PageInfo *pp;
-    pte_t* pte;
-    if ((pp = page_lookup(curenv->env_pgdir,buffer, &pte)) == NULL){
-        panic("e1000_tx_pkg page lookup");
+    struct jif_txd txd;
+    uint32_t tail;
+    int r;
+
+    if (!base_address || nm_pgdir){
+        return -E_NOT_SUPP;
+    }
+    txd.jt_va = buffer;
+    txd.jt_len = size;
+    txd.jt_flags = 0;
+    tail = *REG(E1000_TDT);
+    if ((r = tx_fill(tail, &txd, 1)) < 0){
+        return r;
     }
+    *REG(E1000_TDT) = (tail + r) % TX_DESC_NUM;
+    return 0;
+}
 
-    if (page_insert(curenv->env_pgdir, pp, (void*) GET_TX_BUF(tx_tail), PTE_W) < 0){
-        panic("e1000_tx_pkg page_insert not enough mem");
+// The receive ring has been found empty: interrupt the next waiter
+// again.  A packet that came in while the interrupt was masked has left
+// its cause set in ICR, so unmasking raises it at once.
+static void rx_rearm(void){
+    if (rx_polling){
+        rx_polling = false;
+        *REG(E1000_IMS) = RX_INTERRUPTS;
     }
+}
 
-    *pte |= PTE_COW;
-    *pte &= ~PTE_W;
+// What the card found checking the checksums of the packet in 'desc',
+// as JIF_CSUM_* flags.
+static uint32_t rx_csum(volatile struct e1000_rx_desc* desc){
 
-    tx_descriptors[tx_tail].lower.flags.length = size;
-    tx_descriptors[tx_tail].lower.data |= E1000_TXD_CMD_EOP;
-    tx_descriptors[tx_tail].upper.data &= ~E1000_TXD_STAT_DD;
-    tx_descriptors[tx_tail].buffer_addr = page2pa(pp) + 4;
+    uint32_t flags = 0;
 
-    *REG(E1000_TDT) = (++tx_tail) % TX_DESC_NUM;
+    if (desc->status & E1000_RXD_STAT_IXSM){
+        return 0;
+    }
+    if (desc->status & E1000_RXD_STAT_IPCS){
+        flags |= (desc->errors & E1000_RXD_ERR_IPE) ? JIF_CSUM_BAD : JIF_CSUM_IP;
+    }
+    if (desc->status & (E1000_RXD_STAT_TCPCS | E1000_RXD_STAT_UDPCS)){
+        flags |= (desc->errors & E1000_RXD_ERR_TCPE) ? JIF_CSUM_BAD : JIF_CSUM_L4;
+    }
+    return flags;
+}
+
+// Give the page of the completed receive descriptor 'index' to curenv
+// at 'va' as a struct jif_pkt, and refill the descriptor.  The refill recycles the page
+// curenv had at 'va' if nobody else holds it: its contents are
+// curenv's own, so a receiver cycling through a set of pages costs
+// neither a page_alloc nor a zeroed page.  The caller writes RDT.
+static int rx_take(uint32_t index, void* va){
 
+    volatile struct e1000_rx_desc* desc = &rx_descriptors[index];
+    struct PageInfo *pp = pa2page(desc->buffer_addr);
+    struct PageInfo *refill;
+    struct jif_pkt *pkt;
+    int r;
+
+    // Hold a reference to the refill page across page_insert, which
+    // drops curenv's.
+    if ((refill = page_lookup(curenv->env_pgdir, va, NULL)) == NULL ||
+        refill->pp_ref != 1){
+        if ((refill = page_alloc(ALLOC_ZERO)) == NULL){
+            return -E_NO_MEM;
+        }
+    }
+    refill->pp_ref++;
+
+    // The card reports on a frame in its last descriptor.
+    pkt = page2kva(pp);
+    pkt->jp_len = desc->length;
+    pkt->jp_flags = (desc->status & E1000_RXD_STAT_EOP) ? rx_csum(desc) : JIF_RX_MORE;
+    if ((r = page_insert(curenv->env_pgdir, pp, va, PTE_U | PTE_W)) < 0){
+        page_decref(refill);
+        return r;
+    }
+
+    // Receive buffers belong to their descriptor, with no references.
+    refill->pp_ref--;
+    desc->buffer_addr = page2pa(refill) + offsetof(struct jif_pkt, jp_data);
+    desc->status &= ~E1000_RXD_STAT_DD;
     return 0;
 }
 
+// Map the next received frame into curenv at the page holding 'buffer'
+// as a struct jif_pkt.  Returns its length, at most 'size', or
+// -E_INVAL if it spans more than one receive buffer (a jumbo frame):
+// such a frame is dropped, one descriptor per call, as e1000_rx_batch
+// is the way to receive it.
 int e1000_rx_pkg(void* buffer, uint32_t size){
 
-    uint32_t index = (*REG(E1000_RDT) + 1) % RX_DESC_NUM;
-    volatile struct e1000_rx_desc* desc = &rx_descriptors[index];
+    uint32_t index;
+    volatile struct e1000_rx_desc* desc;
+    uint32_t length;
+    int r;
+
+    if (!base_address || nm_pgdir){
+        return -E_NOT_SUPP;
+    }
+    index = (*REG(E1000_RDT) + 1) % RX_DESC_NUM;
+    desc = &rx_descriptors[index];
+    // Sleep until the card has a packet, then return 0 for the caller
+    // to try again.
+    if (!(desc->status & E1000_RXD_STAT_DD)){
+        rx_rearm();
+        wait_enqueue(curenv, WAIT_NET_RX);
+        wait_block(curenv, 0, 0);
+    }
+
+    if ((uintptr_t) buffer >= UTOP){
+        return -E_INVAL;
+    }
+    if (rx_dropping || !(desc->status & E1000_RXD_STAT_EOP)){
+        // Give the descriptor back to the card with its buffer.
+        rx_dropping = !(desc->status & E1000_RXD_STAT_EOP);
+        desc->status &= ~E1000_RXD_STAT_DD;
+        *REG(E1000_RDT) = index;
+        return -E_INVAL;
+    }
+    length = desc->length;
+    if ((r = rx_take(index, ROUNDDOWN(buffer, PGSIZE))) < 0){
+        return r;
+    }
+    *REG(E1000_RDT) = index;
+
+    return size < length ? size : length;
+
+}
+
+// Map up to 'n' received packets into curenv at consecutive pages from
+// 'va', each as a struct jif_pkt, and return the buffers to the card
+// with one write to RDT.  A jumbo frame takes a page for each of its
+// descriptors, and may be split between calls.  Returns the number of
+// pages, or -E_E1000_RX_EMPTY if none has arrived.
+int e1000_rx_batch(void* va, int n){
+
+    uint32_t tail, index;
+    int i, r;
+
+    if (!base_address || nm_pgdir){
+        return -E_NOT_SUPP;
+    }
+    if (PGOFF(va) || (uintptr_t) va >= UTOP || n <= 0 || n > RX_DESC_NUM ||
+        n > (UTOP - (uintptr_t) va) / PGSIZE){
+        return -E_INVAL;
+    }
+
+    tail = *REG(E1000_RDT);
+    for (i = 0; i < n; i++){
+        index = (tail + 1) % RX_DESC_NUM;
+        if (!(rx_descriptors[index].status & E1000_RXD_STAT_DD)){
+            break;
+        }
+        if ((r = rx_take(index, (char*) va + i * PGSIZE)) < 0){
+            if (i == 0){
+                return r;
+            }
+            break;
+        }
+        tail = index;
+    }
+    if (i == 0){
+        rx_rearm();
+        return -E_E1000_RX_EMPTY;
+    }
+
+    *REG(E1000_RDT) = tail;
+    return i;
+}
+
+// How far 'b' is ahead of 'a' on a ring of 'n' slots.
+static uint32_t ring_dist(uint32_t a, uint32_t b, uint32_t n){
+    return (b + n - a) % n;
+}
+
+// The physical address of pool buffer 'i'.
+static physaddr_t nm_bufpa(uint32_t i){
+    return page2pa(nm_pages[1 + i / NM_BUFS_PER_PAGE]) +
+        (i % NM_BUFS_PER_PAGE) * NETMAP_BUFSIZE;
+}
+
+// Stop the transmitter and empty its ring, dropping whatever was
+// queued, and start it again.
+static void tx_reset(void){
 
     int i;
 
-    while  (!(desc->status & E1000_RXD_STAT_DD)){
-        if (env_wait_send != NULL){
-            panic ("env_wait_receive not empty");
+    *REG(E1000_TCTL) &= ~E1000_TCTL_EN;
+    for (i = 0; i < TX_DESC_NUM; i++){
+        if (tx_pages[i] != NULL){
+            page_decref(tx_pages[i]);
+            tx_pages[i] = NULL;
         }
-        env_wait_receive = curenv;
-        curenv->env_status = ENV_NOT_RUNNABLE;
-        curenv->env_tf.tf_regs.reg_eax = 0;
-        sched_yield();
+        tx_descriptors[i].buffer_addr = 0;
+        tx_descriptors[i].lower.data = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+        tx_descriptors[i].upper.data = E1000_TXD_STAT_DD;
     }
+    tx_ctx_valid = false;
+    *REG(E1000_TDH) = 0;
+    *REG(E1000_TDT) = 0;
+    *REG(E1000_TCTL) |= E1000_TCTL_EN;
+}
+
+// Map the rings and the buffer pool into curenv at NETMAP_VA, and point
+// the card's descriptors at the pool.  Taking the card away from the
+// network server is only for the network server itself and for the
+// registered ENV_TYPE_SERVICE environment.  Only one address space at
+// a time may attach; it stays attached until it is torn down.
+int e1000_netmap_attach(void){
 
-    struct PageInfo *pp;
-    if ((pp = page_lookup(kern_pgdir,KADDR(desc->buffer_addr), NULL)) == NULL){
-        panic("e1000_rx_pkg page lookup");
+    struct PageInfo* pp;
+    int i, r;
+
+    static_assert(NETMAP_NTX == TX_DESC_NUM && NETMAP_NRX == RX_DESC_NUM);
+    static_assert(sizeof(struct netmap_if) <= PGSIZE);
+
+    if (!base_address){
+        return -E_NOT_SUPP;
+    }
+    if (curenv->env_id != services->st_envid[ENV_TYPE_NS]
+        && curenv->env_id != services->st_envid[ENV_TYPE_SERVICE]){
+        return -E_BAD_ENV;
+    }
+    if (nm_pgdir){
+        return -E_BAD_ENV;
     }
 
-    if (page_insert(curenv->env_pgdir, pp, buffer, PTE_U | PTE_W) < 0){
-        panic("e1000_rx_pkg page_insert not enough mem");
+    // We keep a reference to every page, so that the card's buffers
+    // outlive any unmapping the user does.
+    for (i = 0; i < NM_NPAGES; i++){
+        if ((pp = page_alloc(ALLOC_ZERO)) == NULL){
+            r = -E_NO_MEM;
+            goto fail;
+        }
+        pp->pp_ref++;
+        if ((r = page_insert(curenv->env_pgdir, pp, (char*) NETMAP_VA + i * PGSIZE,
+                             PTE_U | PTE_W | PTE_SHARE)) < 0){
+            page_decref(pp);
+            goto fail;
+        }
+        nm_pages[i] = pp;
     }
 
-    if ((pp = page_alloc(ALLOC_ZERO)) == 0 ){ // TODO: clean memory on error
-        panic("e1000_rx_pkg page_alloc not enough mem");
+    nm_if = page2kva(nm_pages[0]);
+    nm_if->ni_tx.nr_head = nm_txcur = 0;
+    nm_if->ni_tx.nr_tail = nm_txtail = TX_DESC_NUM - 1;
+    nm_if->ni_tx.nr_nslots = TX_DESC_NUM;
+    for (i = 0; i < TX_DESC_NUM; i++){
+        nm_if->ni_tx.nr_slot[i].ns_buf = i;
+    }
+    nm_if->ni_rx.nr_head = nm_rxcur = 0;
+    nm_if->ni_rx.nr_tail = nm_rxtail = 0;
+    nm_if->ni_rx.nr_nslots = RX_DESC_NUM;
+    for (i = 0; i < RX_DESC_NUM; i++){
+        nm_if->ni_rx.nr_slot[i].ns_buf = nm_rxbuf[i] = TX_DESC_NUM + i;
     }
 
-    desc->buffer_addr = page2pa(pp) + 4;
+    tx_reset();
 
-    desc->status &= ~E1000_RXD_STAT_DD;
-    *REG(E1000_RDT) = index;
+    // The card may fill every receive descriptor but the last.  A slot
+    // has no way to say a frame goes on in the next one, so no jumbo
+    // frames.
+    *REG(E1000_RCTL) &= ~(E1000_RCTL_EN | E1000_RCTL_LPE);
+    for (i = 0; i < RX_DESC_NUM; i++){
+        rx_saved[i] = rx_descriptors[i].buffer_addr;
+        rx_descriptors[i].buffer_addr = nm_bufpa(nm_rxbuf[i]);
+        rx_descriptors[i].status = 0;
+    }
+    *REG(E1000_RDH) = 0;
+    *REG(E1000_RDT) = RX_DESC_NUM - 1;
+    *REG(E1000_RCTL) |= E1000_RCTL_EN;
+
+    nm_pgdir = curenv->env_pgdir;
+    return 0;
+
+fail:
+    while (--i >= 0){
+        page_remove(curenv->env_pgdir, (char*) NETMAP_VA + i * PGSIZE);
+        page_decref(nm_pages[i]);
+        nm_pages[i] = NULL;
+    }
+    return r;
+}
+
+// Transmit the slots from nm_txcur up to the user's head, then give
+// back the ones the card has sent.  The slot at nm_txtail always stays
+// empty, so TDT never catches up with TDH.
+static int nm_txsync(void){
+
+    volatile struct netmap_ring* ring = &nm_if->ni_tx;
+    uint32_t head = ring->nr_head;
+    uint32_t buf, len, next;
+    int r = 0;
+
+    if (head >= TX_DESC_NUM ||
+        ring_dist(nm_txcur, head, TX_DESC_NUM) > ring_dist(nm_txcur, nm_txtail, TX_DESC_NUM)){
+        return -E_INVAL;
+    }
+
+    for (; nm_txcur != head; nm_txcur = (nm_txcur + 1) % TX_DESC_NUM){
+        buf = ring->nr_slot[nm_txcur].ns_buf;
+        len = ring->nr_slot[nm_txcur].ns_len;
+        if (buf >= NETMAP_NBUF || len == 0 || len > MAX_PKG_SIZE){
+            r = -E_INVAL;
+            break;
+        }
+        tx_descriptors[nm_txcur].buffer_addr = nm_bufpa(buf);
+        tx_descriptors[nm_txcur].lower.data = len | E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+        tx_descriptors[nm_txcur].upper.data = 0;
+    }
+    *REG(E1000_TDT) = nm_txcur;
+
+    while ((next = (nm_txtail + 1) % TX_DESC_NUM) != nm_txcur &&
+           (tx_descriptors[next].upper.data & E1000_TXD_STAT_DD)){
+        nm_txtail = next;
+    }
+    ring->nr_tail = nm_txtail;
+    return r;
+}
+
+// Give the card back the slots from nm_rxcur up to the user's head,
+// with whichever buffers the user left in them, then pass the user the
+// packets that have arrived.
+static int nm_rxsync(void){
+
+    volatile struct netmap_ring* ring = &nm_if->ni_rx;
+    uint32_t head = ring->nr_head;
+    uint32_t buf, last;
+    int r = 0;
+
+    if (head >= RX_DESC_NUM ||
+        ring_dist(nm_rxcur, head, RX_DESC_NUM) > ring_dist(nm_rxcur, nm_rxtail, RX_DESC_NUM)){
+        return -E_INVAL;
+    }
+
+    for (; nm_rxcur != head; nm_rxcur = (nm_rxcur + 1) % RX_DESC_NUM){
+        buf = ring->nr_slot[nm_rxcur].ns_buf;
+        if (buf >= NETMAP_NBUF){
+            r = -E_INVAL;
+            break;
+        }
+        nm_rxbuf[nm_rxcur] = buf;
+        rx_descriptors[nm_rxcur].buffer_addr = nm_bufpa(buf);
+        rx_descriptors[nm_rxcur].status = 0;
+    }
+    last = (nm_rxcur + RX_DESC_NUM - 1) % RX_DESC_NUM;
+    *REG(E1000_RDT) = last;
+
+    while (nm_rxtail != last && (rx_descriptors[nm_rxtail].status & E1000_RXD_STAT_DD)){
+        ring->nr_slot[nm_rxtail].ns_buf = nm_rxbuf[nm_rxtail];
+        ring->nr_slot[nm_rxtail].ns_len = rx_descriptors[nm_rxtail].length;
+        nm_rxtail = (nm_rxtail + 1) % RX_DESC_NUM;
+    }
+    ring->nr_tail = nm_rxtail;
+    return r;
+}
+
+int e1000_netmap_sync(int flags){
 
-    return size < desc->length ? size : desc->length;
+    int r;
 
+    if (!nm_pgdir || curenv->env_pgdir != nm_pgdir){
+        return -E_BAD_ENV;
+    }
+    if (flags & ~(NETMAP_TX | NETMAP_RX)){
+        return -E_INVAL;
+    }
+    if ((flags & NETMAP_TX) && (r = nm_txsync()) < 0){
+        return r;
+    }
+    if ((flags & NETMAP_RX) && (r = nm_rxsync()) < 0){
+        return r;
+    }
+    return 0;
+}
+
+// Called as 'e' tears down its address space: if that is the attached
+// one, put the card back in page mode.
+void e1000_netmap_release(struct Env* e){
+
+    int i;
+
+    if (!nm_pgdir || e->env_pgdir != nm_pgdir){
+        return;
+    }
+
+    tx_reset();
+
+    *REG(E1000_RCTL) &= ~E1000_RCTL_EN;
+    for (i = 0; i < RX_DESC_NUM; i++){
+        rx_descriptors[i].buffer_addr = rx_saved[i];
+        rx_descriptors[i].status = 0;
+    }
+    *REG(E1000_RDH) = 1;
+    *REG(E1000_RDT) = 0;
+    *REG(E1000_RCTL) |= E1000_RCTL_EN | E1000_RCTL_LPE;
+
+    for (i = 0; i < NM_NPAGES; i++){
+        page_decref(nm_pages[i]);
+        nm_pages[i] = NULL;
+    }
+    nm_if = NULL;
+    nm_pgdir = NULL;
+}
+
+// Is there a received packet waiting to be picked up?  If not, the
+// caller is about to sleep until there is, so rearm the interrupt.
+bool e1000_rx_ready(void){
+    bool ready;
+
+    if (!base_address){
+        return false;
+    }
+    if (nm_pgdir){
+        ready = nm_rxtail != (nm_rxcur + RX_DESC_NUM - 1) % RX_DESC_NUM &&
+            (rx_descriptors[nm_rxtail].status & E1000_RXD_STAT_DD);
+    } else {
+        uint32_t index = (*REG(E1000_RDT) + 1) % RX_DESC_NUM;
+        ready = rx_descriptors[index].status & E1000_RXD_STAT_DD;
+    }
+    if (!ready){
+        rx_rearm();
+    }
+    return ready;
+}
+
+// Is there a free transmit descriptor?  In netmap mode, has the card
+// sent something that sys_netmap_sync has yet to give back?
+bool e1000_tx_ready(void){
+    if (!base_address){
+        return false;
+    }
+    if (nm_pgdir){
+        uint32_t next = (nm_txtail + 1) % TX_DESC_NUM;
+        return next != nm_txcur && (tx_descriptors[next].upper.data & E1000_TXD_STAT_DD);
+    }
+    return tx_free(*REG(E1000_TDT), 1);
 }
 
 void e1000_interrupt_handler(){
@@ -229,16 +843,16 @@ void e1000_interrupt_handler(){
 
     uint32_t cause = *REG(E1000_ICR);
 
-    if (cause & E1000_ICR_TXDW){
-        if (env_wait_send != NULL){
-            env_wait_send->env_status = ENV_RUNNABLE;
-            env_wait_send = NULL;
-        }
+    if (cause & (E1000_ICR_TXDW | E1000_ICR_TXQE)){
+        wait_signal(WAIT_NET_TX);
     }
 
-    if ((cause & E1000_ICR_RXT0) && env_wait_receive != NULL) {
-        env_wait_receive->env_status = ENV_RUNNABLE;
-        env_wait_receive = NULL;
+    // Wake the receivers, and leave them to poll the ring dry before
+    // taking another receive interrupt.
+    if (cause & (E1000_ICR_RXT0 | E1000_ICR_RXO)){
+        rx_polling = true;
+        *REG(E1000_IMC) = RX_INTERRUPTS;
+        wait_signal(WAIT_NET_RX);
     }
 }
 
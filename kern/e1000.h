@@ -3,9 +3,19 @@
 
 #include <kern/pci.h>
 
+struct jif_txd;
+struct Env;
+
 int e1000_attach(struct pci_func *e1000);
 int e1000_tx_pkg(void* buffer, uint32_t size);
+int e1000_tx_batch(const struct jif_txd* txds, int n);
 int e1000_rx_pkg(void* buffer, uint32_t size);
+int e1000_rx_batch(void* va, int n);
+int e1000_netmap_attach(void);
+int e1000_netmap_sync(int flags);
+void e1000_netmap_release(struct Env* e);
+bool e1000_rx_ready(void);
+bool e1000_tx_ready(void);
 int e1000_get_irq();
 void e1000_interrupt_handler();
 uint64_t e1000_get_mac_address();
@@ -252,6 +262,8 @@ uint64_t e1000_get_mac_address();
 #define E1000_ICRXDMTC 0x04120  /* Interrupt Cause Rx Descriptor Minimum Threshold Count */
 #define E1000_ICRXOC   0x04124  /* Interrupt Cause Receiver Overrun Count */
 #define E1000_RXCSUM   0x05000  /* RX Checksum Control - RW */
+#define E1000_RXCSUM_IPOFL 0x00000100 /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL 0x00000200 /* TCP / UDP checksum offload */
 #define E1000_RFCTL    0x05008  /* Receive Filter Control*/
 #define E1000_MTA      0x05200  /* Multicast Table Array - RW Array */
 #define E1000_RA       0x05400  /* Receive Address - RW Array */
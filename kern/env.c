@@ -14,8 +14,13 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/wait.h>
+#include <kern/fpu.h>
+#include <kern/exec.h>
+#include <kern/e1000.h>
 
 struct Env *envs = NULL;		// All environments
+struct ServiceTable *services = NULL;	// Service registry
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
@@ -36,7 +41,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[NCPU + 6] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -53,6 +58,10 @@ struct Segdesc gdt[NCPU + 5] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
+	// 0x28 - user read-only segment based at the running environment's
+	// struct Env, set up by env_run() and loaded into GS
+	[GD_UENV >> 3] = SEG_NULL,
+
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL
@@ -241,6 +250,17 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_affinity = -1;
+	e->env_thread = false;
+	e->env_xstacktop = UXSTACKTOP;
+	memset(e->env_exec, 0, sizeof(e->env_exec));
+	e->env_exec_pager = 0;
+	e->env_exec_ino = 0;
+	e->env_pagein_va = 0;
+	e->env_pagein_queued = false;
+	e->env_syscall_restart = false;
+	e->env_fpu_cpu = -1;
+	e->env_fpu_used = false;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -281,6 +301,31 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	return 0;
 }
 
+//
+// Allocates a new thread of environment 'proc': an environment like
+// env_alloc's, but sharing proc's address space instead of having its
+// own.  The page directory's reference count counts its users.
+//
+// Returns 0 on success, < 0 on failure (see env_alloc).
+//
+int
+env_alloc_thread(struct Env **newenv_store, struct Env *proc)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, proc->env_id)) < 0)
+		return r;
+
+	page_decref(pa2page(PADDR(e->env_pgdir)));
+	e->env_pgdir = proc->env_pgdir;
+	pa2page(PADDR(e->env_pgdir))->pp_ref++;
+	e->env_thread = true;
+
+	*newenv_store = e;
+	return 0;
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -410,6 +455,43 @@ load_icode(struct Env *e, uint8_t *binary)
     lcr3(PADDR(kern_pgdir));
 }
 
+//
+// Record 'e' in the service registry as the provider of its env_type,
+// unless another live environment already provides that type.
+//
+void
+service_register(struct Env *e)
+{
+	if (e->env_type == ENV_TYPE_USER || services->st_envid[e->env_type])
+		return;
+	services->st_envid[e->env_type] = e->env_id;
+}
+
+//
+// 'e' is being freed.  If it was the registered provider of its
+// env_type, hand the entry over to another live environment of the
+// same type, or clear it.  This scan only runs when a special
+// environment exits, so lookups never have to scan envs[].
+//
+static void
+service_unregister(struct Env *e)
+{
+	int i;
+
+	if (e->env_type == ENV_TYPE_USER
+	    || services->st_envid[e->env_type] != e->env_id)
+		return;
+
+	services->st_envid[e->env_type] = 0;
+	for (i = 0; i < NENV; i++)
+		if (&envs[i] != e && envs[i].env_type == e->env_type
+		    && envs[i].env_status != ENV_FREE
+		    && envs[i].env_status != ENV_DYING) {
+			services->st_envid[e->env_type] = envs[i].env_id;
+			break;
+		}
+}
+
 //
 // Allocates a new env with env_alloc, loads the named elf
 // binary into it with load_icode, and sets its env_type.
@@ -427,6 +509,7 @@ env_create(uint8_t *binary, enum EnvType type)
     }
     load_icode(new_env, binary);
     new_env->env_type = type;
+    service_register(new_env);
 
     // If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
     // LAB 5: Your code here.
@@ -452,9 +535,28 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// A dying environment must not stay on any wait queue,
+	// nor keep advertising its service, nor have its FPU state
+	// saved for it.
+	wait_cancel(e);
+	exec_cancel(e);
+	service_unregister(e);
+	fpu_free(e);
+
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Threads share one address space; only the last one to go
+	// tears it down.
+	if (pa2page(PADDR(e->env_pgdir))->pp_ref > 1) {
+		page_decref(pa2page(PADDR(e->env_pgdir)));
+		e->env_pgdir = 0;
+		goto free_env;
+	}
+
+	// The card may still be using the netmap pool mapped here.
+	e1000_netmap_release(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -483,6 +585,7 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+free_env:
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
@@ -490,24 +593,40 @@ env_free(struct Env *e)
 }
 
 //
-// Frees environment e.
-// If e was the current env, then runs a new environment (and does not return
-// to the caller).
+// Frees environment e.  If e is the main environment of a threaded
+// program, frees all its threads too.
+// If e or one of its threads was the current env, then runs a new
+// environment (and does not return to the caller).
 //
 void
 env_destroy(struct Env *e)
 {
+	struct Env *t, *self = NULL;
+
+	// The calling thread, if it is one of e's, goes last.
+	if (!e->env_thread && e->env_pgdir
+	    && pa2page(PADDR(e->env_pgdir))->pp_ref > 1)
+		for (t = envs; t < envs + NENV; t++) {
+			if (t == e || t->env_pgdir != e->env_pgdir
+			    || t->env_status == ENV_DYING)
+				continue;
+			if (t == curenv)
+				self = t;
+			else
+				env_destroy(t);
+		}
+
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
+	if (e->env_status == ENV_RUNNING && curenv != e)
 		e->env_status = ENV_DYING;
-		return;
-	}
-
-	env_free(e);
+	else
+		env_free(e);
 
-	if (curenv == e) {
+	if (self)
+		env_free(self);
+	if (curenv == e || self) {
 		curenv = NULL;
 		sched_yield();
 	}
@@ -573,12 +692,33 @@ env_run(struct Env *e)
     if (context_switch){
         curenv->env_status = ENV_RUNNABLE;
     }
+    if (curenv && curenv != e){
+        fpu_leave(curenv);
+    }
 
     curenv = e;
     e->env_status = ENV_RUNNING;
     e->env_runs++;
-    lcr3(PADDR(e->env_pgdir));
 
+    // Switching between threads of one program keeps the TLB, unless
+    // another CPU asked us to flush it.
+    if (thiscpu->cpu_tlbflush || rcr3() != PADDR(e->env_pgdir)) {
+        thiscpu->cpu_tlbflush = false;
+        lcr3(PADDR(e->env_pgdir));
+    }
+
+    // Base GS at e's own struct Env, so that every thread sharing an
+    // address space can tell who it is (see thisenv in inc/lib.h).
+    // The descriptor is cached in GS when it is loaded, so one GDT
+    // entry serves all CPUs.  Its limit counts bytes (SEG16 has byte
+    // granularity), so GS reaches no further than e's own struct Env.
+    gdt[GD_UENV >> 3] = SEG16(0, UENVS + ENVX(e->env_id) * sizeof(struct Env),
+                              sizeof(struct Env) - 1, 3);
+    asm volatile("movw %%ax,%%gs" :: "a" (GD_UENV | 3));
+
+    fpu_switch(e);
+
+    thiscpu->cpu_in_user = true;
     unlock_kernel();
     env_pop_tf(&e->env_tf);
 
@@ -7,15 +7,18 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern struct ServiceTable *services;	// Service registry
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
+int	env_alloc_thread(struct Env **e, struct Env *proc);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	service_register(struct Env *e);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
@@ -0,0 +1,381 @@
+// Demand-paged program images.
+//
+// A program spawned from a file gets none of its pages up front: its
+// loadable segments are recorded as file-backed regions in struct Env
+// and each page is brought in on first touch.  Pages holding no file
+// data are zero-filled on the spot.  The others are requested from the
+// file server, which answers with sys_exec_pagein and the page of its
+// block cache holding the data.  Read-only pages are mapped straight
+// from that cache, so every running instance of a program shares one
+// copy of its text; writable pages get a private copy.
+//
+// The faulting environment sleeps until the file server answers and then
+// retries the faulting instruction.  If the file server is busy, the
+// environment sleeps on a queue instead, and its request is delivered
+// as soon as the server next waits for a message.  A fault taken by the
+// kernel on behalf of a system call (see user_mem_check) restarts the
+// system call; only calls that have had no effect yet are restarted.
+//
+// Shared text pages are also remembered in a small image cache keyed by
+// file identity, so that a program that ran before finds its text there
+// instead of asking the file server for every page.  The identity comes
+// with each of the file server's answers, never from the spawner's
+// memory, so nobody can plant pages under another file's name: a fresh
+// environment learns it with its first page-in, at which point all of
+// its text in the cache is mapped at once.  The file server invalidates
+// a file's entries before it frees any of the file's blocks.
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/fs.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/wait.h>
+#include <kern/exec.h>
+
+#define EXEC_CACHE_SIZE		256
+#define EXEC_CACHE_HASH(ino, off) \
+	(((ino) / sizeof(struct File) + (off) / PGSIZE) % EXEC_CACHE_SIZE)
+
+// Environments waiting for their busy file server to receive their
+// FSREQ_PAGEIN, oldest first.
+static struct Env *exec_waiting;
+
+// Direct-mapped image cache; each entry holds a reference to its page.
+static struct ExecPage {
+	uint32_t ep_ino;		// File identity
+	off_t ep_offset;		// Page-aligned offset in the file
+	struct PageInfo *ep_page;	// The page, or NULL if unused
+} exec_cache[EXEC_CACHE_SIZE];
+
+static struct PageInfo *
+exec_cache_lookup(uint32_t ino, off_t offset)
+{
+	struct ExecPage *ep = &exec_cache[EXEC_CACHE_HASH(ino, offset)];
+
+	if (ep->ep_page && ep->ep_ino == ino && ep->ep_offset == offset)
+		return ep->ep_page;
+	return NULL;
+}
+
+static void
+exec_cache_insert(uint32_t ino, off_t offset, struct PageInfo *pp)
+{
+	struct ExecPage *ep = &exec_cache[EXEC_CACHE_HASH(ino, offset)];
+
+	pp->pp_ref++;
+	if (ep->ep_page)
+		page_decref(ep->ep_page);
+	ep->ep_ino = ino;
+	ep->ep_offset = offset;
+	ep->ep_page = pp;
+}
+
+// Return the region of 'e' containing the page at 'va', or NULL.
+static struct ExecRegion *
+exec_region(struct Env *e, uintptr_t va)
+{
+	struct ExecRegion *r;
+
+	for (r = e->env_exec; r < e->env_exec + NEXECREGION; r++)
+		if (r->er_end && va >= ROUNDDOWN(r->er_va, PGSIZE)
+		    && va < ROUNDUP(r->er_end, PGSIZE))
+			return r;
+	return NULL;
+}
+
+// File offset of the page at 'pgva' in region 'r'.
+static off_t
+exec_offset(struct ExecRegion *r, uintptr_t pgva)
+{
+	return r->er_offset - PGOFF(r->er_va)
+		+ (pgva - ROUNDDOWN(r->er_va, PGSIZE));
+}
+
+// Whether the page at 'pgva' of region 'r' is shared with the file
+// server's cache: it is read-only and all of it comes from the file.
+static bool
+exec_shared(struct ExecRegion *r, uintptr_t pgva)
+{
+	return !(r->er_perm & PTE_W) && MIN(pgva + PGSIZE, r->er_end) <= r->er_filend;
+}
+
+// Map every page of e's shared text that is in the image cache, so that
+// 'e' does not have to fault them in.
+// Returns 0 on success, < 0 on error.
+static int
+exec_map_cached(struct Env *e)
+{
+	struct ExecRegion *r;
+	struct PageInfo *pp;
+	uintptr_t pgva;
+	int err;
+
+	if (!e->env_exec_ino)
+		return 0;
+
+	for (r = e->env_exec; r < e->env_exec + NEXECREGION; r++) {
+		if (!r->er_end)
+			continue;
+		for (pgva = ROUNDDOWN(r->er_va, PGSIZE); pgva < r->er_end;
+		     pgva += PGSIZE) {
+			if (!exec_shared(r, pgva)
+			    || !(pp = exec_cache_lookup(e->env_exec_ino,
+							exec_offset(r, pgva))))
+				continue;
+			if ((err = page_insert(e->env_pgdir, pp, (void *) pgva,
+					       r->er_perm)) < 0)
+				return err;
+		}
+	}
+	return 0;
+}
+
+// Send the file server an FSREQ_PAGEIN for the page at 'pgva' of 'e',
+// as if 'e' had sent it with ipc_send.
+// Returns -E_IPC_NOT_RECV if the server is busy, < 0 on other errors.
+static int
+exec_request(struct Env *e, struct ExecRegion *r, uintptr_t pgva)
+{
+	struct Env *pager;
+	struct PageInfo *pp;
+	union Fsipc *req;
+	int err;
+
+	if ((err = envid2env(e->env_exec_pager, &pager, 0)) < 0)
+		return err;
+	if (!pager->env_ipc_recving || (uintptr_t) pager->env_ipc_dstva >= UTOP)
+		return -E_IPC_NOT_RECV;
+
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+		return -E_NO_MEM;
+	req = (union Fsipc *) page2kva(pp);
+	req->pagein.req_fileid = e->env_exec_fileid;
+	req->pagein.req_offset = exec_offset(r, pgva);
+	if ((err = page_insert(pager->env_pgdir, pp, pager->env_ipc_dstva,
+			       PTE_P | PTE_U | PTE_W)) < 0) {
+		page_free(pp);
+		return err;
+	}
+
+	pager->env_ipc_from = e->env_id;
+	pager->env_ipc_value = FSREQ_PAGEIN;
+	pager->env_ipc_perm = PTE_P | PTE_U | PTE_W;
+	wait_wakeup(pager, WAIT_IPC);
+	return 0;
+}
+
+// Handle a fault of 'e' (which must be curenv) on the missing page at
+// 'va'.  Returns -E_FAULT if 'va' is not in a file-backed region, and 0
+// once a page past the file data has been zero-filled.  Otherwise does
+// not return: 'e' sleeps until the file server delivers the page, then
+// retries.  An environment whose page cannot be brought in is destroyed.
+int
+exec_fault(struct Env *e, uintptr_t va)
+{
+	struct ExecRegion *r;
+	struct PageInfo *pp;
+	uintptr_t pgva = ROUNDDOWN(va, PGSIZE);
+	int err;
+
+	assert(e == curenv);
+
+	if ((r = exec_region(e, pgva)) == NULL)
+		return -E_FAULT;
+
+	if (MAX(pgva, r->er_va) >= r->er_filend) {
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
+			err = -E_NO_MEM;
+			goto fail;
+		}
+		if ((err = page_insert(e->env_pgdir, pp, (void *) pgva,
+				       r->er_perm)) < 0) {
+			page_free(pp);
+			goto fail;
+		}
+		return 0;
+	}
+
+	if (e->env_exec_ino && exec_shared(r, pgva)
+	    && (pp = exec_cache_lookup(e->env_exec_ino, exec_offset(r, pgva)))) {
+		if ((err = page_insert(e->env_pgdir, pp, (void *) pgva,
+				       r->er_perm)) < 0)
+			goto fail;
+		return 0;
+	}
+
+	// Back up over the 'int $T_SYSCALL' so the system call runs again.
+	if (e->env_tf.tf_trapno == T_SYSCALL)
+		e->env_tf.tf_eip -= 2;
+
+	if ((err = exec_request(e, r, pgva)) == -E_IPC_NOT_RECV) {
+		// Wait behind anyone else the file server owes an answer.
+		struct Env **pp;
+
+		for (pp = &exec_waiting; *pp; pp = &(*pp)->env_pagein_link)
+			;
+		*pp = e;
+		e->env_pagein_link = NULL;
+		e->env_pagein_queued = true;
+	} else if (err < 0)
+		goto fail;
+	e->env_pagein_va = pgva;
+	e->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+
+fail:
+	cprintf("[%08x] page-in of va %08x failed: %e\n", e->env_id, va, err);
+	env_destroy(e);
+	return err;
+}
+
+// Take 'e' off the queue of environments waiting for a busy file server.
+void
+exec_cancel(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_pagein_queued)
+		return;
+	for (pp = &exec_waiting; *pp != e; pp = &(*pp)->env_pagein_link)
+		assert(*pp);
+	*pp = e->env_pagein_link;
+	e->env_pagein_queued = false;
+}
+
+// 'pager' (which must be curenv) is about to wait for an IPC message.
+// If an environment is queued for its attention, deliver that one's
+// page-in request now and return true: the caller then returns to
+// 'pager' at once, as if the message had just arrived.
+bool
+exec_recv(struct Env *pager)
+{
+	struct Env *e;
+	int err;
+
+	assert(pager == curenv);
+
+	if ((uintptr_t) pager->env_ipc_dstva >= UTOP)
+		return false;
+	for (e = exec_waiting; e; e = e->env_pagein_link)
+		if (e->env_exec_pager == pager->env_id)
+			break;
+	if (!e)
+		return false;
+
+	exec_cancel(e);
+	if ((err = exec_request(e, exec_region(e, e->env_pagein_va),
+				e->env_pagein_va)) == 0)
+		return true;
+	cprintf("[%08x] page-in of va %08x failed: %e\n", e->env_id,
+		e->env_pagein_va, err);
+	e->env_pagein_va = 0;
+	env_destroy(e);
+	return exec_recv(pager);
+}
+
+// Complete the page-in that 'e' is waiting for.  The caller must be
+// e's file server; 'result' is the file offset of the page it maps at
+// 'srcva', or < 0 if it could not read the page, in which case 'e' is
+// destroyed.  'ino' is the identity of the file, under which shared
+// text is cached.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if 'e' is not waiting for a page from the caller, or
+//		'result' is not the offset it is waiting for (a stale reply).
+//	-E_INVAL if srcva is not a page-aligned address mapped below UTOP.
+int
+exec_pagein(struct Env *e, int32_t result, void *srcva, uint32_t ino)
+{
+	struct ExecRegion *r;
+	struct PageInfo *src, *pp;
+	uintptr_t pgva = e->env_pagein_va, lo, hi;
+	int err;
+
+	if (!pgva || e->env_pagein_queued || curenv->env_id != e->env_exec_pager)
+		return -E_INVAL;
+	r = exec_region(e, pgva);
+	assert(r);
+
+	if (result < 0) {
+		err = result;
+		goto fail;
+	}
+	if (result != exec_offset(r, pgva))
+		return -E_INVAL;
+	if ((uintptr_t) srcva >= UTOP || PGOFF(srcva)
+	    || (src = page_lookup(curenv->env_pgdir, srcva, NULL)) == NULL)
+		return -E_INVAL;
+
+	if (exec_shared(r, pgva)) {
+		pp = src;
+		if (ino && (!e->env_exec_ino || e->env_exec_ino == ino))
+			exec_cache_insert(ino, result, pp);
+	} else {
+		if ((pp = page_alloc(0)) == NULL) {
+			err = -E_NO_MEM;
+			goto fail;
+		}
+		lo = MAX(pgva, r->er_va);
+		hi = MIN(pgva + PGSIZE, r->er_filend);
+		if (lo == pgva && hi == pgva + PGSIZE)
+			page_copy(page2kva(pp), page2kva(src));
+		else {
+			page_zero(page2kva(pp));
+			memcpy(page2kva(pp) + (lo - pgva),
+			       page2kva(src) + (lo - pgva), hi - lo);
+		}
+	}
+
+	if ((err = page_insert(e->env_pgdir, pp, (void *) pgva, r->er_perm)) < 0) {
+		if (pp != src)
+			page_free(pp);
+		goto fail;
+	}
+
+	// First answer: map the rest of the text the cache already has.
+	if (ino && !e->env_exec_ino) {
+		e->env_exec_ino = ino;
+		if ((err = exec_map_cached(e)) < 0)
+			goto fail;
+	}
+
+	e->env_pagein_va = 0;
+	if (e->env_status == ENV_NOT_RUNNABLE)
+		e->env_status = ENV_RUNNABLE;
+	return 0;
+
+fail:
+	e->env_pagein_va = 0;
+	cprintf("[%08x] page-in of va %08x failed: %e\n", e->env_id, pgva, err);
+	env_destroy(e);
+	return 0;
+}
+
+// Drop every image cache entry of the file 'ino'.
+void
+exec_invalidate(uint32_t ino)
+{
+	struct ExecPage *ep;
+
+	for (ep = exec_cache; ep < exec_cache + EXEC_CACHE_SIZE; ep++)
+		if (ep->ep_page && ep->ep_ino == ino) {
+			page_decref(ep->ep_page);
+			ep->ep_page = NULL;
+		}
+}
+
+// Give 'child' the file-backed regions of 'parent', so that it faults in
+// the pages that were still missing when it was forked.
+void
+exec_fork(struct Env *child, struct Env *parent)
+{
+	memcpy(child->env_exec, parent->env_exec, sizeof(child->env_exec));
+	child->env_exec_pager = parent->env_exec_pager;
+	child->env_exec_fileid = parent->env_exec_fileid;
+	child->env_exec_ino = parent->env_exec_ino;
+}
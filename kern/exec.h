@@ -0,0 +1,18 @@
+#ifndef JOS_KERN_EXEC_H
+#define JOS_KERN_EXEC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+int	exec_fault(struct Env *e, uintptr_t va);
+bool	exec_recv(struct Env *pager);
+void	exec_cancel(struct Env *e);
+int	exec_pagein(struct Env *e, int32_t result, void *srcva, uint32_t ino);
+void	exec_invalidate(uint32_t ino);
+void	exec_fork(struct Env *child, struct Env *parent);
+
+#endif	// !JOS_KERN_EXEC_H
@@ -0,0 +1,149 @@
+// Lazy switching of the environments' x87 and SSE registers.
+//
+// User environments may use SSE (lib/string.c does, when the CPU has
+// SSE2); the kernel never does.  Saving and restoring the 512-byte
+// FXSAVE area on every switch would tax every environment, so instead
+// env_run sets CR0.TS unless the environment's own state is already in
+// this CPU's registers.  Its first FPU or SSE instruction then traps
+// with T_DEVICE, and only then is its state loaded.
+//
+// An environment's state stays in the registers, unsaved, across traps
+// and switches until it has to go: when another environment on the
+// CPU takes the FPU (fpu_trap), or when the environment leaves the CPU
+// and another CPU may pick it up next (fpu_leave, only on machines with
+// more than one).  env_fpu_cpu records which CPU loaded it last: a CPU
+// whose cpu_fpu_env still points at the environment only trusts its
+// registers if that is itself.
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/fpu.h>
+
+#define CPUID_FXSR	(1 << 24)
+#define CPUID_SSE	(1 << 25)
+#define MXCSR_DEFAULT	0x1F80		// All SIMD exceptions masked
+
+static bool fpu_enabled;
+
+// Enable FXSAVE and SSE on this CPU, if it has them, and start with no
+// environment's state loaded.
+void
+fpu_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if ((edx & (CPUID_FXSR | CPUID_SSE)) != (CPUID_FXSR | CPUID_SSE))
+		return;
+
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_TS);
+	thiscpu->cpu_fpu_env = NULL;
+	fpu_enabled = true;
+}
+
+// Whether the registers of this CPU hold the state of 'e'.
+static bool
+fpu_live(struct Env *e)
+{
+	return e && thiscpu->cpu_fpu_env == e && e->env_fpu_cpu == cpunum();
+}
+
+// Handle T_DEVICE from 'e', which must be curenv: save the state of the
+// environment that had the FPU last, load e's, or a fresh one if it
+// never used the FPU, and let it continue.
+void
+fpu_trap(struct Env *e)
+{
+	struct Env *owner = thiscpu->cpu_fpu_env;
+	uint32_t mxcsr = MXCSR_DEFAULT;
+
+	if (!fpu_enabled) {
+		cprintf("[%08x] FPU not available\n", e->env_id);
+		env_destroy(e);
+		return;
+	}
+
+	asm volatile("clts");
+	if (owner != e && fpu_live(owner))
+		asm volatile("fxsave %0" : "=m" (owner->env_fpu));
+	if (e->env_fpu_used)
+		asm volatile("fxrstor %0" : : "m" (e->env_fpu));
+	else {
+		asm volatile("fninit; ldmxcsr %0" : : "m" (mxcsr));
+		e->env_fpu_used = true;
+	}
+	e->env_fpu_cpu = cpunum();
+	thiscpu->cpu_fpu_env = e;
+}
+
+// Save the registers of 'e' into struct Env if they are live on this
+// CPU.  They stay live.
+void
+fpu_save(struct Env *e)
+{
+	uint32_t cr0;
+
+	if (!fpu_live(e))
+		return;
+	cr0 = rcr0();
+	if (cr0 & CR0_TS)
+		asm volatile("clts");
+	asm volatile("fxsave %0" : "=m" (e->env_fpu));
+	if (cr0 & CR0_TS)
+		lcr0(cr0);
+}
+
+// This CPU is switching away from 'e'.  If another CPU may run it next,
+// save its registers for that CPU to load.  (Even an environment pinned
+// here may be moved by sys_env_set_affinity before it runs again.)
+void
+fpu_leave(struct Env *e)
+{
+	if (ncpu > 1)
+		fpu_save(e);
+}
+
+// 'e' is being freed: no CPU may save into its struct Env any more.
+void
+fpu_free(struct Env *e)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_fpu_env == e)
+			cpus[i].cpu_fpu_env = NULL;
+}
+
+// Set up CR0.TS for running 'e' on this CPU.
+void
+fpu_switch(struct Env *e)
+{
+	bool live;
+	uint32_t cr0;
+
+	if (!fpu_enabled)
+		return;
+
+	live = thiscpu->cpu_fpu_env == e && e->env_fpu_cpu == cpunum();
+	cr0 = rcr0();
+	if (live && (cr0 & CR0_TS))
+		asm volatile("clts");
+	else if (!live && !(cr0 & CR0_TS))
+		lcr0(cr0 | CR0_TS);
+}
+
+// Give a forked 'child' a copy of its parent's registers, which must be
+// curenv.
+void
+fpu_fork(struct Env *child, struct Env *parent)
+{
+	fpu_save(parent);
+	child->env_fpu_used = parent->env_fpu_used;
+	if (parent->env_fpu_used)
+		memcpy(child->env_fpu, parent->env_fpu, sizeof(child->env_fpu));
+}
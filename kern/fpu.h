@@ -0,0 +1,17 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+struct Env;
+
+void	fpu_init_percpu(void);
+void	fpu_trap(struct Env *e);
+void	fpu_save(struct Env *e);
+void	fpu_leave(struct Env *e);
+void	fpu_free(struct Env *e);
+void	fpu_switch(struct Env *e);
+void	fpu_fork(struct Env *child, struct Env *parent);
+
+#endif	// !JOS_KERN_FPU_H
@@ -0,0 +1,140 @@
+// Futexes: block an environment until a word of user memory changes.
+//
+// A waiter is keyed by the physical address of the word it sleeps on,
+// not by its virtual address, so environments that share a page
+// (PTE_SHARE mappings, pipes, IPC'd pages) can wait and wake each
+// other no matter where each of them has the page mapped.
+//
+// Waiters are kept in a small hash table of singly linked lists threaded
+// through struct Env.  Each list is kept in FIFO order so wakeups are
+// handed out in the order the environments went to sleep.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/futex.h>
+#include <kern/wait.h>
+
+#define FUTEX_HASH_SIZE		64
+#define FUTEX_HASH(pa)		(((pa) >> 2) % FUTEX_HASH_SIZE)
+
+static struct Env *futex_queue[FUTEX_HASH_SIZE];
+
+// Translate the user address 'uaddr' in e's address space to the
+// physical address used as the futex key.
+static int
+futex_key(struct Env *e, uint32_t *uaddr, physaddr_t *key)
+{
+	struct PageInfo *pp;
+
+	if ((uintptr_t) uaddr >= UTOP || ((uintptr_t) uaddr & 3))
+		return -E_INVAL;
+	if (user_mem_check(e, uaddr, sizeof(uint32_t), PTE_U) < 0)
+		return -E_FAULT;
+	if ((pp = page_lookup(e->env_pgdir, uaddr, NULL)) == NULL)
+		return -E_FAULT;
+
+	*key = page2pa(pp) + PGOFF(uaddr);
+	return 0;
+}
+
+// Remove 'e' from its futex queue, if it is on one.
+static void
+futex_dequeue(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_futex_key)
+		return;
+
+	for (pp = &futex_queue[FUTEX_HASH(e->env_futex_key)]; *pp;
+	     pp = &(*pp)->env_futex_link)
+		if (*pp == e) {
+			*pp = e->env_futex_link;
+			break;
+		}
+
+	e->env_futex_key = 0;
+	e->env_futex_link = NULL;
+}
+
+// Queue 'e' on the futex at 'uaddr', provided the word there still
+// holds 'val'.  The caller then blocks with wait_block().
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if uaddr >= UTOP or is not 4-byte aligned.
+//	-E_FAULT if uaddr is not mapped user-readable.
+//	-E_AGAIN if the word at uaddr does not equal val.
+int
+futex_enqueue(struct Env *e, uint32_t *uaddr, uint32_t val)
+{
+	physaddr_t key;
+	struct Env **pp;
+	int r;
+
+	if ((r = futex_key(e, uaddr, &key)) < 0)
+		return r;
+
+	// The big kernel lock orders this check against every wakeup, so a
+	// store followed by futex_wake cannot slip in between.
+	if (*(volatile uint32_t *) KADDR(key) != val)
+		return -E_AGAIN;
+
+	futex_dequeue(e);
+	for (pp = &futex_queue[FUTEX_HASH(key)]; *pp; pp = &(*pp)->env_futex_link)
+		/* walk to the tail */;
+	*pp = e;
+	e->env_futex_key = key;
+	e->env_futex_link = NULL;
+	return 0;
+}
+
+// Block 'e' (which must be curenv) until another environment wakes the
+// futex at 'uaddr', provided the word there still holds 'val'.
+// If 'timeout' is nonzero, give up after that many milliseconds.
+//
+// Does not return on success; the system call returns 0 when woken
+// and -E_TIMEOUT when the deadline passes first.
+// Return < 0 on error (see futex_enqueue).
+int
+futex_wait(struct Env *e, uint32_t *uaddr, uint32_t val, unsigned timeout)
+{
+	int r;
+
+	if ((r = futex_enqueue(e, uaddr, val)) < 0)
+		return r;
+	wait_block(e, 0, timeout);
+}
+
+// Wake up to 'n' environments sleeping on the futex at 'uaddr' in e's
+// address space, oldest first.
+// Returns the number of environments woken, or < 0 on error
+// (see futex_wait).
+int
+futex_wake(struct Env *e, uint32_t *uaddr, int n)
+{
+	physaddr_t key;
+	struct Env *w, *next;
+	int r, woken = 0;
+
+	if ((r = futex_key(e, uaddr, &key)) < 0)
+		return r;
+
+	for (w = futex_queue[FUTEX_HASH(key)]; w && woken < n; w = next) {
+		next = w->env_futex_link;
+		if (w->env_futex_key != key)
+			continue;
+		wait_wakeup(w, WAIT_FUTEX);
+		woken++;
+	}
+	return woken;
+}
+
+// Forget any futex wait of 'e'.
+void
+futex_cancel(struct Env *e)
+{
+	futex_dequeue(e);
+}
@@ -180,3 +180,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the single CPU 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/exec.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -83,6 +84,7 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void tlb_shootdown(pde_t *pgdir);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -189,6 +191,12 @@ mem_init(void)
 	envs = boot_alloc(evn_size);
     memset(envs,0,evn_size);
 
+	// The service registry shares the UENVS slot with 'envs'.
+	static_assert(NENV * sizeof(struct Env) <= USERVICES - UENVS);
+	static_assert(sizeof(struct ServiceTable) <= PGSIZE);
+	services = boot_alloc(PGSIZE);
+	memset(services, 0, PGSIZE);
+
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -227,6 +235,9 @@ mem_init(void)
 	uint32_t evn_size_rounded = ROUNDUP_PGSIZE(evn_size);
     boot_map_region(kern_pgdir, UENVS, evn_size_rounded, PADDR(envs), PTE_U | PTE_P);
 
+	// Map the service registry read-only by the user at USERVICES.
+	boot_map_region(kern_pgdir, USERVICES, PGSIZE, PADDR(services), PTE_U | PTE_P);
+
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
 	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -445,7 +456,7 @@ page_alloc(int alloc_flags)
     result->pp_link = NULL;
 
     if (alloc_flags & ALLOC_ZERO){
-        memset(page2kva(result),0,PGSIZE);
+        page_zero(page2kva(result));
     }
 
 	// Fill this function in
@@ -701,6 +712,51 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	tlb_shootdown(pgdir);
+}
+
+// Make every other CPU running an environment with address space
+// 'pgdir' -- another thread of the same program -- flush its TLB.
+//
+// A CPU in user mode is interrupted and waited for.  A CPU in the
+// kernel is waiting for the big kernel lock, which we hold, and flushes
+// in tlb_flush_pending() before it touches user memory again.
+static void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c, *self = thiscpu;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == self || !c->cpu_env || c->cpu_env->env_pgdir != pgdir)
+			continue;
+		c->cpu_tlbflush = true;
+		if (!c->cpu_in_user)
+			continue;
+		lapic_ipi_cpu(c->cpu_id, T_TLBFLUSH);
+		while (c->cpu_tlbflush && c->cpu_in_user)
+			asm volatile("pause");
+	}
+}
+
+// Flush this CPU's TLB if another CPU asked us to.
+void
+tlb_flush_pending(void)
+{
+	if (thiscpu->cpu_tlbflush) {
+		thiscpu->cpu_tlbflush = false;
+		lcr3(rcr3());
+	}
+}
+
+// Handle a T_TLBFLUSH IPI that interrupted 'tf' and go straight back.
+void
+tlb_flush_ipi(struct Trapframe *tf)
+{
+	tlb_flush_pending();
+	lapic_eoi();
+	if ((tf->tf_cs & 3) == 3)
+		thiscpu->cpu_in_user = true;
+	env_pop_tf(tf);
 }
 
 //
@@ -784,6 +840,17 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
 	for (iter = (char*)start_address; iter <= (char*)last_page_address; iter = iter + PGSIZE){
 		pte_walk = pgdir_walk(env->env_pgdir,iter,0);
+
+		// A system call touching a missing page of a demand-paged
+		// program brings it in (possibly restarting the call), if
+		// it has done nothing yet that a restart would repeat.
+		if ((uintptr_t) iter < UTOP && env == curenv
+		    && env->env_tf.tf_trapno == T_SYSCALL
+		    && env->env_syscall_restart
+		    && (pte_walk == NULL || !(*pte_walk & PTE_P))
+		    && exec_fault(env, (uintptr_t) iter) == 0)
+			pte_walk = pgdir_walk(env->env_pgdir, iter, 0);
+
 		if(((uintptr_t)iter) >= ULIM || pte_walk == NULL || !((*pte_walk)&perm)){
 			user_mem_check_addr = (uintptr_t)iter;
 
@@ -987,6 +1054,9 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check service registry
+	assert(check_va2pa(pgdir, USERVICES) == PADDR(services));
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -9,6 +9,7 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 struct Env;
+struct Trapframe;
 
 extern char bootstacktop[], bootstack[];
 
@@ -63,6 +64,8 @@ struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush_pending(void);
+void	tlb_flush_ipi(struct Trapframe *tf) __attribute__((noreturn));
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
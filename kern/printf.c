@@ -1,25 +1,41 @@
 // Simple implementation of cprintf console output for the kernel,
-// based on printfmt() and the kernel console's cputchar().
+// based on printfmt() and the kernel console's cons_write().
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
+// Collect up to 256 characters and write them to the console at once,
+// taking the console lock once per buffer rather than per character.
+struct printbuf {
+	int idx;	// current buffer index
+	int cnt;	// total bytes printed so far
+	char buf[256];
+};
 
 static void
-putch(int ch, int *cnt)
+putch(int ch, struct printbuf *b)
 {
-	cputchar(ch);
-	*cnt++;
+	b->buf[b->idx++] = ch;
+	if (b->idx == sizeof(b->buf)) {
+		cons_write(b->buf, b->idx);
+		b->idx = 0;
+	}
+	b->cnt++;
 }
 
 int
 vcprintf(const char *fmt, va_list ap)
 {
-	int cnt = 0;
+	struct printbuf b;
 
-	vprintfmt((void*)putch, &cnt, fmt, ap);
-	return cnt;
+	b.idx = 0;
+	b.cnt = 0;
+	vprintfmt((void*)putch, &b, fmt, ap);
+	cons_write(b.buf, b.idx);
+	return b.cnt;
 }
 
 int
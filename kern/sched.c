@@ -4,9 +4,17 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/fpu.h>
 
 void sched_halt(void);
 
+// May this CPU run 'e'?
+static inline bool
+sched_may_run(struct Env *e)
+{
+	return e->env_affinity < 0 || e->env_affinity == cpunum();
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
@@ -27,6 +35,9 @@ sched_yield(void)
 	// another CPU (env_status == ENV_RUNNING). If there are
 	// no runnable environments, simply drop through to the code
 	// below to halt the cpu.
+	//
+	// Environments pinned to another CPU (env_affinity) are left
+	// for that CPU to pick up.
 
 	// LAB 4: Your code here.
 
@@ -38,13 +49,18 @@ sched_yield(void)
 
 	for( current_env_id = (env_id + 1) % NENV ; current_env_id != env_id ; current_env_id = (current_env_id + 1) % NENV){
 
-	    if (envs[current_env_id].env_status == ENV_RUNNABLE){
+	    if (envs[current_env_id].env_status == ENV_RUNNABLE &&
+	        sched_may_run(&envs[current_env_id])){
 	        env_run(&envs[current_env_id]);
 	    }
 	}
 
 	if (curenv && curenv->env_status == ENV_RUNNING){
-	    env_run(curenv);
+	    if (sched_may_run(curenv)){
+	        env_run(curenv);
+	    }
+	    // Pinned elsewhere: leave it for its own CPU.
+	    curenv->env_status = ENV_RUNNABLE;
 	}
 
 	// sched_halt never returns
@@ -76,6 +92,8 @@ sched_halt(void)
 	}
 
 	// Mark that no environment is running on this CPU
+	if (curenv)
+		fpu_leave(curenv);
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
@@ -0,0 +1,334 @@
+// In-kernel process creation.
+//
+// spawn_image builds a complete child environment -- program segments,
+// argument stack, shared pages and trapframe -- from an ELF image in the
+// caller's memory, in a single system call.  The library's spawn() used
+// to do the same with sys_exofork plus several system calls per page.
+// Given the program's open file, it copies nothing: the segments become
+// file-backed regions that are demand-paged from the file server (see
+// kern/exec.c).
+//
+// The caller's other threads keep running while we work, so everything
+// the kernel acts on -- the ELF and program headers, the argument
+// pointers and strings -- is copied into kernel memory once, and only
+// the copies are checked and used.
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/elf.h>
+#include <inc/fd.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/spawn.h>
+#include <kern/exec.h>
+
+// Most program headers an image may have.
+#define SPAWN_MAXPH	16
+
+// Copy the NUL-terminated string 's', which must be readable by 'e',
+// to the 'n' bytes at 'dst'.  Returns its length (without the NUL), or
+// -E_FAULT if it is not readable, or -E_NO_MEM if it does not fit.
+static int
+spawn_strcpy(struct Env *e, const char *s, char *dst, size_t n)
+{
+	const char *p = s, *end;
+
+	while (1) {
+		if (user_mem_check(e, p, 1, PTE_U) < 0)
+			return -E_FAULT;
+		end = ROUNDDOWN(p, PGSIZE) + PGSIZE;
+		for (; p < end; p++) {
+			if ((size_t) (p - s) >= n)
+				return -E_NO_MEM;
+			if ((dst[p - s] = *p) == '\0')
+				return p - s;
+		}
+	}
+}
+
+// Copy the ELF header of the image at 'image' (of 'size' bytes) to
+// *elf and its program headers to 'ph', which has room for SPAWN_MAXPH,
+// and validate the copies.  If 'paged', the segments are not in 'image'
+// but will be paged in from the file, which needs them to sit at the
+// same page offset in the file as in memory, and to fit in struct Env's
+// regions.
+static int
+spawn_check_elf(const uint8_t *image, size_t size, bool paged,
+		struct Elf *elf, struct Proghdr *ph)
+{
+	int i, nregions = 0;
+
+	if (size < sizeof(struct Elf))
+		return -E_NOT_EXEC;
+	memcpy(elf, image, sizeof(struct Elf));
+	if (elf->e_magic != ELF_MAGIC || elf->e_phnum > SPAWN_MAXPH)
+		return -E_NOT_EXEC;
+	if (elf->e_phoff > size
+	    || elf->e_phnum > (size - elf->e_phoff) / sizeof(struct Proghdr))
+		return -E_NOT_EXEC;
+	memcpy(ph, image + elf->e_phoff, elf->e_phnum * sizeof(struct Proghdr));
+
+	for (i = 0; i < elf->e_phnum; i++) {
+		if (ph[i].p_type != ELF_PROG_LOAD)
+			continue;
+		if (ph[i].p_filesz > ph[i].p_memsz
+		    || ph[i].p_va + ph[i].p_memsz < ph[i].p_va
+		    || ph[i].p_va + ph[i].p_memsz > USTACKTOP - PGSIZE)
+			return -E_NOT_EXEC;
+		if (paged) {
+			if (PGOFF(ph[i].p_offset) != PGOFF(ph[i].p_va)
+			    || (int32_t) ph[i].p_offset < 0
+			    || ++nregions > NEXECREGION)
+				return -E_NOT_EXEC;
+		} else if (ph[i].p_offset > size
+			   || ph[i].p_filesz > size - ph[i].p_offset)
+			return -E_NOT_EXEC;
+	}
+	return 0;
+}
+
+// Map the segment 'ph' of 'image' into 'child', copying its file
+// contents and zero-filling the rest.
+static int
+spawn_segment(struct Env *child, const uint8_t *image, struct Proghdr *ph)
+{
+	uintptr_t va, lo, hi;
+	uintptr_t filend = ph->p_va + ph->p_filesz;
+	struct PageInfo *pp;
+	int perm, r;
+
+	perm = PTE_P | PTE_U;
+	if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+		perm |= PTE_W;
+
+	for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < ph->p_va + ph->p_memsz;
+	     va += PGSIZE) {
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+			return -E_NO_MEM;
+
+		lo = MAX(va, ph->p_va);
+		hi = MIN(va + PGSIZE, filend);
+		if (lo < hi)
+			memcpy(page2kva(pp) + (lo - va),
+			       image + ph->p_offset + (lo - ph->p_va), hi - lo);
+
+		if ((r = page_insert(child->env_pgdir, pp, (void *) va, perm)) < 0) {
+			page_free(pp);
+			return r;
+		}
+	}
+	return 0;
+}
+
+// Record the segment 'ph' as the next free file-backed region of 'child'.
+static void
+spawn_region(struct Env *child, struct Proghdr *ph)
+{
+	struct ExecRegion *r;
+
+	for (r = child->env_exec; r->er_end; r++)
+		/* find a free region */;
+
+	r->er_va = ph->p_va;
+	r->er_filend = ph->p_va + ph->p_filesz;
+	r->er_end = ph->p_va + ph->p_memsz;
+	r->er_offset = ph->p_offset;
+	r->er_perm = PTE_P | PTE_U;
+	if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+		r->er_perm |= PTE_W;
+}
+
+// Copy the null-terminated argument array 'argv' of 'parent' into a new
+// stack page, and store the page in *pp_store and the child's initial
+// stack pointer in *esp_store.  The layout matches what lib/entry.S
+// expects: argc, then argv, then the argument array, then the strings
+// at the top of the page.  Each pointer and string is read from the
+// parent exactly once.
+static int
+spawn_args(struct Env *parent, const char **argv, struct PageInfo **pp_store,
+	   uintptr_t *esp_store)
+{
+	struct PageInfo *pp;
+	char *page, *strings, *s, *arg;
+	uintptr_t *argv_store;
+	size_t size = 0;
+	int argc, i, r;
+
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+		return -E_NO_MEM;
+	page = page2kva(pp);
+
+	// Collect the strings at the bottom of the page first.
+	for (argc = 0; ; argc++) {
+		if (user_mem_check(parent, &argv[argc], sizeof(argv[argc]), PTE_U) < 0) {
+			r = -E_FAULT;
+			goto error;
+		}
+		if ((arg = (char *) argv[argc]) == NULL)
+			break;
+		if ((r = spawn_strcpy(parent, arg, page + size, PGSIZE - size)) < 0)
+			goto error;
+		size += r + 1;
+	}
+
+	// Then move them to the top and put the pointers below them.
+	strings = page + PGSIZE - size;
+	memmove(strings, page, size);
+	argv_store = (uintptr_t *) (ROUNDDOWN(strings, 4) - 4 * (argc + 1));
+	if ((char *) (argv_store - 2) < page) {
+		r = -E_NO_MEM;
+		goto error;
+	}
+
+#define STACKVA(p) (USTACKTOP - PGSIZE + ((char *) (p) - page))
+
+	for (i = 0, s = strings; i < argc; i++, s += strlen(s) + 1)
+		argv_store[i] = STACKVA(s);
+	argv_store[argc] = 0;
+	argv_store[-1] = STACKVA(argv_store);
+	argv_store[-2] = argc;
+	memset(page, 0, (char *) (argv_store - 2) - page);
+	*esp_store = STACKVA(&argv_store[-2]);
+
+#undef STACKVA
+
+	*pp_store = pp;
+	return 0;
+
+error:
+	page_free(pp);
+	return r;
+}
+
+// Share every PTE_SHARE page of 'parent' (file descriptors, pipes, ...)
+// with 'child' at the same address, as the library's fork and spawn do.
+// Neither the descriptor 'fd' of the program being spawned nor the
+// parent's own program file at UEXECFD is passed on.
+static int
+spawn_copy_shared(struct Env *parent, struct Env *child, const struct Fd *fd)
+{
+	uint32_t pdeno, pteno;
+	uintptr_t va;
+	pte_t *pt;
+	int r;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(parent->env_pgdir[pdeno] & PTE_P))
+			continue;
+		pt = (pte_t *) KADDR(PTE_ADDR(parent->env_pgdir[pdeno]));
+		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+			va = (uintptr_t) PGADDR(pdeno, pteno, 0);
+			if ((pt[pteno] & (PTE_P | PTE_SHARE)) != (PTE_P | PTE_SHARE)
+			    || va == UXSTACKTOP - PGSIZE
+			    || va == (uintptr_t) UEXECFD || va == (uintptr_t) fd)
+				continue;
+			if ((r = page_insert(child->env_pgdir,
+					     pa2page(PTE_ADDR(pt[pteno])),
+					     (void *) va, pt[pteno] & PTE_SYSCALL)) < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+// Make 'child' demand-page its segments from the file open on 'fd', a
+// file server descriptor page of 'parent'.  The child keeps the page
+// mapped at UEXECFD, which keeps the file open on the server.
+static int
+spawn_pager(struct Env *parent, struct Env *child, const struct Fd *fd)
+{
+	struct PageInfo *pp;
+	int r;
+
+	if ((pp = page_lookup(parent->env_pgdir, (void *) fd, NULL)) == NULL)
+		return -E_FAULT;
+	if ((r = page_insert(child->env_pgdir, pp, UEXECFD,
+			     PTE_P | PTE_U | PTE_SHARE)) < 0)
+		return r;
+
+	child->env_exec_pager = services->st_envid[ENV_TYPE_FS];
+	child->env_exec_fileid = fd->fd_file.id;
+	return 0;
+}
+
+// Create a runnable child of 'parent' (which must be curenv) running
+// the ELF image at user address 'image' of 'size' bytes, with the
+// null-terminated argument array 'argv'.
+//
+// If 'fd' is not NULL, it is parent's open descriptor for the program
+// file, and 'image' only needs to hold the ELF and program headers: the
+// child's segments are paged in from the file server on demand.
+//
+// Returns the child's envid on success, < 0 on error.  Errors are:
+//	-E_FAULT if image, argv or fd is not readable by the parent.
+//	-E_INVAL if fd is not page-aligned.
+//	-E_BAD_ENV if fd is given but no file server is running.
+//	-E_NOT_EXEC if image is not a valid ELF executable.
+//	-E_NO_MEM if the arguments do not fit in one stack page, or on
+//		memory exhaustion.
+//	-E_NO_FREE_ENV if no free environment is available.
+envid_t
+spawn_image(struct Env *parent, const void *image, size_t size,
+	    const char **argv, const struct Fd *fd)
+{
+	struct Env *child;
+	struct Elf elf;
+	struct Proghdr ph[SPAWN_MAXPH];
+	struct PageInfo *stack;
+	uintptr_t esp;
+	int i, r;
+
+	assert(parent == curenv);
+
+	if (user_mem_check(parent, image, size, PTE_U) < 0)
+		return -E_FAULT;
+	if (fd) {
+		if (PGOFF(fd))
+			return -E_INVAL;
+		if (user_mem_check(parent, fd, sizeof(*fd), PTE_U) < 0)
+			return -E_FAULT;
+		if (!services->st_envid[ENV_TYPE_FS])
+			return -E_BAD_ENV;
+	}
+	if ((r = spawn_check_elf(image, size, fd != NULL, &elf, ph)) < 0)
+		return r;
+	if ((r = spawn_args(parent, argv, &stack, &esp)) < 0)
+		return r;
+
+	if ((r = env_alloc(&child, parent->env_id)) < 0) {
+		page_free(stack);
+		return r;
+	}
+	child->env_status = ENV_NOT_RUNNABLE;
+
+	// From here on the child's page directory owns the stack page.
+	if ((r = page_insert(child->env_pgdir, stack, (void *) (USTACKTOP - PGSIZE),
+			     PTE_P | PTE_U | PTE_W)) < 0) {
+		page_free(stack);
+		goto error;
+	}
+	child->env_tf.tf_esp = esp;
+
+	for (i = 0; i < elf.e_phnum; i++) {
+		if (ph[i].p_type != ELF_PROG_LOAD)
+			continue;
+		if (fd)
+			spawn_region(child, &ph[i]);
+		else if ((r = spawn_segment(child, image, &ph[i])) < 0)
+			goto error;
+	}
+	if (fd && (r = spawn_pager(parent, child, fd)) < 0)
+		goto error;
+	if ((r = spawn_copy_shared(parent, child, fd)) < 0)
+		goto error;
+
+	child->env_tf.tf_eip = elf.e_entry;
+	child->env_status = ENV_RUNNABLE;
+	return child->env_id;
+
+error:
+	env_free(child);
+	return r;
+}
@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_SPAWN_H
+#define JOS_KERN_SPAWN_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+struct Fd;
+
+envid_t	spawn_image(struct Env *parent, const void *image, size_t size,
+		    const char **argv, const struct Fd *fd);
+
+#endif	// !JOS_KERN_SPAWN_H
@@ -13,6 +13,12 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/futex.h>
+#include <kern/wait.h>
+#include <kern/spawn.h>
+#include <kern/exec.h>
+#include <kern/fpu.h>
+#include <kern/spinlock.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -20,14 +26,35 @@
 static void
 sys_cputs(const char *s, size_t len)
 {
+	char buf[256];
+	size_t n;
+
 	// Check that the user has permission to read memory [s, s+len).
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
 	user_mem_assert(curenv, s, len, PTE_U);
-
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// From here on the call has effects, so it must not be restarted.
+	curenv->env_syscall_restart = false;
+
+	// Print the string supplied by the user a piece at a time, copied
+	// out so that the devices can be driven without the big kernel
+	// lock.  Once we give up the lock, another thread may unmap the
+	// string, so check each piece again.
+	for (; len > 0; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		tlb_flush_pending();
+		user_mem_assert(curenv, s, n, PTE_U);
+		memcpy(buf, s, n);
+
+		unlock_kernel();
+		cons_write(buf, n);
+		lock_kernel();
+
+		// Another CPU may have destroyed us in the meantime.
+		if (curenv->env_status == ENV_DYING)
+			env_destroy(curenv);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -91,6 +118,8 @@ sys_exofork(void)
     env->env_status = ENV_NOT_RUNNABLE;
     env->env_tf = curenv->env_tf;
     env->env_tf.tf_regs.reg_eax = 0;
+    exec_fork(env, curenv);
+    fpu_fork(env, curenv);
     return env->env_id;
 }
 
@@ -359,6 +388,99 @@ sys_page_unmap(envid_t envid, void *va)
 
 }
 
+// Check a range of 'npages' pages at 'va' for the range calls below.
+static int
+page_range_check(void *va, size_t npages)
+{
+	if ((uintptr_t) va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	if (npages == 0 || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	return 0;
+}
+
+// Like sys_page_alloc, but for the 'npages' consecutive pages starting
+// at 'va', in one system call.  Either all the pages are mapped or, on
+// error, the address space is left as it was: the pages and page tables
+// are all allocated before any existing mapping is replaced.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, or the range is empty or
+//		reaches past UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no memory to allocate the pages,
+//		or to allocate any necessary page tables.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	struct Env *env;
+	struct PageInfo *pp, *list = NULL;
+	size_t i;
+	int r;
+
+	if ((r = envid2env(envid, &env, true)) < 0)
+		return r;
+	if ((r = page_range_check(va, npages)) < 0)
+		return r;
+	if (perm & ~((int) PTE_SYSCALL))
+		return -E_INVAL;
+
+	for (i = 0; i < npages; i++) {
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+			goto nomem;
+		pp->pp_link = list;
+		list = pp;
+	}
+	for (i = 0; i < npages; i += NPTENTRIES - PTX((uint8_t *) va + i * PGSIZE))
+		if (!pgdir_walk(env->env_pgdir, (uint8_t *) va + i * PGSIZE, 1))
+			goto nomem;
+
+	// Nothing can fail from here on.
+	for (i = 0; i < npages; i++) {
+		pp = list;
+		list = pp->pp_link;
+		pp->pp_link = NULL;
+		r = page_insert(env->env_pgdir, pp, (uint8_t *) va + i * PGSIZE,
+				perm | PTE_U);
+		assert(r == 0);
+	}
+	return 0;
+
+nomem:
+	while ((pp = list) != NULL) {
+		list = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+	return -E_NO_MEM;
+}
+
+// Like sys_page_unmap, for the 'npages' consecutive pages at 'va'.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, or the range is empty or
+//		reaches past UTOP.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	struct Env *env;
+	size_t i;
+	int r;
+
+	if ((r = envid2env(envid, &env, true)) < 0)
+		return r;
+	if ((r = page_range_check(va, npages)) < 0)
+		return r;
+
+	for (i = 0; i < npages; i++)
+		page_remove(env->env_pgdir, (uint8_t *) va + i * PGSIZE);
+	return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -375,8 +497,8 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_value is set to the 'value' parameter;
 //    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
 // The target environment is marked runnable again, returning 0
-// from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
+// from the paused sys_ipc_recv system call (or WAIT_IPC from sys_wait).
+// (Hint: does the sys_ipc_recv function ever actually return?)
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
@@ -412,7 +534,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     }
 
     // Check if need to copy page
-    if ((uintptr_t) srcva < UTOP ){
+    if ((uintptr_t) srcva < UTOP && (uintptr_t) env->env_ipc_dstva < UTOP){
 
         if (((uintptr_t) srcva) % PGSIZE){
             return -E_INVAL;
@@ -437,11 +559,10 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
         }
     }
 
-    env->env_status = ENV_RUNNABLE;
-    env->env_ipc_recving = false;
     env->env_ipc_from = curenv->env_id;
     env->env_ipc_value = value;
-    env->env_ipc_perm = perm;
+    env->env_ipc_perm = (uintptr_t) srcva < UTOP && (uintptr_t) env->env_ipc_dstva < UTOP ? perm : 0;
+    wait_wakeup(env, WAIT_IPC);
 
     return 0;
 }
@@ -453,37 +574,27 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If 'timeout' is nonzero, give up after that many milliseconds.
+//
 // This function only returns on error, but the system call will eventually
-// return 0 on success.
+// return 0 on success, or -E_TIMEOUT if the timeout expired first.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, unsigned timeout)
 {
-    curenv->env_ipc_recving = true;
-
-    int eid1 = curenv->env_id;
-
 	// LAB 4: Your code here.
-    if ((uintptr_t) dstva < UTOP){
-
-        if ((uintptr_t) dstva % PGSIZE){
-            return -E_INVAL;
-        }
-
-        curenv->env_ipc_dstva = dstva;
+    if ((uintptr_t) dstva < UTOP && (uintptr_t) dstva % PGSIZE){
+        return -E_INVAL;
     }
 
-    curenv->env_status = ENV_NOT_RUNNABLE;
-
-    //TODO remove
-    int x = curenv->env_ipc_value;
+    curenv->env_ipc_recving = true;
+    curenv->env_ipc_dstva = dstva;
+    if (exec_recv(curenv))
+        return 0;
 
     // We don't return, but still need to have a success indication
-    curenv->env_tf.tf_regs.reg_eax = 0;
-    sched_yield();
-    panic("sys_ipc_recv");
-    return 0;
+    wait_block(curenv, 0, timeout);
 }
 
 // Return the current time.
@@ -499,26 +610,268 @@ sys_tx_pkg(void* buffer, uint32_t size){
     return e1000_tx_pkg(buffer, size);
 }
 
+// Queue the packets made of up to 'n' fragments described by 'txds' for
+// transmission.  Returns how many fragments were queued, or
+// -E_E1000_TX_FULL if no packet fit.
+static int
+sys_tx_batch(const struct jif_txd* txds, int n){
+    return e1000_tx_batch(txds, n);
+}
+
+// Map the next received frame at the page holding 'buffer'.  Returns
+// its length, or -E_INVAL for a frame too big for one page, which is
+// dropped (see e1000_rx_pkg).
 static int
 sys_rx_pkg(void* buffer, uint32_t size){
     return e1000_rx_pkg(buffer, size);
 }
 
+// Map up to 'n' received packets at consecutive pages from 'va'.
+// Returns how many, or -E_E1000_RX_EMPTY if there are none.
+static int
+sys_rx_batch(void* va, int n){
+    return e1000_rx_batch(va, n);
+}
+
+// Switch the card to netmap mode, with its rings and buffers mapped
+// into curenv at NETMAP_VA (see inc/ns.h).  Only the network server
+// and the registered service environment may.
+static int
+sys_netmap_attach(void){
+    return e1000_netmap_attach();
+}
+
+// Pass the slots curenv has released on the rings named by 'flags' to
+// the card, and collect the ones it has finished with.
+static int
+sys_netmap_sync(int flags){
+    return e1000_netmap_sync(flags);
+}
+
 static int
 sys_set_service(){
     curenv->env_type = ENV_TYPE_SERVICE;
+    service_register(curenv);
     return 0;
 }
 
+// Create a new, runnable child environment running the ELF executable
+// 'image' (of 'size' bytes in the caller's memory) with the
+// null-terminated argument array 'argv'.  The child gets its program
+// segments, argument stack and the caller's PTE_SHARE pages, all built
+// by the kernel in this one call.
+//
+// If 'fd' is not NULL, it is the caller's open file descriptor for the
+// program, and 'image' need only hold the ELF and program headers: the
+// child's segments are then demand-paged from the file server.
+//
+// Returns the child's envid, < 0 on error (see spawn_image).
+static envid_t
+sys_spawn(const void *image, size_t size, const char **argv,
+	  const struct Fd *fd)
+{
+	return spawn_image(curenv, image, size, argv, fd);
+}
+
+// Answer the FSREQ_PAGEIN that demand-paged environment envid sent us:
+// 'result' is the file offset of the page at 'srcva', or < 0 if it
+// could not be read, and 'ino' the identity of the file.  Only the
+// environment's file server may call this.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if envid is not waiting for this page from the caller,
+//		or srcva is not a page-aligned address mapped below UTOP.
+static int
+sys_exec_pagein(envid_t envid, int32_t result, void *srcva, uint32_t ino)
+{
+	struct Env *env;
+	int r;
+
+	if ((r = envid2env(envid, &env, 0)) < 0)
+		return r;
+	return exec_pagein(env, result, srcva, ino);
+}
+
+// Forget the cached program pages of the file 'ino', whose blocks the
+// caller is about to free.  Only the file server may call this.
+//
+// Returns 0 on success, -E_BAD_ENV if the caller is not the file server.
+static int
+sys_exec_invalidate(uint32_t ino)
+{
+	if (curenv->env_id != services->st_envid[ENV_TYPE_FS])
+		return -E_BAD_ENV;
+	exec_invalidate(ino);
+	return 0;
+}
+
+// Create a new thread of the current environment: a runnable
+// environment sharing curenv's address space, page fault upcall and
+// program image, which starts at 'eip' with stack pointer 'esp' and has
+// its own exception stack below 'xstacktop'.  Threads are scheduled on
+// their own, so several may run at once on different CPUs.
+//
+// Returns the thread's envid, < 0 on error.  Errors are:
+//	-E_INVAL if eip, esp or xstacktop is above UTOP, or xstacktop is
+//		not page-aligned.
+//	-E_NO_FREE_ENV if no free environment is available.
+static envid_t
+sys_thread_create(void *eip, void *esp, void *xstacktop)
+{
+	struct Env *env;
+	int r;
+
+	if ((uintptr_t) eip >= UTOP || (uintptr_t) esp > UTOP
+	    || (uintptr_t) xstacktop > UTOP || PGOFF(xstacktop))
+		return -E_INVAL;
+
+	if ((r = env_alloc_thread(&env, curenv)) < 0)
+		return r;
+
+	env->env_type = curenv->env_type;
+	env->env_tf.tf_eflags |= curenv->env_tf.tf_eflags & FL_IOPL_MASK;
+	env->env_tf.tf_eip = (uintptr_t) eip;
+	env->env_tf.tf_esp = (uintptr_t) esp;
+	env->env_xstacktop = (uintptr_t) xstacktop;
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	exec_fork(env, curenv);
+	return env->env_id;
+}
+
+// Pin envid to CPU 'cpu', so that only that CPU will run it, or let
+// any CPU run it again if 'cpu' is -1.  The change takes effect the
+// next time the environment is scheduled.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpu is neither -1 nor a valid CPU number.
+static int
+sys_env_set_affinity(envid_t envid, int cpu)
+{
+	struct Env *env;
+	int r;
+
+	if ((r = envid2env(envid, &env, true)) < 0)
+		return r;
+	if (cpu < -1 || cpu >= ncpu)
+		return -E_INVAL;
+
+	env->env_affinity = cpu;
+	return 0;
+}
+
+// Look up the environment providing the special environment 'type'.
+// Returns its envid, 0 if there is none, or -E_INVAL if 'type' is not
+// a special environment type.  The same information is mapped
+// read-only at USERVICES for lookups that need no system call.
+static envid_t
+sys_service_lookup(int type)
+{
+	if (type <= ENV_TYPE_USER || type >= NENVTYPE)
+		return -E_INVAL;
+	return services->st_envid[type];
+}
+
 static int sys_get_mac_address(uint64_t *mac){
 	*mac = e1000_get_mac_address();
 	return 0;
 }
 
+// Block until the futex at 'uaddr' is woken, provided the 32-bit word
+// there still equals 'val'.  A nonzero 'timeout' bounds the wait in
+// milliseconds.  Futexes are keyed by physical address, so they work
+// across PTE_SHARE mappings of the same page.
+//
+// Does not return on success; the system call returns 0 when woken.
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if uaddr >= UTOP or is not 4-byte aligned.
+//	-E_FAULT if uaddr is not mapped user-readable.
+//	-E_AGAIN if *uaddr != val.
+//	-E_TIMEOUT if the timeout expired before a wakeup.
+static int
+sys_futex_wait(uint32_t *uaddr, uint32_t val, unsigned timeout)
+{
+	return futex_wait(curenv, uaddr, val, timeout);
+}
+
+// Wake up to 'n' environments waiting on the futex at 'uaddr'.
+// Returns the number of environments woken, < 0 on error
+// (see sys_futex_wait).
+static int
+sys_futex_wake(uint32_t *uaddr, int n)
+{
+	if (n < 0)
+		return -E_INVAL;
+	return futex_wake(curenv, uaddr, n);
+}
+
+// Block until any of the WAIT_* sources in 'events' fires:
+//	WAIT_IPC	an IPC message arrives, as with sys_ipc_recv(dstva).
+//	WAIT_FUTEX	the futex at 'uaddr' is woken or no longer equals 'val'.
+//	WAIT_NET_RX	the network card has received packets.
+//	WAIT_NET_TX	the network card has free transmit descriptors.
+// A nonzero 'timeout' bounds the wait in milliseconds.
+//
+// Sources that are already ready are reported without blocking.
+// Returns the WAIT_* bit that fired, -E_TIMEOUT if the timeout expired
+// first, or < 0 on error.  Errors are:
+//	-E_INVAL if events is empty or has unknown bits.
+//	-E_INVAL if WAIT_IPC is set and dstva < UTOP is not page-aligned.
+//	Any error of sys_futex_wait other than -E_AGAIN.
+static int
+sys_wait(uint32_t events, uint32_t *uaddr, uint32_t val, void *dstva,
+	 unsigned timeout)
+{
+	int r;
+
+	if (events == 0 || (events & ~WAIT_ALL))
+		return -E_INVAL;
+	if ((events & WAIT_IPC) && (uintptr_t) dstva < UTOP && PGOFF(dstva))
+		return -E_INVAL;
+
+	if ((events & WAIT_NET_RX) && e1000_rx_ready())
+		return WAIT_NET_RX;
+	if ((events & WAIT_NET_TX) && e1000_tx_ready())
+		return WAIT_NET_TX;
+	if (events & WAIT_FUTEX) {
+		if ((r = futex_enqueue(curenv, uaddr, val)) == -E_AGAIN)
+			return WAIT_FUTEX;
+		if (r < 0)
+			return r;
+	}
+	if (events & WAIT_IPC) {
+		curenv->env_ipc_recving = true;
+		curenv->env_ipc_dstva = dstva;
+		if (exec_recv(curenv))
+			return WAIT_IPC;
+	}
+
+	wait_block(curenv, events, timeout);
+}
+
+// System calls that check all the user memory they use before doing
+// anything else, so that bringing in a missing page of a demand-paged
+// program may restart them (see user_mem_check).  Any other call simply
+// fails on such a page.
+static const bool syscall_restartable[NSYSCALLS] = {
+	[SYS_cputs] = true,
+	[SYS_env_set_trapframe] = true,
+	[SYS_futex_wait] = true,
+	[SYS_futex_wake] = true,
+	[SYS_wait] = true,
+	[SYS_spawn] = true,
+	[SYS_tx_batch] = true,
+};
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
+	curenv->env_syscall_restart = syscallno < NSYSCALLS
+		&& syscall_restartable[syscallno];
+
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
 	// LAB 3: Your code here.
@@ -567,7 +920,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             return sys_ipc_try_send(a1,a2,(void*)a3,a4);
 
         case SYS_ipc_recv:
-            return sys_ipc_recv((void*) a1);
+            return sys_ipc_recv((void*) a1, a2);
 
         case SYS_time_msec:
             return sys_time_msec();
@@ -575,6 +928,18 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_tx_pkg:
             return sys_tx_pkg((void*) a1, a2);
 
+        case SYS_tx_batch:
+            return sys_tx_batch((const struct jif_txd*) a1, a2);
+
+        case SYS_rx_batch:
+            return sys_rx_batch((void*) a1, a2);
+
+        case SYS_netmap_attach:
+            return sys_netmap_attach();
+
+        case SYS_netmap_sync:
+            return sys_netmap_sync(a1);
+
         case SYS_rx_pkg:
             return sys_rx_pkg((void*) a1, a2);
 
@@ -584,6 +949,40 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_get_mac_address:
 			return sys_get_mac_address((uint64_t *) a1);
 
+        case SYS_futex_wait:
+            return sys_futex_wait((uint32_t *) a1, a2, a3);
+
+        case SYS_futex_wake:
+            return sys_futex_wake((uint32_t *) a1, a2);
+
+        case SYS_spawn:
+            return sys_spawn((const void *) a1, a2, (const char **) a3,
+                             (const struct Fd *) a4);
+
+        case SYS_env_set_affinity:
+            return sys_env_set_affinity(a1, a2);
+
+        case SYS_service_lookup:
+            return sys_service_lookup(a1);
+
+        case SYS_wait:
+            return sys_wait(a1, (uint32_t *) a2, a3, (void *) a4, a5);
+
+        case SYS_exec_pagein:
+            return sys_exec_pagein(a1, a2, (void *) a3, a4);
+
+        case SYS_exec_invalidate:
+            return sys_exec_invalidate(a1);
+
+        case SYS_thread_create:
+            return sys_thread_create((void *) a1, (void *) a2, (void *) a3);
+
+        case SYS_page_alloc_range:
+            return sys_page_alloc_range(a1, (void *) a2, a3, a4);
+
+        case SYS_page_unmap_range:
+            return sys_page_unmap_range(a1, (void *) a2, a3);
+
         default:
             return -E_INVAL;
 	}
@@ -15,6 +15,9 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/wait.h>
+#include <kern/exec.h>
+#include <kern/fpu.h>
 
 static struct Taskstate ts;
 
@@ -62,6 +65,8 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_TLBFLUSH)
+		return "TLB shootdown";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
@@ -99,6 +104,7 @@ trap_init(void)
 	SETGATE(idt[T_SIMDERR], 0, GD_KT,simderr_handler, 0);
 
 	SETGATE(idt[T_SYSCALL], 0, GD_KT,syscall_handler, 3);
+	SETGATE(idt[T_TLBFLUSH], 0, GD_KT, tlbflush_handler, 0);
 	
 	SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, timer_handler, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_KBD], 0, GD_KT, kbd_handler, 0);
@@ -164,6 +170,8 @@ trap_init_percpu(void)
 	// bottom three bits are special; we leave them 0)
 	ltr(GD_TSS0 + (cpu_id << 3));
 
+	fpu_init_percpu();
+
 	// Load the IDT
 	lidt(&idt_pd);
 }
@@ -241,6 +249,12 @@ trap_dispatch(struct Trapframe *tf)
         case T_BRKPT:
             monitor(tf);
             return;
+        case T_DEVICE:
+            if ((tf->tf_cs & 3) == 3) {
+                fpu_trap(curenv);
+                return;
+            }
+            break;
         default:
             break;
     }
@@ -261,6 +275,7 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 	        if (bootcpu->cpu_id == thiscpu->cpu_id){
 	            time_tick();
+	            wait_expire(time_msec());
 	        }
 	        lapic_eoi();
 	        sched_yield();
@@ -314,6 +329,12 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Answer TLB shootdowns without taking the big kernel lock, which
+	// the CPU asking for one holds while it waits (see tlb_invalidate).
+	thiscpu->cpu_in_user = 0;
+	if (tf->tf_trapno == T_TLBFLUSH)
+		tlb_flush_ipi(tf);
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -346,6 +367,10 @@ trap(struct Trapframe *tf)
 		tf = &curenv->env_tf;
 	}
 
+	// Another thread of curenv may have changed its mappings while we
+	// were waiting for the lock.
+	tlb_flush_pending();
+
 	// Record that tf is the last real trapframe so
 	// print_trapframe can print some additional information.
 	last_tf = tf;
@@ -382,6 +407,10 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Bring in a missing page of a demand-paged program.
+	if (!(tf->tf_err & FEC_PR) && exec_fault(curenv, fault_va) == 0)
+		env_run(curenv);
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -421,8 +450,10 @@ page_fault_handler(struct Trapframe *tf)
 	    // check that the handler is valid (read only). TODO: Not sure if needed.
 	    //user_mem_assert(curenv, curenv->env_pgfault_upcall, sizeof(uintptr_t), 0);
 
-	    bool is_exception_stack = (tf->tf_esp >= UXSTACKTOP - PGSIZE && tf->tf_esp < UXSTACKTOP);
-	    uintptr_t utf_ptr =  is_exception_stack ? tf->tf_esp - 4 : UXSTACKTOP;
+	    // Each thread has its own exception stack below env_xstacktop.
+	    uintptr_t xstacktop = curenv->env_xstacktop;
+	    bool is_exception_stack = (tf->tf_esp >= xstacktop - PGSIZE && tf->tf_esp < xstacktop);
+	    uintptr_t utf_ptr =  is_exception_stack ? tf->tf_esp - 4 : xstacktop;
 
 	    utf_ptr -=  sizeof(struct UTrapframe);
 	    struct UTrapframe* utf = (struct UTrapframe*) utf_ptr;
@@ -40,6 +40,7 @@ void align_handler ();
 void mchk_handler ();
 void simderr_handler ();
 void syscall_handler ();
+void tlbflush_handler ();
 void unknown_irq_handler();
 void timer_handler();
 void spurious_handler();
@@ -0,0 +1,162 @@
+// Blocking waits with timeouts and multiple event sources.
+//
+// An environment blocks on IPC (sys_ipc_recv), on a futex
+// (sys_futex_wait), or on any combination of those and device events
+// (sys_wait).  Whichever source fires first wakes it up and tears down
+// every other registration, so a single wakeup is ever delivered.
+// An optional deadline is checked on every timer tick.
+//
+// Waiters for a device event sit on that event's queue, threaded through
+// struct Env in FIFO order, so any number of environments may wait for
+// the same device and an interrupt touches only them.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+#include <kern/wait.h>
+
+// Number of waiters with a deadline, so that the timer tick can skip
+// the scan in the common case.
+static int wait_ntimed;
+
+// The device events with a queue, and the queues.
+static const uint32_t wait_qevent[NWAITQ] = { WAIT_NET_RX, WAIT_NET_TX };
+static struct Env *wait_queue[NWAITQ];
+
+static int
+wait_qindex(uint32_t event)
+{
+	int q;
+
+	for (q = 0; q < NWAITQ; q++)
+		if (wait_qevent[q] == event)
+			return q;
+	panic("no wait queue for event 0x%x", event);
+}
+
+// Queue 'e' for device 'event' (WAIT_NET_RX or WAIT_NET_TX).  The
+// caller then blocks with wait_block().
+void
+wait_enqueue(struct Env *e, uint32_t event)
+{
+	int q = wait_qindex(event);
+	struct Env **pp;
+
+	if (e->env_wait_queued & event)
+		return;
+	for (pp = &wait_queue[q]; *pp; pp = &(*pp)->env_wait_link[q])
+		/* walk to the tail */;
+	*pp = e;
+	e->env_wait_link[q] = NULL;
+	e->env_wait_queued |= event;
+}
+
+// Remove 'e' from every device queue it is on.
+static void
+wait_dequeue(struct Env *e)
+{
+	struct Env **pp;
+	int q;
+
+	for (q = 0; q < NWAITQ && e->env_wait_queued; q++) {
+		if (!(e->env_wait_queued & wait_qevent[q]))
+			continue;
+		for (pp = &wait_queue[q]; *pp; pp = &(*pp)->env_wait_link[q])
+			if (*pp == e) {
+				*pp = e->env_wait_link[q];
+				break;
+			}
+		e->env_wait_link[q] = NULL;
+		e->env_wait_queued &= ~wait_qevent[q];
+	}
+}
+
+// Block 'e' (which must be curenv) until it is woken up or 'timeout'
+// milliseconds pass (0 means wait forever).  'events' is the sys_wait
+// event mask, or 0 for single-source waits that return 0 when woken.
+// The caller has already registered 'e' with IPC and futex sources;
+// this queues it for the device events in 'events'.
+void
+wait_block(struct Env *e, uint32_t events, unsigned timeout)
+{
+	int q;
+
+	assert(e == curenv);
+
+	for (q = 0; q < NWAITQ; q++)
+		if (events & wait_qevent[q])
+			wait_enqueue(e, wait_qevent[q]);
+	e->env_wait_events = events;
+	if (timeout) {
+		e->env_wait_deadline = time_msec() + timeout;
+		wait_ntimed++;
+	}
+
+	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Remove every wait registration of 'e'.
+void
+wait_cancel(struct Env *e)
+{
+	futex_cancel(e);
+	wait_dequeue(e);
+	e->env_ipc_recving = false;
+	e->env_wait_events = 0;
+	if (e->env_wait_deadline) {
+		e->env_wait_deadline = 0;
+		wait_ntimed--;
+	}
+}
+
+static void
+wait_finish(struct Env *e, int32_t ret)
+{
+	wait_cancel(e);
+	if (e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_tf.tf_regs.reg_eax = ret;
+		e->env_status = ENV_RUNNABLE;
+	}
+}
+
+// Wake up 'e' because 'event' fired.  sys_wait returns the event;
+// single-source waits return 0.
+void
+wait_wakeup(struct Env *e, uint32_t event)
+{
+	wait_finish(e, e->env_wait_events ? event : 0);
+}
+
+// Wake up every environment waiting for device 'event'.  Each wakeup
+// takes its environment off the queue.
+void
+wait_signal(uint32_t event)
+{
+	int q = wait_qindex(event);
+
+	while (wait_queue[q])
+		wait_wakeup(wait_queue[q], event);
+}
+
+// Time out every waiter whose deadline is at or before 'now'.
+// Called from the timer interrupt on the boot CPU.
+void
+wait_expire(unsigned now)
+{
+	int i;
+
+	if (wait_ntimed == 0)
+		return;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_wait_deadline &&
+		    (int) (envs[i].env_wait_deadline - now) <= 0)
+			wait_finish(&envs[i], -E_TIMEOUT);
+}
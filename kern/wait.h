@@ -0,0 +1,19 @@
+#ifndef JOS_KERN_WAIT_H
+#define JOS_KERN_WAIT_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+void	wait_block(struct Env *e, uint32_t events, unsigned timeout)
+	__attribute__((noreturn));
+void	wait_enqueue(struct Env *e, uint32_t event);
+void	wait_wakeup(struct Env *e, uint32_t event);
+void	wait_signal(uint32_t event);
+void	wait_cancel(struct Env *e);
+void	wait_expire(unsigned now);
+
+#endif	// !JOS_KERN_WAIT_H
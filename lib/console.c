@@ -2,14 +2,132 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
+// Writes to the console device collect in a buffer and go to the
+// kernel in one sys_cputs per line (_IOLBF, the default), per full
+// buffer (_IOFBF), or at once (_IONBF).  cprintf goes through the same
+// buffer but flushes it before returning, so its output is never lost.
+// The buffer is flushed before reading the console, and by cflush(),
+// fork, exit and panic.  The threads of an environment share it, so
+// lines from different threads stay whole; a thread waiting for another
+// to finish sleeps on the lock's futex.  A thread that reenters while
+// it holds the lock (a page fault handler or a panic that interrupted
+// it) writes straight to the kernel instead.
+#define CONSOUTSIZE	1024
+
+static struct {
+	volatile uint32_t owner;	// Thread holding the buffer, or 0
+	volatile uint32_t waiters;	// Threads sleeping for it
+	int mode;
+	int len;
+	char buf[CONSOUTSIZE];
+} consout = { .mode = _IOLBF };
+
+// Take the buffer for the calling thread.  Returns false, without
+// taking it, if the thread already holds it.
+static bool
+consout_lock(void)
+{
+	envid_t self = thisenvid();
+	uint32_t owner;
+
+	if (consout.owner == self)
+		return false;
+	while ((owner = __sync_val_compare_and_swap(&consout.owner, 0, self)) != 0) {
+		__sync_fetch_and_add(&consout.waiters, 1);
+		sys_futex_wait(&consout.owner, owner, 0);
+		__sync_fetch_and_sub(&consout.waiters, 1);
+	}
+	return true;
+}
+
+static void
+consout_unlock(void)
+{
+	__sync_lock_release(&consout.owner);
+	if (consout.waiters)
+		sys_futex_wake(&consout.owner, 1);
+}
+
+static void
+consout_flush(void)
+{
+	if (consout.len > 0)
+		sys_cputs(consout.buf, consout.len);
+	consout.len = 0;
+}
+
+// Write 'n' bytes to the console through the buffer.
+void
+cwrite(const char *s, size_t n)
+{
+	bool newline = memfind(s, '\n', n) != s + n;
+	size_t m;
+
+	if (!consout_lock()) {
+		sys_cputs(s, n);
+		return;
+	}
+	for (; n > 0; s += m, n -= m) {
+		m = MIN(n, CONSOUTSIZE - consout.len);
+		memmove(consout.buf + consout.len, s, m);
+		consout.len += m;
+		if (consout.len == CONSOUTSIZE)
+			consout_flush();
+	}
+	if (consout.mode == _IONBF || (consout.mode == _IOLBF && newline))
+		consout_flush();
+	consout_unlock();
+}
+
+// Send any buffered console output to the kernel.
+void
+cflush(void)
+{
+	if (!consout_lock())
+		return;
+	consout_flush();
+	consout_unlock();
+}
+
+// Forget the buffer's lock and contents, which the child of fork
+// copied from its parent's threads.
+void
+creset(void)
+{
+	consout.owner = 0;
+	consout.waiters = 0;
+	consout.len = 0;
+}
+
+// Set the console buffering mode to _IONBF, _IOLBF or _IOFBF.
+int
+csetbuf(int mode)
+{
+	if (mode != _IONBF && mode != _IOLBF && mode != _IOFBF)
+		return -E_INVAL;
+	if (!consout_lock())
+		return -E_INVAL;
+	consout.mode = mode;
+	if (mode == _IONBF)
+		consout_flush();
+	consout_unlock();
+	return 0;
+}
+
 void
 cputchar(int ch)
 {
 	char c = ch;
+	bool locked = consout_lock();
 
 	// Unlike standard Unix's putchar,
-	// the cputchar function _always_ outputs to the system console.
+	// the cputchar function _always_ outputs to the system console,
+	// after anything buffered before it.
+	if (locked)
+		consout_flush();
 	sys_cputs(&c, 1);
+	if (locked)
+		consout_unlock();
 }
 
 int
@@ -18,6 +136,8 @@ getchar(void)
 	unsigned char c;
 	int r;
 
+	cflush();
+
 	// JOS does, however, support standard _input_ redirection,
 	// allowing the user to redirect script files to the shell and such.
 	// getchar() reads a character from file descriptor 0.
@@ -83,6 +203,7 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 	if (n == 0)
 		return 0;
 
+	cflush();
 	while ((c = sys_cgetc()) == 0)
 		sys_yield();
 	if (c < 0)
@@ -96,19 +217,8 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 static ssize_t
 devcons_write(struct Fd *fd, const void *vbuf, size_t n)
 {
-	int tot, m;
-	char buf[128];
-
-	// mistake: have to nul-terminate arg to sys_cputs,
-	// so we have to copy vbuf into buf in chunks and nul-terminate.
-	for (tot = 0; tot < n; tot += m) {
-		m = n - tot;
-		if (m > sizeof(buf) - 1)
-			m = sizeof(buf) - 1;
-		memmove(buf, (char*)vbuf + tot, m);
-		sys_cputs(buf, m);
-	}
-	return tot;
+	cwrite(vbuf, n);
+	return n;
 }
 
 static int
@@ -5,6 +5,7 @@ void
 exit(void)
 {
 	close_all();
+	cflush();
 	sys_env_destroy(0);
 }
 
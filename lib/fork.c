@@ -52,7 +52,7 @@ pgfault(struct UTrapframe *utf)
 
 	// move data from addr too PFTEMP
 	void* round_address = ROUNDDOWN(addr, PGSIZE);
-	memmove(PFTEMP, round_address, PGSIZE );
+	page_copy(PFTEMP, round_address);
 
 	// Allocate address (TODO: delete previous content? what if more than one reference
     if ((result = sys_page_map(0, PFTEMP, 0, round_address,  PTE_W )) < 0){
@@ -131,7 +131,6 @@ duppage(envid_t envid, unsigned pn)
 //
 // Hint:
 //   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
 //   Neither user exception stack should ever be marked copy-on-write,
 //   so you must allocate a new page for the child's user exception stack.
 //
@@ -152,15 +151,15 @@ fork(void)
     // so that the child will appear to have called sys_exofork() too -
     // except that in the child, this "fake" call to sys_exofork()
     // will return 0 instead of the envid of the child.
+    // Flush console output first, or the child would print it again.
+    cflush();
     envid = sys_exofork();
     if (envid < 0)
         panic("sys_exofork: %e", envid);
     if (envid == 0) {
-        // We're the child.
-        // The copied value of the global variable 'thisenv'
-        // is no longer valid (it refers to the parent!).
-        // Fix it and return 0.
-        thisenv = &envs[ENVX(sys_getenvid())];
+        // We're the child.  Another of the parent's threads may have
+        // held the console buffer when it was copied.
+        creset();
         return 0;
     }
 
@@ -212,14 +211,13 @@ sfork(void)
     // so that the child will appear to have called sys_exofork() too -
     // except that in the child, this "fake" call to sys_exofork()
     // will return 0 instead of the envid of the child.
+    // Flush console output first, or the child would print it again.
+    cflush();
     envid = sys_exofork();
     if (envid < 0)
         panic("sys_exofork: %e", envid);
     if (envid == 0) {
         // We're the child.
-        // The copied value of the global variable 'thisenv'
-        // is no longer valid (it refers to the parent!).
-        // Fix it and return 0.
         return 0;
     }
 
@@ -21,9 +21,18 @@
 //   a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_timeout(from_env_store, pg, perm_store, 0);
+}
+
+// Like ipc_recv, but give up with -E_TIMEOUT if nothing arrives within
+// 'timeout' milliseconds.  A timeout of 0 waits forever.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+		 unsigned timeout)
 {
 
-    int result = sys_ipc_recv(pg == NULL ? (void* )UTOP : pg);
+    int result = sys_ipc_recv(pg == NULL ? (void* )UTOP : pg, timeout);
 
     if (from_env_store){
         *from_env_store = result >= 0 ? thisenv->env_ipc_from : 0;
@@ -58,15 +67,14 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 
 }
 
-// Find the first environment of the given type.  We'll use this to
+// Find the environment providing the given special type, as recorded
+// in the kernel's read-only service registry.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
 envid_t
 ipc_find_env(enum EnvType type)
 {
-	int i;
-	for (i = 0; i < NENV; i++)
-		if (envs[i].env_type == type)
-			return envs[i].env_id;
-	return 0;
+	if (type <= ENV_TYPE_USER || type >= NENVTYPE)
+		return 0;
+	return services.st_envid[type];
 }
@@ -0,0 +1,149 @@
+// Kernel-scheduled threads.
+//
+// A thread is an environment that shares its creator's address space
+// (see sys_thread_create), so the threads of a program run in parallel
+// on different CPUs.  Thread i lives in slot i of the region starting at
+// KTHREADS, which holds, from the bottom up: an unmapped guard page, the
+// thread's stack, another guard page and its exception stack.  A slot
+// is reused, pages and all, once its thread has exited.
+//
+// Threads share everything but their registers and stacks, including
+// the file descriptor table: exit() in any thread closes every file of
+// the program.
+
+#include <inc/lib.h>
+
+#define KTHREADS		0xE0000000
+#define NKTHREAD		64
+#define KTHREAD_STKPAGES	8
+#define KTHREAD_SLOTSIZE	((KTHREAD_STKPAGES + 3) * PGSIZE)
+
+static struct KthreadSlot {
+	volatile envid_t ks_tid;	// Thread in this slot; 0 if never used,
+					// -1 while it is being set up
+	volatile uint32_t ks_done;	// Set once the thread has exited
+} kthreads[NKTHREAD];
+
+#define SLOTBASE(i)	(KTHREADS + (i) * KTHREAD_SLOTSIZE)
+#define STACKTOP(i)	(SLOTBASE(i) + (KTHREAD_STKPAGES + 1) * PGSIZE)
+#define XSTACKTOP(i)	(SLOTBASE(i) + KTHREAD_SLOTSIZE)
+
+static bool
+kthread_gone(envid_t tid)
+{
+	const volatile struct Env *e = &envs[ENVX(tid)];
+
+	return e->env_id != tid || e->env_status == ENV_FREE;
+}
+
+// Claim a free slot, returning its index, or < 0 if there is none.
+// *fresh is set if the slot's pages have never been mapped.
+static int
+kthread_slot_alloc(bool *fresh)
+{
+	envid_t tid;
+	int i;
+
+	for (i = 0; i < NKTHREAD; i++) {
+		tid = kthreads[i].ks_tid;
+		if ((tid == 0 || (tid > 0 && kthread_gone(tid)))
+		    && __sync_bool_compare_and_swap(&kthreads[i].ks_tid, tid, -1)) {
+			*fresh = (tid == 0);
+			return i;
+		}
+	}
+	return -E_NO_FREE_ENV;
+}
+
+static int
+kthread_slot_map(int i)
+{
+	uintptr_t va;
+	int r;
+
+	for (va = SLOTBASE(i) + PGSIZE; va < STACKTOP(i); va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	return sys_page_alloc(0, (void *) (XSTACKTOP(i) - PGSIZE),
+			      PTE_P|PTE_U|PTE_W);
+}
+
+// Where a new thread starts, as if called from nowhere.
+static void __attribute__((noreturn))
+kthread_start(void (*fn)(void *), void *arg)
+{
+	fn(arg);
+	kthread_exit();
+}
+
+// Start a thread running fn(arg) in our address space.
+// Returns the thread's envid, < 0 on error.
+envid_t
+kthread_create(void (*fn)(void *), void *arg)
+{
+	uint32_t *sp;
+	bool fresh;
+	envid_t tid;
+	int i, r;
+
+	if ((i = kthread_slot_alloc(&fresh)) < 0)
+		return i;
+	if (fresh && (r = kthread_slot_map(i)) < 0) {
+		kthreads[i].ks_tid = 0;
+		return r;
+	}
+
+	// kthread_start's frame: a null return address, then its arguments.
+	sp = (uint32_t *) STACKTOP(i) - 3;
+	sp[0] = 0;
+	sp[1] = (uint32_t) fn;
+	sp[2] = (uint32_t) arg;
+
+	kthreads[i].ks_done = 0;
+	if ((tid = sys_thread_create(kthread_start, sp,
+				     (void *) XSTACKTOP(i))) < 0) {
+		kthreads[i].ks_tid = 0;
+		return tid;
+	}
+	kthreads[i].ks_tid = tid;
+	return tid;
+}
+
+// End the calling thread.  Must be called on a kthread_create() stack.
+void
+kthread_exit(void)
+{
+	uintptr_t sp = (uintptr_t) &sp;
+	struct KthreadSlot *ks;
+
+	if (sp < KTHREADS || sp >= SLOTBASE(NKTHREAD))
+		panic("kthread_exit: not a thread");
+	ks = &kthreads[(sp - KTHREADS) / KTHREAD_SLOTSIZE];
+
+	malloc_thread_flush();
+	cflush();
+	ks->ks_done = 1;
+	sys_futex_wake(&ks->ks_done, NENV);
+	sys_env_destroy(0);
+	panic("kthread_exit: still running");
+}
+
+// Wait for thread 'tid' to exit.
+// Returns 0 on success, -E_INVAL if tid is not one of our threads.
+int
+kthread_join(envid_t tid)
+{
+	int i;
+
+	if (tid <= 0)
+		return -E_INVAL;
+	for (i = 0; i < NKTHREAD; i++)
+		if (kthreads[i].ks_tid == tid)
+			break;
+	if (i == NKTHREAD)
+		return -E_INVAL;
+
+	while (!kthreads[i].ks_done)
+		sys_futex_wait(&kthreads[i].ks_done, 0, 0);
+	return 0;
+}
@@ -4,7 +4,6 @@
 #include <inc/lib.h>
 #include <inc/env.h>
 
-const volatile struct Env *thisenv;
 extern void umain(int argc, char **argv);
 
 const char *binaryname = "<unknown>";
@@ -12,12 +11,6 @@ const char *binaryname = "<unknown>";
 void
 libmain(int argc, char **argv)
 {
-
-    // set thisenv to point at our Env structure in envs[].
-    // LAB 3: Your code here.
-    envid_t eid = sys_getenvid();
-    thisenv = envs + ENVX(eid);
-
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
 		binaryname = argv[0];
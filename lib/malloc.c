@@ -2,139 +2,603 @@
 #include <inc/lib.h>
 
 /*
- * Simple malloc/free.
+ * Size-class malloc/free.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * Small requests are rounded up to one of a fixed set of size
+ * classes.  Each class allocates from slabs: pages that start with a
+ * struct Slab header and are carved into equal objects, the free ones
+ * linked through their first word.  A class keeps the slabs that still
+ * have free objects on a list, so both malloc and free are O(1) and,
+ * once the heap has warmed up, make no system calls.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * A slab whose objects are all free goes back to a small cache of
+ * empty pages, shared by all classes, and is only unmapped when that
+ * cache is full.
+ *
+ * Requests too big for the largest class get a page-aligned run of
+ * whole pages of their own, mapped and unmapped with one system call
+ * each, and recorded in a side table rather than in the pages
+ * themselves.  The table starts small and is rehashed, in pages of the
+ * heap itself and doubling as needed, whenever it fills up.  Runs of a
+ * page table's worth or more are aligned to a page table boundary.
+ * Slab objects never start on a page boundary, so free can tell the two
+ * apart from the address alone.
+ *
+ * Each kernel thread also keeps a few free objects of every class in a
+ * cache of its own, indexed by its environment slot.  Small objects
+ * are handed out from and freed to that cache without taking the heap
+ * lock; the lock is only taken to move a batch of objects between the
+ * cache and the slabs.  A thread's cache is not freed when it exits,
+ * but is picked up by the next thread in the same slot.
+ *
+ * The heap lives between mbegin and mend.  New pages come from a
+ * cursor that moves through that range and wraps around, skipping
+ * pages that are still mapped.
  */
-enum
-{
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
+#define SLAB_MAGIC	0x51AB0000
+#define SLAB_HDRSIZE	32		/* sizeof(struct Slab), rounded up */
+#define NCACHEDPAGES	16		/* empty pages kept mapped */
+
+struct Slab {
+	uint32_t s_magic;
+	uint16_t s_class;		// Index into class_size
+	uint16_t s_nused;		// Objects handed out
+	void *s_free;			// Free objects
+	struct Slab *s_next;		// Link on the class's partial list
+	struct Slab *s_prev;
+};
+
+// Object sizes, all multiples of 16 chosen to waste little of a page.
+static const uint16_t class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 336, 448, 576, 800, 1008, 1344, 2032
+};
+#define NCLASS		(sizeof(class_size) / sizeof(class_size[0]))
+#define MAXSMALL	2032
+
+static uint8_t size_class[MAXSMALL / 16 + 1];	// (n + 15) / 16 -> class
+static struct Slab *partial[NCLASS];		// Slabs with free objects
+static uint8_t *cached[NCACHEDPAGES];		// Empty, still-mapped pages
+static int ncached;
+
+// Large objects, hashed by address with linear probing.
+#define NLARGE		256		/* initial table size */
+#define LARGE_DELETED	((uint8_t *) 1)
+#define LARGE_HASH(va)	(((uintptr_t) (va) >> PGSHIFT) % nlarge)
+
+struct Large {
+	uint8_t *l_va;			// 0 if never used, or LARGE_DELETED
+	size_t l_npages;
 };
 
-#define PTE_CONTINUED 0x200
+static struct Large large0[NLARGE];
+static struct Large *large = large0;
+static size_t nlarge = NLARGE;		// Table size
+static size_t nlarge_used;		// Entries that are not 0
+
+// Per-thread caches.
+#define TCACHE_MAX	32		/* objects per class per thread */
+#define TCACHE_BATCH	16		/* objects moved to or from slabs */
+
+struct Tcache {
+	void *tc_bin[NCLASS];		// Free objects of each class
+	uint16_t tc_count[NCLASS];
+	size_t tc_bytes;		// Bytes in the bins
+	uint32_t tc_nmalloc;		// Calls served from the bins
+	uint32_t tc_nfree;
+};
+
+static struct Tcache *tcaches[NENV];
+
+static struct MallocStats stats;
 
 static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
 static uint8_t *mptr;
 
-static int
-isfree(void *v, size_t n)
+static volatile uint32_t mlock;
+
+static void
+malloc_lock(void)
 {
-	uintptr_t va, end_va = (uintptr_t) v + n;
+	while (__sync_lock_test_and_set(&mlock, 1) != 0)
+		asm volatile("pause");
+}
 
-	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
-		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
-			return 0;
-	return 1;
+static void
+malloc_unlock(void)
+{
+	__sync_lock_release(&mlock);
 }
 
-void*
-malloc(size_t n)
+static void
+malloc_init(void)
 {
-	int i, cont;
-	int nwrap;
-	uint32_t *ref;
-	void *v;
+	int i, c = 0;
 
-	if (mptr == 0)
-		mptr = mbegin;
+	for (i = 0; i <= MAXSMALL / 16; i++) {
+		while (class_size[c] < i * 16)
+			c++;
+		size_class[i] = c;
+	}
+	mptr = mbegin;
+}
+
+// Find 'npages' unmapped pages in the heap, starting at a multiple of
+// 'align', and move the cursor past them.
+static uint8_t *
+range_find(size_t npages, size_t align)
+{
+	uintptr_t start, va, n = npages * PGSIZE;
+	int nwrap = 0;
+
+	start = ROUNDUP((uintptr_t) mptr, align);
+	while (1) {
+		if (start + n > (uintptr_t) mend || start + n < start) {
+			if (++nwrap == 2)
+				return 0;	/* out of address space */
+			start = ROUNDUP((uintptr_t) mbegin, align);
+			continue;
+		}
+		// Look for a mapped page in the range, skipping unmapped
+		// page tables whole.
+		for (va = start; va < start + n; ) {
+			if (!(uvpd[PDX(va)] & PTE_P))
+				va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+			else if (uvpt[PGNUM(va)] & PTE_P)
+				break;
+			else
+				va += PGSIZE;
+		}
+		if (va >= start + n)
+			break;
+		start = ROUNDUP(va + PGSIZE, align);
+	}
 
-	n = ROUNDUP(n, 4);
+	mptr = (uint8_t *) (start + n);
+	return (uint8_t *) start;
+}
+
+// Map 'npages' fresh pages at the next free run of the heap.
+static uint8_t *
+pages_alloc(size_t npages, size_t align)
+{
+	uint8_t *v;
 
-	if (n >= MAXMALLOC)
+	if ((v = range_find(npages, align)) == 0)
 		return 0;
+	stats.ms_nsyscall++;
+	if (sys_page_alloc_range(0, v, npages, PTE_P|PTE_U|PTE_W) < 0)
+		return 0;	/* out of physical memory */
+	return v;
+}
 
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
-		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
+static void
+pages_free(void *v, size_t npages)
+{
+	stats.ms_nsyscall++;
+	sys_page_unmap_range(0, v, npages);
+}
+
+// Return an empty slab page to the cache, or unmap it.
+static void
+page_release(uint8_t *pg)
+{
+	if (ncached < NCACHEDPAGES)
+		cached[ncached++] = pg;
+	else {
+		pages_free(pg, 1);
+		stats.ms_slab -= PGSIZE;
 	}
+}
 
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
-	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
+static void
+partial_remove(struct Slab *s)
+{
+	if (s->s_prev)
+		s->s_prev->s_next = s->s_next;
+	else
+		partial[s->s_class] = s->s_next;
+	if (s->s_next)
+		s->s_next->s_prev = s->s_prev;
+	s->s_next = s->s_prev = 0;
+}
+
+static void
+partial_insert(struct Slab *s)
+{
+	s->s_prev = 0;
+	s->s_next = partial[s->s_class];
+	if (s->s_next)
+		s->s_next->s_prev = s;
+	partial[s->s_class] = s;
+}
+
+// Make a new slab for class 'c' and put it on the partial list.
+static struct Slab *
+slab_new(int c)
+{
+	struct Slab *s;
+	uint8_t *pg, *obj;
+	void **link;
+
+	if (ncached > 0)
+		pg = cached[--ncached];
+	else if ((pg = pages_alloc(1, PGSIZE)) == 0)
+		return 0;
+	else
+		stats.ms_slab += PGSIZE;
+
+	s = (struct Slab *) pg;
+	s->s_magic = SLAB_MAGIC;
+	s->s_class = c;
+	s->s_nused = 0;
+
+	link = &s->s_free;
+	for (obj = pg + SLAB_HDRSIZE; obj + class_size[c] <= pg + PGSIZE;
+	     obj += class_size[c]) {
+		*link = obj;
+		link = (void **) obj;
+	}
+	*link = 0;
+
+	partial_insert(s);
+	return s;
+}
+
+static void *
+malloc_small(size_t n)
+{
+	int c = size_class[(n + 15) / 16];
+	struct Slab *s;
+	void *v;
+
+	if ((s = partial[c]) == 0 && (s = slab_new(c)) == 0)
+		return 0;
+
+	v = s->s_free;
+	s->s_free = *(void **) v;
+	s->s_nused++;
+	if (s->s_free == 0)
+		partial_remove(s);
+	stats.ms_inuse += class_size[c];
+	return v;
+}
+
+static struct Large *
+large_lookup(void *v)
+{
+	struct Large *l;
+	size_t i, h = LARGE_HASH(v);
+
+	for (i = 0; i < nlarge; i++) {
+		l = &large[(h + i) % nlarge];
+		if (l->l_va == v)
+			return l;
+		if (l->l_va == 0)
 			break;
-		mptr += PGSIZE;
-		if (mptr == mend) {
-			mptr = mbegin;
-			if (++nwrap == 2)
-				return 0;	/* out of address space */
-		}
 	}
+	return 0;
+}
+
+// A slot for a new entry for 'v'.
+static struct Large *
+large_slot(void *v)
+{
+	struct Large *l;
+	size_t i, h = LARGE_HASH(v);
+
+	for (i = 0; ; i++) {
+		l = &large[(h + i) % nlarge];
+		if (l->l_va == 0 || l->l_va == LARGE_DELETED)
+			return l;
+	}
+}
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
+// Rehash the table, dropping deleted entries, into a new one that is
+// twice as big if at least half the old one is live.
+// Returns 0 on success, < 0 if there is no memory for it.
+static int
+large_grow(void)
+{
+	struct Large *old = large;
+	size_t nold = nlarge, n, i;
+	uint8_t *v;
+
+	n = stats.ms_nlarge >= nold / 2 ? 2 * nold : nold;
+	if ((v = pages_alloc(ROUNDUP(n * sizeof(struct Large), PGSIZE) / PGSIZE,
+			     PGSIZE)) == 0)
+		return -E_NO_MEM;
+	large = (struct Large *) v;
+	nlarge = n;
+	nlarge_used = 0;
+	for (i = 0; i < nold; i++)
+		if (old[i].l_va != 0 && old[i].l_va != LARGE_DELETED) {
+			*large_slot(old[i].l_va) = old[i];
+			nlarge_used++;
 		}
+	if (old != large0)
+		pages_free(old, ROUNDUP(nold * sizeof(struct Large), PGSIZE) / PGSIZE);
+	return 0;
+}
+
+static void *
+malloc_large(size_t n)
+{
+	size_t npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+	struct Large *l;
+	uint8_t *v;
+
+	if (n > (size_t) (mend - mbegin))
+		return 0;
+	// Keep probe runs short.
+	if (nlarge_used >= nlarge * 3 / 4 && large_grow() < 0)
+		return 0;
+	if ((v = pages_alloc(npages, n >= PTSIZE ? PTSIZE : PGSIZE)) == 0)
+		return 0;
+
+	l = large_slot(v);
+	if (l->l_va == 0)
+		nlarge_used++;
+	l->l_va = v;
+	l->l_npages = npages;
+
+	stats.ms_nlarge++;
+	stats.ms_large += npages * PGSIZE;
+	stats.ms_inuse += npages * PGSIZE;
+	return v;
+}
+
+static void
+free_large(void *v)
+{
+	struct Large *l;
+
+	if ((l = large_lookup(v)) == 0)
+		panic("free: %p was not allocated", v);
+	pages_free(v, l->l_npages);
+
+	stats.ms_nlarge--;
+	stats.ms_large -= l->l_npages * PGSIZE;
+	stats.ms_inuse -= l->l_npages * PGSIZE;
+	l->l_va = LARGE_DELETED;
+}
+
+// The header of the slab holding 'v'.
+static struct Slab *
+slab_of(void *v)
+{
+	struct Slab *s;
+
+	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+	s = ROUNDDOWN((struct Slab *) v, PGSIZE);
+	assert(s->s_magic == SLAB_MAGIC);
+	return s;
+}
+
+// Bytes usable at 'v', which malloc returned.
+static size_t
+usable_size(void *v)
+{
+	struct Large *l;
+
+	if (PGOFF(v) == 0) {
+		if ((l = large_lookup(v)) == 0)
+			panic("realloc: %p was not allocated", v);
+		return l->l_npages * PGSIZE;
 	}
+	return class_size[slab_of(v)->s_class];
+}
+
+// Return the object 'v' of slab 's' to the slab.
+static void
+free_small(struct Slab *s, void *v)
+{
+	assert(s->s_nused > 0);
+	if (s->s_free == 0)
+		partial_insert(s);
+	*(void **) v = s->s_free;
+	s->s_free = v;
+	stats.ms_inuse -= class_size[s->s_class];
+	if (--s->s_nused == 0) {
+		partial_remove(s);
+		s->s_magic = 0;
+		page_release((uint8_t *) s);
+	}
+}
+
+// The calling thread's cache, created on first use.
+// Returns 0 if there is no memory for one.
+static struct Tcache *
+tcache_self(void)
+{
+	struct Tcache *tc;
+	int i = ENVX(thisenvid());
+
+	if ((tc = tcaches[i]) != 0)
+		return tc;
+
+	malloc_lock();
+	if (mptr == 0)
+		malloc_init();
+	if ((tc = malloc_small(sizeof(struct Tcache))) != 0) {
+		memset(tc, 0, sizeof(*tc));
+		tcaches[i] = tc;
+	}
+	malloc_unlock();
+	return tc;
+}
+
+// Move up to TCACHE_BATCH objects of class 'c' from the slabs to 'tc'.
+// Returns the number moved.
+static int
+tcache_fill(struct Tcache *tc, int c)
+{
+	void *v;
+	int n;
+
+	malloc_lock();
+	for (n = 0; n < TCACHE_BATCH; n++) {
+		if ((v = malloc_small(class_size[c])) == 0)
+			break;
+		*(void **) v = tc->tc_bin[c];
+		tc->tc_bin[c] = v;
+	}
+	malloc_unlock();
+
+	tc->tc_count[c] += n;
+	tc->tc_bytes += n * class_size[c];
+	return n;
+}
+
+// Move up to 'n' objects of class 'c' from 'tc' back to the slabs.
+static void
+tcache_flush(struct Tcache *tc, int c, int n)
+{
+	void *v;
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
+	malloc_lock();
+	for (; n > 0 && (v = tc->tc_bin[c]) != 0; n--) {
+		tc->tc_bin[c] = *(void **) v;
+		tc->tc_count[c]--;
+		tc->tc_bytes -= class_size[c];
+		free_small(slab_of(v), v);
+	}
+	malloc_unlock();
+}
+
+void*
+malloc(size_t n)
+{
+	struct Tcache *tc;
+	void *v;
+	int c;
+
+	if (n <= MAXSMALL && (tc = tcache_self()) != 0) {
+		c = size_class[(n + 15) / 16];
+		if (tc->tc_count[c] == 0 && tcache_fill(tc, c) == 0)
+			return 0;
+		v = tc->tc_bin[c];
+		tc->tc_bin[c] = *(void **) v;
+		tc->tc_count[c]--;
+		tc->tc_bytes -= class_size[c];
+		tc->tc_nmalloc++;
+		return v;
+	}
+
+	malloc_lock();
+	if (mptr == 0)
+		malloc_init();
+	if (n <= MAXSMALL)
+		v = malloc_small(n);
+	else
+		v = malloc_large(n);
+	if (v)
+		stats.ms_nmalloc++;
+	malloc_unlock();
 	return v;
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	struct Tcache *tc;
+	int c;
 
 	if (v == 0)
 		return;
-	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
 
-	c = ROUNDDOWN(v, PGSIZE);
+	if (PGOFF(v) != 0 && (tc = tcache_self()) != 0) {
+		// The slab header does not change while v is allocated.
+		c = slab_of(v)->s_class;
+		*(void **) v = tc->tc_bin[c];
+		tc->tc_bin[c] = v;
+		tc->tc_bytes += class_size[c];
+		tc->tc_nfree++;
+		if (++tc->tc_count[c] > TCACHE_MAX)
+			tcache_flush(tc, c, TCACHE_BATCH);
+		return;
+	}
+
+	malloc_lock();
+	stats.ms_nfree++;
+	if (PGOFF(v) == 0)
+		free_large(v);
+	else
+		free_small(slab_of(v), v);
+	malloc_unlock();
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+	void *v;
+
+	if (size && nmemb > (size_t) -1 / size)
+		return 0;
+	if ((v = malloc(nmemb * size)) != 0)
+		memset(v, 0, nmemb * size);
+	return v;
+}
+
+void*
+realloc(void *v, size_t n)
+{
+	void *nv;
+	size_t old;
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	if (v == 0)
+		return malloc(n);
+	if (n == 0) {
+		free(v);
+		return 0;
 	}
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	malloc_lock();
+	old = usable_size(v);
+	malloc_unlock();
+	if (n <= old)
+		return v;
+
+	if ((nv = malloc(n)) == 0)
+		return 0;
+	memmove(nv, v, old);
+	free(v);
+	return nv;
+}
+
+// Give the calling thread's cached objects back to the slabs, so that
+// other threads can use them; for a thread that is about to exit.
+void
+malloc_thread_flush(void)
+{
+	struct Tcache *tc;
+	int c;
+
+	if ((tc = tcaches[ENVX(thisenvid())]) == 0)
+		return;
+	for (c = 0; c < NCLASS; c++)
+		tcache_flush(tc, c, tc->tc_count[c]);
 }
 
+// Fill in *ms with the heap's current statistics.  Other threads'
+// caches are read without stopping them, so the result is approximate
+// while they allocate.
+void
+malloc_stats(struct MallocStats *ms)
+{
+	struct Tcache *tc;
+	int i;
+
+	malloc_lock();
+	*ms = stats;
+	malloc_unlock();
+
+	for (i = 0; i < NENV; i++) {
+		if ((tc = tcaches[i]) == 0)
+			continue;
+		ms->ms_inuse -= tc->tc_bytes;
+		ms->ms_tcache += tc->tc_bytes;
+		ms->ms_nmalloc += tc->tc_nmalloc;
+		ms->ms_nfree += tc->tc_nfree;
+	}
+}
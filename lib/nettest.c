@@ -0,0 +1,86 @@
+// Frames for the network card tests.
+
+#include <inc/lib.h>
+#include <inc/nettest.h>
+
+// Store 'v' at 'p' in network byte order.
+void
+put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+// Store the card's MAC address in mac[0..5].
+void
+nettest_mac(uint8_t *mac)
+{
+	uint64_t addr;
+	int i;
+
+	sys_get_mac_address(&addr);
+	for (i = 0; i < 6; i++)
+		mac[i] = addr >> (8 * i);
+}
+
+// Build in 'buf' an ARP_LEN-byte broadcast ARP request for 10.0.2.2
+// from 10.0.2.15 at 'mac'.
+void
+nettest_arp(uint8_t *buf, const uint8_t *mac)
+{
+	static const uint8_t hdr[] = { 0, 1, 8, 0, 6, 4, 0, 1 };
+
+	memset(buf, 0, ARP_LEN);
+	memset(buf, 0xff, 6);
+	memcpy(buf + 6, mac, 6);
+	put16(buf + 12, 0x0806);
+	memcpy(buf + 14, hdr, sizeof(hdr));
+	memcpy(buf + 22, mac, 6);
+	buf[28] = 10, buf[29] = 0, buf[30] = 2, buf[31] = 15;
+	buf[38] = 10, buf[39] = 0, buf[40] = 2, buf[41] = 2;
+}
+
+// Build in 'frame' the Ethernet and IPv4 headers of a broadcast packet
+// of protocol 'proto' whose 'l4hlen'-byte UDP or TCP header, zeroed but
+// for its ports ('sport' to 9, discard), is followed by 'len' bytes of
+// payload.  The IP checksum is left 0, as the card wants.
+// Returns the UDP or TCP header.
+uint8_t *
+nettest_ip(uint8_t *frame, uint8_t proto, int l4hlen, int len, uint16_t sport)
+{
+	uint8_t *ip = frame + ETH_HLEN, *l4 = ip + IP_HLEN;
+
+	memset(frame, 0, ETH_HLEN + IP_HLEN + l4hlen);
+	memset(frame, 0xff, 6);
+	nettest_mac(frame + 6);
+	put16(frame + 12, 0x0800);
+
+	ip[0] = 0x45;
+	put16(ip + 2, IP_HLEN + l4hlen + len);
+	ip[8] = 64;
+	ip[9] = proto;
+	ip[12] = 10, ip[13] = 0, ip[14] = 2, ip[15] = 15;
+	ip[16] = 10, ip[17] = 0, ip[18] = 2, ip[19] = 2;
+
+	put16(l4, sport);
+	put16(l4 + 2, 9);
+	return l4;
+}
+
+// The pseudo header sum of the IPv4 packet in 'frame' for 'l4len' bytes
+// of UDP or TCP, with which the card wants the checksum seeded.  For
+// segmentation offload the card adds each segment's length itself, so
+// 'l4len' is then 0.
+uint16_t
+nettest_pseudo(const uint8_t *frame, int l4len)
+{
+	const uint8_t *ip = frame + ETH_HLEN;
+	uint32_t sum = ip[9] + l4len;
+	int i;
+
+	for (i = 12; i < 20; i += 2)
+		sum += (ip[i] << 8) | ip[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
@@ -18,6 +18,7 @@ _panic(const char *file, int line, const char *fmt, ...)
 		sys_getenvid(), binaryname, file, line);
 	vcprintf(fmt, ap);
 	cprintf("\n");
+	cflush();
 
 	// Cause a breakpoint exception
 	while (1)
@@ -13,6 +13,25 @@ extern void _pgfault_upcall(void);
 // Pointer to currently installed C-language pgfault handler.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
+// Called by _pgfault_upcall to run _pgfault_handler.  The fault may
+// have hit in the middle of code using the x87 or SSE registers (such
+// as lib/string.c's SSE2 loops), which the handler may use too, so they
+// are saved around it.  An environment that has never used them has no
+// state to lose.
+void
+_pgfault_call(struct UTrapframe *utf)
+{
+	uint8_t area[512 + 15];
+	void *fpu = (void *) ROUNDUP((uintptr_t) area, 16);
+	bool saved = thisenv->env_fpu_used;
+
+	if (saved)
+		asm volatile("fxsave %0" : "=m" (*(uint8_t (*)[512]) fpu));
+	_pgfault_handler(utf);
+	if (saved)
+		asm volatile("fxrstor %0" : : "m" (*(uint8_t (*)[512]) fpu));
+}
+
 //
 // Set the page fault handler function.
 // If there isn't one yet, _pgfault_handler will be 0.
@@ -19,12 +19,23 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// A blocked reader or writer sleeps on p_seq, which every read, write
+// and close bumps.  A close cannot bump it after unmapping the pipe, so
+// the closer of an end's last fd marks the end closed in p_closed first;
+// a sleeper never has to wait for the unmap itself to be noticed.
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_seq;		// bumped by every read, write and close
+	uint32_t p_waiting;	// readers and writers sleeping on p_seq
+	uint32_t p_closing[2];	// closes in progress, by end
+	uint32_t p_closed[2];	// set once an end's last fd closes
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+// The index of fd's end in p_closing and p_closed.
+#define PIPEEND(fd)	((fd)->fd_omode == O_RDONLY ? 0 : 1)
+
 int
 pipe(int pfd[2])
 {
@@ -77,6 +88,8 @@ _pipeisclosed(struct Fd *fd, struct Pipe *p)
 {
 	int n, nn, ret;
 
+	if (p->p_closed[!PIPEEND(fd)])
+		return 1;
 	while (1) {
 		n = thisenv->env_runs;
 		ret = pageref(fd) == pageref(p);
@@ -88,6 +101,38 @@ _pipeisclosed(struct Fd *fd, struct Pipe *p)
 	}
 }
 
+// Sample p_seq before looking at the pipe, so that any change made
+// after the look also moves p_seq past the sample.
+static uint32_t
+pipe_seq(struct Pipe *p)
+{
+	uint32_t seq = *(volatile uint32_t *) &p->p_seq;
+
+	__sync_synchronize();
+	return seq;
+}
+
+// Sleep until p_seq moves past 'seq' and someone wakes us.
+static void
+pipe_sleep(struct Pipe *p, uint32_t seq)
+{
+	__sync_fetch_and_add(&p->p_waiting, 1);
+	sys_futex_wait(&p->p_seq, seq, 0);
+	__sync_fetch_and_sub(&p->p_waiting, 1);
+}
+
+// Bump p_seq and wake everyone sleeping on it.  Skips the system call
+// when nobody is waiting; the locked add orders our changes to the pipe
+// before the check of p_waiting, pairing with the increment in
+// pipe_sleep.
+static void
+pipe_wake(struct Pipe *p)
+{
+	__sync_fetch_and_add(&p->p_seq, 1);
+	if (*(volatile uint32_t *) &p->p_waiting)
+		sys_futex_wake(&p->p_seq, NENV);
+}
+
 int
 pipeisclosed(int fdnum)
 {
@@ -106,6 +151,7 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
 	size_t i;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -118,21 +164,28 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 		while (p->p_rpos == p->p_wpos) {
 			// pipe is empty
 			// if we got any data, return it
-			if (i > 0)
+			if (i > 0) {
+				pipe_wake(p);
 				return i;
+			}
+			// look again after sampling p_seq
+			seq = pipe_seq(p);
+			if (p->p_rpos != p->p_wpos)
+				continue;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer writes or closes
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read sleep\n");
+			pipe_sleep(p, seq);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+	pipe_wake(p);
 	return i;
 }
 
@@ -140,7 +193,8 @@ static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, woken;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,18 +203,28 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
+	woken = 0;
 	for (i = 0; i < n; i++) {
 		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
 			// pipe is full
+			// let the readers drain what we wrote, then look
+			// again after sampling p_seq
+			if (woken < i) {
+				pipe_wake(p);
+				woken = i;
+			}
+			seq = pipe_seq(p);
+			if (p->p_wpos < p->p_rpos + sizeof(p->p_buf))
+				continue;
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a reader reads or closes
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_sleep(p, seq);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +232,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(p);
 	return i;
 }
 
@@ -185,7 +250,21 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	int end = PIPEEND(fd), last;
+
+	// We close the end's last fd if everyone still mapping the fd
+	// page is closing it too.
+	__sync_fetch_and_add(&p->p_closing[end], 1);
+	last = pageref(fd) <= *(volatile uint32_t *) &p->p_closing[end];
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	__sync_fetch_and_sub(&p->p_closing[end], 1);
+
+	// Mark the end closed and wake the other end while we can still
+	// reach the pipe; the unmap below would wake no one.
+	if (last)
+		p->p_closed[end] = 1;
+	pipe_wake(p);
+	return sys_page_unmap(0, p);
 }
 
@@ -1,5 +1,5 @@
 // Implementation of cprintf console output for user environments,
-// based on printfmt() and the sys_cputs() system call.
+// based on printfmt() and the buffered console output in lib/console.c.
 //
 // cprintf is a debugging statement, not a generic output statement.
 // It is very important that it always go to the console, especially when
@@ -11,11 +11,11 @@
 #include <inc/lib.h>
 
 
-// Collect up to 256 characters into a buffer
-// and perform ONE system call to print all of them,
-// in order to make the lines output to the console atomic
-// and prevent interrupts from causing context switches
-// in the middle of a console output line and such.
+// Collect up to 256 characters into a buffer and hand them to the
+// console buffer (see lib/console.c) all at once, so that lines output
+// to the console stay atomic and are not broken up by interrupts,
+// context switches or other threads.  vcprintf flushes the console
+// buffer before returning, whatever its mode.
 struct printbuf {
 	int idx;	// current buffer index
 	int cnt;	// total bytes printed so far
@@ -28,7 +28,7 @@ putch(int ch, struct printbuf *b)
 {
 	b->buf[b->idx++] = ch;
 	if (b->idx == 256-1) {
-		sys_cputs(b->buf, b->idx);
+		cwrite(b->buf, b->idx);
 		b->idx = 0;
 	}
 	b->cnt++;
@@ -42,7 +42,8 @@ vcprintf(const char *fmt, va_list ap)
 	b.idx = 0;
 	b.cnt = 0;
 	vprintfmt((void*)putch, &b, fmt, ap);
-	sys_cputs(b.buf, b.idx);
+	cwrite(b.buf, b.idx);
+	cflush();
 
 	return b.cnt;
 }
@@ -37,6 +37,8 @@ static const char * const error_string[MAXERROR] =
 	[E_NOT_SUPP]	= "operation not supported",
 	[E_E1000_TX_FULL]     = "e1000 tx full",
 	[E_E1000_RX_EMPTY]    = "e1000 rx empty",
+	[E_TIMEOUT]	= "timed out",
+	[E_AGAIN]	= "try again",
 };
 
 /*
@@ -1,7 +1,11 @@
-// Basic string routines.  Not hardware optimized, but not shabby.
+// Basic string routines.  The loops that matter work a word at a time,
+// and in user programs 16 bytes at a time with SSE2 (lib/sse2.S) when
+// the CPU has it.
 
 #include <inc/string.h>
 #include <inc/stdio.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -9,22 +13,80 @@
 // Primespipe runs 3x faster this way.
 #define ASM 1
 
+// Word-at-a-time scanning.  HASZERO(w) is nonzero iff a byte of w is 0.
+// An aligned word never straddles a page, so reading the whole word
+// that holds the last byte of a string cannot fault.
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+
+#define ONES		0x01010101U
+#define HIGHS		0x80808080U
+#define HASZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+#define WORD(p)		(*(const word_t *) (p))
+#define WALIGNED(p)	(((uintptr_t) (p) & 3) == 0)
+
+#define SSE2_MIN	64		// Shorter buffers go word by word
+
+size_t	sse2_strlen(const char *s);
+const void *sse2_memfind(const void *s, int c, size_t nblocks);
+size_t	sse2_memcmp(const void *a, const void *b, size_t nblocks);
+void	sse2_memset(void *dst, int c, size_t nblocks);
+void	sse2_memcpy(void *dst, const void *src, size_t nblocks);
+
+#define CPUID_SSE2	(1 << 26)
+
+// Whether the CPU has SSE2, decided on first use.
+static int sse2 = -1;
+
+static bool
+cpu_has_sse2(void)
+{
+	uint32_t edx;
+
+	if (sse2 < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sse2 = (edx & CPUID_SSE2) != 0;
+	}
+	return sse2;
+}
+
+// Whether to use the SSE2 loops.  The kernel turns SSE on for user
+// environments whenever the CPU has it, but does not save its own SSE
+// registers.
+#ifndef JOS_KERNEL
+#define use_sse2()	cpu_has_sse2()
+#else
+#define use_sse2()	false
+#endif
+
 int
 strlen(const char *s)
 {
-	int n;
-
-	for (n = 0; *s != '\0'; s++)
-		n++;
-	return n;
+	const char *p;
+
+	if (use_sse2())
+		return sse2_strlen(s);
+
+	for (p = s; !WALIGNED(p); p++)
+		if (*p == '\0')
+			return p - s;
+	while (!HASZERO(WORD(p)))
+		p += 4;
+	while (*p != '\0')
+		p++;
+	return p - s;
 }
 
 int
 strnlen(const char *s, size_t size)
 {
-	int n;
-
-	for (n = 0; size > 0 && *s != '\0'; s++, size--)
+	size_t n;
+
+	for (n = 0; n < size && !WALIGNED(s + n); n++)
+		if (s[n] == '\0')
+			return n;
+	while (size - n >= 4 && !HASZERO(WORD(s + n)))
+		n += 4;
+	while (n < size && s[n] != '\0')
 		n++;
 	return n;
 }
@@ -80,20 +142,36 @@ strlcpy(char *dst, const char *src, size_t size)
 int
 strcmp(const char *p, const char *q)
 {
+	// Compare whole words while they match and hold no NUL.
+	if (((uintptr_t) p & 3) == ((uintptr_t) q & 3)) {
+		for (; !WALIGNED(p); p++, q++)
+			if (*p == '\0' || *p != *q)
+				goto out;
+		while (WORD(p) == WORD(q) && !HASZERO(WORD(p)))
+			p += 4, q += 4;
+	}
 	while (*p && *p == *q)
 		p++, q++;
+out:
 	return (int) ((unsigned char) *p - (unsigned char) *q);
 }
 
 int
 strncmp(const char *p, const char *q, size_t n)
 {
+	if (((uintptr_t) p & 3) == ((uintptr_t) q & 3)) {
+		for (; n > 0 && !WALIGNED(p); n--, p++, q++)
+			if (*p == '\0' || *p != *q)
+				goto out;
+		while (n >= 4 && WORD(p) == WORD(q) && !HASZERO(WORD(p)))
+			n -= 4, p += 4, q += 4;
+	}
 	while (n > 0 && *p && *p == *q)
 		n--, p++, q++;
 	if (n == 0)
 		return 0;
-	else
-		return (int) ((unsigned char) *p - (unsigned char) *q);
+out:
+	return (int) ((unsigned char) *p - (unsigned char) *q);
 }
 
 // Return a pointer to the first occurrence of 'c' in 's',
@@ -101,6 +179,16 @@ strncmp(const char *p, const char *q, size_t n)
 char *
 strchr(const char *s, char c)
 {
+	uint32_t cw = (unsigned char) c * ONES;
+
+	for (; !WALIGNED(s); s++) {
+		if (*s == '\0')
+			return 0;
+		if (*s == c)
+			return (char *) s;
+	}
+	while (!HASZERO(WORD(s)) && !HASZERO(WORD(s) ^ cw))
+		s += 4;
 	for (; *s; s++)
 		if (*s == c)
 			return (char *) s;
@@ -119,52 +207,107 @@ strfind(const char *s, char c)
 }
 
 #if ASM
+static inline void
+stosb(uint8_t **p, int c, size_t n)
+{
+	asm volatile("cld; rep stosb"
+		     : "+D" (*p), "+c" (n) : "a" (c) : "cc", "memory");
+}
+
+static inline void
+stosl(uint8_t **p, uint32_t w, size_t nwords)
+{
+	asm volatile("cld; rep stosl"
+		     : "+D" (*p), "+c" (nwords) : "a" (w) : "cc", "memory");
+}
+
+static inline void
+movsb(uint8_t **d, const uint8_t **s, size_t n)
+{
+	asm volatile("cld; rep movsb"
+		     : "+D" (*d), "+S" (*s), "+c" (n) : : "cc", "memory");
+}
+
+static inline void
+movsl(uint8_t **d, const uint8_t **s, size_t nwords)
+{
+	asm volatile("cld; rep movsl"
+		     : "+D" (*d), "+S" (*s), "+c" (nwords) : : "cc", "memory");
+}
+
+// Bytes up to a word boundary of the destination, whole words (or
+// 16-byte blocks), then the remaining bytes.
 void *
 memset(void *v, int c, size_t n)
 {
-	char *p;
-
-	if (n == 0)
-		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
-	} else
-		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
-			: "cc", "memory");
+	uint8_t *p = v;
+	size_t head;
+
+	c &= 0xFF;
+	if (n >= 16) {
+		head = -(uintptr_t) p & 3;
+		stosb(&p, c, head);
+		n -= head;
+		if (use_sse2() && n >= SSE2_MIN) {
+			head = -(uintptr_t) p & 15;
+			stosl(&p, c * ONES, head / 4);
+			n -= head;
+			sse2_memset(p, c, n / 16);
+			p += n & ~15;
+			n &= 15;
+		}
+		stosl(&p, c * ONES, n / 4);
+		n &= 3;
+	}
+	stosb(&p, c, n);
 	return v;
 }
 
 void *
 memmove(void *dst, const void *src, size_t n)
 {
-	const char *s;
-	char *d;
+	const uint8_t *s;
+	uint8_t *d;
+	size_t head;
 
 	s = src;
 	d = dst;
 	if (s < d && s + n > d) {
+		// Copy backward, starting with the bytes past the last
+		// word boundary of the destination.
 		s += n;
 		d += n;
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("std; rep movsl\n"
-				:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("std; rep movsb\n"
-				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
+		head = MIN((uintptr_t) d & 3, n);
+		asm volatile("std; rep movsb\n"
+			:: "D" (d-1), "S" (s-1), "c" (head) : "cc", "memory");
+		s -= head, d -= head, n -= head;
+		asm volatile("std; rep movsl\n"
+			:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
+		s -= n & ~3, d -= n & ~3, n &= 3;
+		asm volatile("std; rep movsb\n"
+			:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
 		// Some versions of GCC rely on DF being clear
 		asm volatile("cld" ::: "cc");
 	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+		// Copying forward is safe even when d is just below s:
+		// every word or block is read before it is overwritten.
+		if (n >= 16) {
+			head = -(uintptr_t) d & 3;
+			movsb(&d, &s, head);
+			n -= head;
+			if (use_sse2() && n >= SSE2_MIN) {
+				head = -(uintptr_t) d & 15;
+				movsl(&d, &s, head / 4);
+				n -= head;
+				sse2_memcpy(d, s, n / 16);
+				d += n & ~15;
+				s += n & ~15;
+				n &= 15;
+			}
+			movsl(&d, &s, n / 4);
+			n &= 3;
+		}
+		movsb(&d, &s, n);
 	}
 	return dst;
 }
@@ -213,12 +356,67 @@ memcpy(void *dst, const void *src, size_t n)
 	return memmove(dst, src, n);
 }
 
+// Clear or copy a whole page with non-temporal stores, which go around
+// the cache.  The pages these are used for, fresh zero pages and
+// copy-on-write copies, are seldom read again soon, and caching them
+// would only evict the caller's working set.  movnti is SSE2 but uses
+// general registers, so the kernel can use it too.
+void
+page_zero(void *dst)
+{
+	size_t n = PGSIZE / 16;
+
+	if (!cpu_has_sse2()) {
+		memset(dst, 0, PGSIZE);
+		return;
+	}
+	asm volatile("1:	movnti %%eax, (%0)\n"
+		     "	movnti %%eax, 4(%0)\n"
+		     "	movnti %%eax, 8(%0)\n"
+		     "	movnti %%eax, 12(%0)\n"
+		     "	addl $16, %0\n"
+		     "	decl %1\n"
+		     "	jnz 1b\n"
+		     "	sfence"
+		     : "+r" (dst), "+r" (n) : "a" (0) : "cc", "memory");
+}
+
+void
+page_copy(void *dst, const void *src)
+{
+	size_t n = PGSIZE / 8;
+
+	if (!cpu_has_sse2()) {
+		memcpy(dst, src, PGSIZE);
+		return;
+	}
+	asm volatile("1:	movl (%1), %%eax\n"
+		     "	movl 4(%1), %%edx\n"
+		     "	movnti %%eax, (%0)\n"
+		     "	movnti %%edx, 4(%0)\n"
+		     "	addl $8, %1\n"
+		     "	addl $8, %0\n"
+		     "	decl %2\n"
+		     "	jnz 1b\n"
+		     "	sfence"
+		     : "+D" (dst), "+S" (src), "+c" (n) : : "eax", "edx", "cc", "memory");
+}
+
 int
 memcmp(const void *v1, const void *v2, size_t n)
 {
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
+	size_t off;
 
+	// Skip the equal prefix in blocks, then words (x86 does not mind
+	// unaligned loads), and find the difference byte by byte.
+	if (use_sse2() && n >= SSE2_MIN) {
+		off = sse2_memcmp(s1, s2, n / 16);
+		s1 += off, s2 += off, n -= off;
+	}
+	while (n >= 4 && WORD(s1) == WORD(s2))
+		s1 += 4, s2 += 4, n -= 4;
 	while (n-- > 0) {
 		if (*s1 != *s2)
 			return (int) *s1 - (int) *s2;
@@ -231,11 +429,17 @@ memcmp(const void *v1, const void *v2, size_t n)
 void *
 memfind(const void *s, int c, size_t n)
 {
-	const void *ends = (const char *) s + n;
-	for (; s < ends; s++)
-		if (*(const unsigned char *) s == (unsigned char) c)
+	const unsigned char *p = s, *ends = p + n;
+	uint32_t cw = (unsigned char) c * ONES;
+
+	if (use_sse2() && n >= SSE2_MIN)
+		p = sse2_memfind(p, c, n / 16);
+	while (ends - p >= 4 && !HASZERO(WORD(p) ^ cw))
+		p += 4;
+	for (; p < ends; p++)
+		if (*p == (unsigned char) c)
 			break;
-	return (void *) s;
+	return (void *) p;
 }
 
 long
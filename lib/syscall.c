@@ -112,9 +112,9 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 }
 
 int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, unsigned timeout)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, timeout, 0, 0, 0);
 }
 
 unsigned int
@@ -128,11 +128,31 @@ sys_tx_pkg(void* buffer, uint32_t size){
     return syscall(SYS_tx_pkg, 0, (uint32_t) buffer, size, 0, 0, 0);
 }
 
+int
+sys_tx_batch(const struct jif_txd* txds, int n){
+    return syscall(SYS_tx_batch, 0, (uint32_t) txds, n, 0, 0, 0);
+}
+
 int
 sys_rx_pkg(void* buffer, uint32_t size){
     return syscall(SYS_rx_pkg, 0, (uint32_t) buffer, size, 0, 0, 0);
 }
 
+int
+sys_rx_batch(void* va, int n){
+    return syscall(SYS_rx_batch, 0, (uint32_t) va, n, 0, 0, 0);
+}
+
+int
+sys_netmap_attach(void){
+    return syscall(SYS_netmap_attach, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_netmap_sync(int flags){
+    return syscall(SYS_netmap_sync, 0, flags, 0, 0, 0, 0);
+}
+
 int
 sys_set_service(){
     return syscall(SYS_set_service, 0, 0, 0, 0, 0, 0);
@@ -146,3 +166,74 @@ sys_get_mac_address(uint64_t * mac){
 	return syscall(SYS_get_mac_address,0,(uint32_t) mac,0,0,0,0);
 }
 
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+envid_t
+sys_spawn(const void *image, size_t size, const char **argv,
+	  const struct Fd *fd)
+{
+	return syscall(SYS_spawn, 0, (uint32_t) image, size, (uint32_t) argv,
+		       (uint32_t) fd, 0);
+}
+
+int
+sys_exec_pagein(envid_t envid, int32_t result, void *pg, uint32_t ino)
+{
+	return syscall(SYS_exec_pagein, 0, envid, result, (uint32_t) pg, ino, 0);
+}
+
+int
+sys_exec_invalidate(uint32_t ino)
+{
+	return syscall(SYS_exec_invalidate, 1, ino, 0, 0, 0, 0);
+}
+
+envid_t
+sys_thread_create(void *eip, void *esp, void *xstacktop)
+{
+	return syscall(SYS_thread_create, 0, (uint32_t) eip, (uint32_t) esp,
+		       (uint32_t) xstacktop, 0, 0);
+}
+
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, npages,
+		       perm, 0);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, npages,
+		       0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, int cpu)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpu, 0, 0, 0);
+}
+
+envid_t
+sys_service_lookup(enum EnvType type)
+{
+	return syscall(SYS_service_lookup, 0, type, 0, 0, 0, 0);
+}
+
+int
+sys_wait(uint32_t events, volatile uint32_t *addr, uint32_t val, void *dstva,
+	 unsigned timeout)
+{
+	return syscall(SYS_wait, 0, events, (uint32_t) addr, val, (uint32_t) dstva, timeout);
+}
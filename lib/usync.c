@@ -0,0 +1,70 @@
+// Mutexes and condition variables for user threads, built on
+// uthread_futex_wait and uthread_futex_wake.  A thread that has to wait
+// parks, leaving its worker free to run other threads.
+//
+// The mutex is the usual three-state futex mutex: an unlock only pays
+// for a wakeup when the state says somebody may be parked.
+
+#include <inc/lib.h>
+
+void
+umutex_lock(struct Umutex *m)
+{
+	uint32_t c;
+
+	if ((c = __sync_val_compare_and_swap(&m->um_state, 0, 1)) == 0)
+		return;
+	// Contended: announce a waiter, then park until it is free.
+	if (c != 2)
+		c = __sync_lock_test_and_set(&m->um_state, 2);
+	while (c != 0) {
+		uthread_futex_wait(&m->um_state, 2);
+		c = __sync_lock_test_and_set(&m->um_state, 2);
+	}
+}
+
+// Returns true if the mutex was taken.
+bool
+umutex_trylock(struct Umutex *m)
+{
+	return __sync_bool_compare_and_swap(&m->um_state, 0, 1);
+}
+
+void
+umutex_unlock(struct Umutex *m)
+{
+	if (__sync_fetch_and_sub(&m->um_state, 1) != 1) {
+		m->um_state = 0;
+		uthread_futex_wake(&m->um_state, 1);
+	}
+}
+
+// Atomically unlock 'm' and wait for 'c' to be signaled, then relock
+// 'm'.  As with any condition variable, the wakeup may be spurious.
+void
+ucond_wait(struct Ucond *c, struct Umutex *m)
+{
+	uint32_t seq = c->uc_seq;
+
+	umutex_unlock(m);
+	uthread_futex_wait(&c->uc_seq, seq);
+
+	// Other waiters may have been woken with us: take the mutex in
+	// its contended state so our unlock wakes the next of them.
+	while (__sync_lock_test_and_set(&m->um_state, 2) != 0)
+		uthread_futex_wait(&m->um_state, 2);
+}
+
+void
+ucond_signal(struct Ucond *c)
+{
+	__sync_fetch_and_add(&c->uc_seq, 1);
+	uthread_futex_wake(&c->uc_seq, 1);
+}
+
+void
+ucond_broadcast(struct Ucond *c)
+{
+	__sync_fetch_and_add(&c->uc_seq, 1);
+	uthread_futex_wake(&c->uc_seq, NENV);
+}
@@ -0,0 +1,589 @@
+// User-level threads.
+//
+// uthread_run() turns the calling environment into a small pool of
+// workers -- itself plus kernel threads from kthread_create() -- and
+// multiplexes any number of user threads over them.  A user thread is
+// just a stack and a saved stack pointer, so creating one and switching
+// between two costs no system calls.
+//
+// Each worker has a FIFO run queue.  A worker runs the threads on its
+// own queue first and steals from the other workers' queues when it
+// runs dry; with nothing to steal it sleeps on a kernel futex until
+// some thread becomes runnable.  Threads park on user-level futexes
+// (uthread_futex_wait), on which the mutexes and condition variables of
+// usync.c are built, without blocking their worker.
+//
+// A thread that must block in the kernel (ipc_recv, say) blocks its
+// worker as well.  Calling uthread_blocking first lets the runtime hand
+// the rest of that worker's queue to an idle worker, or start a new
+// one, so the other threads keep running.
+//
+// Worker i runs a scheduler loop on its own stack.  A thread gives up
+// its worker by switching back to that loop, which then finishes the
+// job: it requeues a yielding thread, drops the lock a parking thread
+// queued itself under, or reaps an exiting one.  That way no thread is
+// visible to other workers until its stack is no longer in use.
+
+#include <inc/lib.h>
+
+// Thread stacks, each below an unmapped guard page.
+#define UTHREADS		0xE0400000
+#define UTHREADS_END		0xEE000000
+#define UTHREAD_MAXSTKPAGES	(UTHREAD_MAXSTACK / PGSIZE)
+
+#define UFUTEX_HASH_SIZE	64
+#define UFUTEX_HASH(addr)	((((uintptr_t) (addr)) >> 2) % UFUTEX_HASH_SIZE)
+
+enum {
+	UT_RUNNABLE = 0,
+	UT_RUNNING,
+	UT_BLOCKED,
+	UT_EXITED
+};
+
+// A thread's struct sits at the top of its own stack.
+struct Uthread {
+	uint32_t ut_esp;		// Saved stack pointer while switched out
+	volatile int ut_state;		// UT_*
+	void (*ut_fn)(void *);
+	void *ut_arg;
+	struct Uthread *ut_link;	// Next on a run queue or futex queue
+	volatile uint32_t *ut_waddr;	// Futex word we are parked on
+	volatile uint32_t ut_done;	// Set once exited, for uthread_join
+	volatile uint32_t ut_refs;	// The running thread and its handle
+	int ut_npages;			// Stack pages, struct included
+};
+
+struct Uworker {
+	volatile envid_t w_envid;	// Kernel thread running this worker;
+					// -1 until it starts
+	envid_t w_tid;			// Its kthread_create id, for joining
+	uint32_t w_esp;			// Scheduler loop's saved stack pointer
+	struct Uthread *w_cur;		// Thread running on this worker
+	volatile uint32_t *w_unlock;	// Lock to drop once w_cur is off-CPU
+	volatile uint32_t w_lock;	// Protects the run queue
+	struct Uthread *w_head;		// Run queue
+	struct Uthread *w_tail;
+};
+
+static struct Ufutexq {
+	volatile uint32_t uq_lock;
+	struct Uthread *uq_head;
+} ufutexq[UFUTEX_HASH_SIZE];
+
+static struct Uworker workers[UTHREAD_MAXWORKERS];
+static volatile int nworkers;
+static volatile uint32_t worker_lock;	// Serializes adding workers
+
+static volatile uint32_t nlive;		// Threads that have not exited
+static volatile uint32_t nidle;		// Workers asleep or about to be
+static volatile uint32_t wakeseq;	// Kernel futex idle workers sleep on
+static volatile bool done;
+
+static volatile uint32_t stack_lock;
+static uintptr_t stack_next = UTHREADS;
+static uintptr_t stack_free[UTHREAD_MAXSTKPAGES + 1];
+
+void	uthread_switch(uint32_t *save_esp, uint32_t esp);
+
+static void
+spin_lock(volatile uint32_t *lock)
+{
+	while (__sync_lock_test_and_set(lock, 1) != 0)
+		asm volatile("pause");
+}
+
+static void
+spin_unlock(volatile uint32_t *lock)
+{
+	__sync_lock_release(lock);
+}
+
+// Return the worker run by the calling kernel thread, or NULL if it is
+// not one of ours.
+static struct Uworker *
+worker_self(void)
+{
+	envid_t envid = thisenvid();
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].w_envid == envid)
+			return &workers[i];
+	return NULL;
+}
+
+/*
+ * Stacks
+ */
+
+// Get a stack of 'npages' pages, reusing a freed one of the same size
+// if there is one, and store its top in *top_store.
+static int
+stack_alloc(int npages, uintptr_t *top_store)
+{
+	uintptr_t top, va;
+	int r;
+
+	spin_lock(&stack_lock);
+	if ((top = stack_free[npages]) != 0) {
+		stack_free[npages] = *(uintptr_t *) (top - sizeof(uintptr_t));
+		spin_unlock(&stack_lock);
+		*top_store = top;
+		return 0;
+	}
+	if (stack_next + (npages + 1) * PGSIZE > UTHREADS_END) {
+		spin_unlock(&stack_lock);
+		return -E_NO_MEM;
+	}
+	va = stack_next + PGSIZE;
+	stack_next += (npages + 1) * PGSIZE;
+	spin_unlock(&stack_lock);
+
+	top = va + npages * PGSIZE;
+	for (; va < top; va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0) {
+			// The address range is lost; don't keep its pages.
+			while (va > top - npages * PGSIZE)
+				sys_page_unmap(0, (void *) (va -= PGSIZE));
+			return r;
+		}
+	*top_store = top;
+	return 0;
+}
+
+// Keep the stack below 'top' mapped for the next thread of its size.
+static void
+stack_free_top(uintptr_t top, int npages)
+{
+	spin_lock(&stack_lock);
+	*(uintptr_t *) (top - sizeof(uintptr_t)) = stack_free[npages];
+	stack_free[npages] = top;
+	spin_unlock(&stack_lock);
+}
+
+static void
+uthread_put(struct Uthread *ut)
+{
+	if (__sync_sub_and_fetch(&ut->ut_refs, 1) == 0)
+		stack_free_top((uintptr_t) (ut + 1), ut->ut_npages);
+}
+
+/*
+ * Run queues
+ */
+
+static void
+runq_push(struct Uworker *w, struct Uthread *ut)
+{
+	spin_lock(&w->w_lock);
+	ut->ut_link = NULL;
+	if (w->w_tail)
+		w->w_tail->ut_link = ut;
+	else
+		w->w_head = ut;
+	w->w_tail = ut;
+	spin_unlock(&w->w_lock);
+}
+
+static struct Uthread *
+runq_pop(struct Uworker *w)
+{
+	struct Uthread *ut;
+
+	if (!w->w_head)
+		return NULL;
+	spin_lock(&w->w_lock);
+	if ((ut = w->w_head) != NULL) {
+		w->w_head = ut->ut_link;
+		if (!w->w_head)
+			w->w_tail = NULL;
+	}
+	spin_unlock(&w->w_lock);
+	return ut;
+}
+
+static bool
+runq_pending(void)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].w_head)
+			return true;
+	return false;
+}
+
+// Wake one idle worker, if any, to pick up newly queued work.
+static void
+worker_kick(void)
+{
+	// Order the caller's queue update before reading nidle;
+	// worker_idle does the reverse.
+	__sync_synchronize();
+	if (nidle) {
+		__sync_fetch_and_add(&wakeseq, 1);
+		sys_futex_wake(&wakeseq, 1);
+	}
+}
+
+// Make 'ut' runnable on the calling worker's queue.
+static void
+uthread_ready(struct Uthread *ut)
+{
+	struct Uworker *w = worker_self();
+
+	ut->ut_state = UT_RUNNABLE;
+	runq_push(w ? w : &workers[0], ut);
+	worker_kick();
+}
+
+/*
+ * Workers
+ */
+
+// The next thread for 'w' to run: its own oldest, else a stolen one.
+static struct Uthread *
+worker_next(struct Uworker *w)
+{
+	struct Uthread *ut;
+	int i, n = nworkers, self = w - workers;
+
+	if ((ut = runq_pop(w)) != NULL)
+		return ut;
+	for (i = 1; i < n; i++)
+		if ((ut = runq_pop(&workers[(self + i) % n])) != NULL)
+			return ut;
+	return NULL;
+}
+
+static void
+worker_idle(void)
+{
+	uint32_t seq = wakeseq;
+
+	__sync_fetch_and_add(&nidle, 1);
+	if (!done && !runq_pending())
+		sys_futex_wait(&wakeseq, seq, 0);
+	__sync_fetch_and_sub(&nidle, 1);
+}
+
+static void
+uthread_reap(struct Uthread *ut)
+{
+	ut->ut_done = 1;
+	uthread_futex_wake(&ut->ut_done, NENV);
+	uthread_put(ut);
+
+	if (__sync_sub_and_fetch(&nlive, 1) == 0) {
+		done = true;
+		__sync_fetch_and_add(&wakeseq, 1);
+		sys_futex_wake(&wakeseq, NENV);
+	}
+}
+
+static void
+worker_loop(struct Uworker *w)
+{
+	struct Uthread *ut;
+	int state;
+
+	w->w_envid = thisenvid();
+	while (!done) {
+		if ((ut = worker_next(w)) == NULL) {
+			worker_idle();
+			continue;
+		}
+
+		w->w_cur = ut;
+		ut->ut_state = UT_RUNNING;
+		uthread_switch(&w->w_esp, ut->ut_esp);
+		w->w_cur = NULL;
+
+		// Once w_unlock is dropped a parked thread may already be
+		// running elsewhere, so look at its state first.
+		state = ut->ut_state;
+		if (w->w_unlock) {
+			spin_unlock(w->w_unlock);
+			w->w_unlock = NULL;
+		}
+		if (state == UT_RUNNABLE)
+			runq_push(w, ut);
+		else if (state == UT_EXITED)
+			uthread_reap(ut);
+	}
+}
+
+static void
+worker_main(void *arg)
+{
+	worker_loop((struct Uworker *) arg);
+}
+
+// Start another worker, if there is room for one.
+static void
+worker_add(void)
+{
+	struct Uworker *w;
+
+	spin_lock(&worker_lock);
+	if (nworkers < UTHREAD_MAXWORKERS) {
+		// Count the worker before it can run any thread, so that
+		// worker_self finds it.
+		w = &workers[nworkers];
+		memset(w, 0, sizeof(*w));
+		w->w_envid = -1;
+		__sync_synchronize();
+		nworkers++;
+		if ((w->w_tid = kthread_create(worker_main, w)) < 0)
+			nworkers--;
+	}
+	spin_unlock(&worker_lock);
+}
+
+// Give up the CPU to the calling worker's scheduler loop; the caller has
+// set its state to say why.
+static void
+uthread_sched(struct Uthread *ut)
+{
+	uthread_switch(&ut->ut_esp, worker_self()->w_esp);
+}
+
+// Where a new thread starts, as if called from nowhere.
+static void __attribute__((noreturn))
+uthread_start(void)
+{
+	struct Uthread *ut = uthread_self();
+
+	ut->ut_fn(ut->ut_arg);
+	uthread_exit();
+}
+
+/*
+ * Public interface
+ */
+
+// Run fn(arg) as the first user thread of the program on 'nworkers'
+// workers, the calling environment among them.  Returns once every
+// user thread has exited, < 0 on error.
+int
+uthread_run(void (*fn)(void *), void *arg, int nworkers_wanted)
+{
+	int i, r;
+
+	if (nworkers_wanted < 1 || nworkers_wanted > UTHREAD_MAXWORKERS)
+		return -E_INVAL;
+	if (nworkers != 0)
+		return -E_INVAL;
+
+	memset(&workers[0], 0, sizeof(workers[0]));
+	workers[0].w_envid = thisenvid();
+	nworkers = 1;
+	done = false;
+
+	if ((r = uthread_create(NULL, fn, arg, 0)) < 0) {
+		nworkers = 0;
+		return r;
+	}
+
+	for (i = 1; i < nworkers_wanted; i++)
+		worker_add();
+
+	worker_loop(&workers[0]);
+
+	// Workers started by uthread_blocking count too.
+	for (i = 1; i < nworkers; i++)
+		kthread_join(workers[i].w_tid);
+	nworkers = 0;
+	return 0;
+}
+
+// Create a thread running fn(arg) on a stack of at least 'stacksize'
+// bytes, or UTHREAD_STACKSIZE if 0.  The thread runs as soon as a worker
+// is free.  If ut_store is not NULL the caller must later uthread_join
+// or uthread_detach *ut_store.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the stack, thread struct included, would be larger
+//		than UTHREAD_MAXSTACK.
+//	-E_NO_MEM if out of memory or address space.
+int
+uthread_create(struct Uthread **ut_store, void (*fn)(void *), void *arg,
+	       size_t stacksize)
+{
+	struct Uthread *ut;
+	uint32_t *sp;
+	uintptr_t top;
+	int npages, r;
+
+	if (stacksize == 0)
+		stacksize = UTHREAD_STACKSIZE;
+	if (stacksize > UTHREAD_MAXSTACK)
+		return -E_INVAL;
+	npages = ROUNDUP(stacksize + sizeof(struct Uthread), PGSIZE) / PGSIZE;
+	if (npages > UTHREAD_MAXSTKPAGES)
+		return -E_INVAL;
+	if ((r = stack_alloc(npages, &top)) < 0)
+		return r;
+
+	ut = (struct Uthread *) top - 1;
+	memset(ut, 0, sizeof(*ut));
+	ut->ut_fn = fn;
+	ut->ut_arg = arg;
+	ut->ut_npages = npages;
+	ut->ut_refs = ut_store ? 2 : 1;
+
+	// uthread_switch's frame: edi, esi, ebx, ebp, return address;
+	// then uthread_start's null return address.
+	sp = (uint32_t *) ROUNDDOWN((uintptr_t) ut, 16) - 6;
+	memset(sp, 0, 6 * sizeof(uint32_t));
+	sp[4] = (uint32_t) uthread_start;
+	ut->ut_esp = (uint32_t) sp;
+
+	__sync_fetch_and_add(&nlive, 1);
+	if (ut_store)
+		*ut_store = ut;
+	uthread_ready(ut);
+	return 0;
+}
+
+// The calling user thread, or NULL if not called from one.
+struct Uthread *
+uthread_self(void)
+{
+	struct Uworker *w = worker_self();
+
+	return w ? w->w_cur : NULL;
+}
+
+// Let the other runnable threads run first.
+void
+uthread_yield(void)
+{
+	struct Uthread *ut;
+
+	if ((ut = uthread_self()) == NULL) {
+		sys_yield();
+		return;
+	}
+	ut->ut_state = UT_RUNNABLE;
+	uthread_sched(ut);
+}
+
+void
+uthread_exit(void)
+{
+	struct Uthread *ut;
+
+	if ((ut = uthread_self()) == NULL)
+		panic("uthread_exit: not a user thread");
+	ut->ut_state = UT_EXITED;
+	uthread_sched(ut);
+	panic("uthread_exit: still running");
+}
+
+// Wait for 'ut' to exit, then release it.
+// Must be called from a user thread.
+int
+uthread_join(struct Uthread *ut)
+{
+	while (!ut->ut_done)
+		uthread_futex_wait(&ut->ut_done, 0);
+	uthread_put(ut);
+	return 0;
+}
+
+// Let 'ut' be released as soon as it exits.
+void
+uthread_detach(struct Uthread *ut)
+{
+	uthread_put(ut);
+}
+
+// Park the calling thread until uthread_futex_wake(addr), provided the
+// word at 'addr' still holds 'val'.  Unlike sys_futex_wait, only this
+// program's threads can wake it, and its worker keeps running others.
+// Returns 0 when woken, -E_AGAIN if the word did not hold 'val', or
+// -E_INVAL if not called from a user thread.
+int
+uthread_futex_wait(volatile uint32_t *addr, uint32_t val)
+{
+	struct Ufutexq *q = &ufutexq[UFUTEX_HASH(addr)];
+	struct Uthread *ut, **pp;
+
+	if ((ut = uthread_self()) == NULL)
+		return -E_INVAL;
+
+	spin_lock(&q->uq_lock);
+	if (*addr != val) {
+		spin_unlock(&q->uq_lock);
+		return -E_AGAIN;
+	}
+	for (pp = &q->uq_head; *pp; pp = &(*pp)->ut_link)
+		/* walk to the tail */;
+	*pp = ut;
+	ut->ut_link = NULL;
+	ut->ut_waddr = addr;
+	ut->ut_state = UT_BLOCKED;
+
+	// The scheduler loop drops the queue lock once we are off our
+	// stack, so a waker cannot requeue us while we are still on it.
+	worker_self()->w_unlock = &q->uq_lock;
+	uthread_sched(ut);
+	return 0;
+}
+
+// Wake up to 'n' threads parked on 'addr', oldest first.
+// Returns the number of threads woken.
+int
+uthread_futex_wake(volatile uint32_t *addr, int n)
+{
+	struct Ufutexq *q = &ufutexq[UFUTEX_HASH(addr)];
+	struct Uthread *ut, *next, **pp, *woken = NULL, **tail = &woken;
+	int nwoken = 0;
+
+	spin_lock(&q->uq_lock);
+	for (pp = &q->uq_head; *pp && nwoken < n; ) {
+		ut = *pp;
+		if (ut->ut_waddr != addr) {
+			pp = &ut->ut_link;
+			continue;
+		}
+		*pp = ut->ut_link;
+		ut->ut_link = NULL;
+		ut->ut_waddr = NULL;
+		*tail = ut;
+		tail = &ut->ut_link;
+		nwoken++;
+	}
+	spin_unlock(&q->uq_lock);
+
+	for (ut = woken; ut; ut = next) {
+		next = ut->ut_link;
+		uthread_ready(ut);
+	}
+	return nwoken;
+}
+
+// The calling thread is about to block in the kernel, and its worker
+// with it: have another worker take over any queued threads, starting
+// one if none is idle.
+void
+uthread_blocking(void)
+{
+	if (!uthread_self() || !runq_pending())
+		return;
+	if (nidle)
+		worker_kick();
+	else
+		worker_add();
+}
+
+// ipc_recv for user threads.  The message is received by the calling
+// thread's worker, so a reply to a request this thread sent arrives
+// here as long as the thread does not yield in between.
+int32_t
+uthread_ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	uthread_blocking();
+	return ipc_recv(from_env_store, pg, perm_store);
+}
@@ -1,6 +1,12 @@
 #include "ns.h"
 
-extern union Nsipc nsipcbuf;
+// Pages that received packets are mapped into, in turn.  The kernel
+// refills the card's buffers with the pages it finds here, once the
+// network server has let go of them, so this ring is also the pool of
+// receive buffers.
+#define NSLOT	64
+
+static union Nsipc slots[NSLOT] __attribute__((aligned(PGSIZE)));
 
 void
 input(envid_t ns_envid)
@@ -14,44 +20,24 @@ input(envid_t ns_envid)
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
 
-	while(true) {
-
-	    int result;
-	    int perm;
-	    envid_t whom;
-
-	    if ((result = sys_page_alloc(thisenv->env_id, &nsipcbuf, PTE_W)) < 0){
-	        panic ("INPUT error %e", result);
-	    }
-
-	    result = sys_rx_pkg((void*) nsipcbuf.pkt.jp_data, MAX_PKG_SIZE);
-
-	    if (result < 0){
-	        cprintf ("\nINPUT: ipc_recv failed on %e. Ignoring", result);
-	        continue;
-	    }
-
-	    if (result == 0){
-	        continue;
-	    }
-
-	    int length = result;
-	    nsipcbuf.pkt.jp_len = result;
-
-#if 0
-	    int i;
-	    cprintf("\n::USER Start length %d\n", result);
-	    uint32_t* ptr = (uint32_t*) nsipcbuf.pkt.jp_data;
-	    for (i = 0; i < result / 4; i++){
-	        cprintf("0x%08x ", ptr[i]);
-	    }
-	    cprintf("\n::USER end\n");
-#endif
-
-	    ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_W | PTE_U | PTE_P);
-
-	    // Make sure receiving env will have access event even after getting a new package
-	    sys_page_unmap(0, &nsipcbuf);
-
+	int next = 0;
+
+	while (true) {
+		int i, n;
+
+		// Take every packet the card has, up to the end of the ring.
+		n = sys_rx_batch(&slots[next], NSLOT - next);
+		if (n == -E_E1000_RX_EMPTY) {
+			sys_wait(WAIT_NET_RX, NULL, 0, NULL, 0);
+			continue;
+		}
+		if (n < 0)
+			panic("net input sys_rx_batch: %e", n);
+
+		// The kernel stored each packet's length in jp_len.
+		for (i = 0; i < n; i++)
+			ipc_send(ns_envid, NSREQ_INPUT, &slots[next + i],
+				 PTE_W | PTE_U | PTE_P);
+		next = (next + n) % NSLOT;
 	}
 }
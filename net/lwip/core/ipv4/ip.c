@@ -224,7 +224,7 @@ ip_input(struct pbuf *p, struct netif *inp)
 
   /* verify checksum */
 #if CHECKSUM_CHECK_IP
-  if (inet_chksum(iphdr, iphdr_hlen) != 0) {
+  if (!(p->flags & PBUF_FLAG_IP_CSUM_OK) && inet_chksum(iphdr, iphdr_hlen) != 0) {
 
     LWIP_DEBUGF(IP_DEBUG | 2, ("Checksum (0x%"X16_F") failed, IP packet dropped.\n", inet_chksum(iphdr, iphdr_hlen)));
     ip_debug_print(p);
@@ -521,8 +521,9 @@ ip_output_if(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest,
   }
 
 #if IP_FRAG
-  /* don't fragment if interface has mtu set to 0 [loopif] */
-  if (netif->mtu && (p->tot_len > netif->mtu))
+  /* don't fragment if interface has mtu set to 0 [loopif], nor a TCP
+     super-segment, which the interface cuts up itself */
+  if (netif->mtu && (p->tot_len > netif->mtu) && !(p->flags & PBUF_FLAG_TSO))
     return ip_frag(p,netif,dest);
 #endif
 
@@ -236,6 +236,7 @@ pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
     p->len = p->tot_len = length;
     p->next = NULL;
     p->type = type;
+    p->ref_of = NULL;
     break;
   default:
     LWIP_ASSERT("pbuf_alloc: erroneous type", 0);
@@ -500,6 +501,10 @@ pbuf_free(struct pbuf *p)
         memp_free(MEMP_PBUF_POOL, p);
       /* is this a ROM or RAM referencing pbuf? */
       } else if (type == PBUF_ROM || type == PBUF_REF) {
+        /* let go of the pbuf whose data this one borrowed */
+        if (type == PBUF_REF && p->ref_of != NULL) {
+          pbuf_free(p->ref_of);
+        }
         memp_free(MEMP_PBUF, p);
       /* type == PBUF_RAM */
       } else {
@@ -58,6 +58,9 @@
 
 /* Forward declarations.*/
 static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
+#if TCP_TSO
+static u16_t tcp_output_tso(struct tcp_seg *seg, struct tcp_pcb *pcb, u32_t wnd);
+#endif /* TCP_TSO */
 
 /**
  * Called by tcp_close() to send a segment including flags but not data.
@@ -414,6 +417,9 @@ tcp_output(struct tcp_pcb *pcb)
   struct tcp_hdr *tcphdr;
   struct tcp_seg *seg, *useg;
   u32_t wnd;
+#if TCP_TSO
+  u16_t tso_left = 0;
+#endif /* TCP_TSO */
 #if TCP_CWND_DEBUG
   s16_t i = 0;
 #endif /* TCP_CWND_DEBUG */
@@ -523,7 +529,12 @@ tcp_output(struct tcp_pcb *pcb)
      *   RST is no sent using tcp_enqueue/tcp_output.
      */
     if((tcp_do_output_nagle(pcb) == 0) &&
-      ((pcb->flags & (TF_NAGLEMEMERR | TF_FIN)) == 0)){
+      ((pcb->flags & (TF_NAGLEMEMERR | TF_FIN)) == 0)
+#if TCP_TSO
+      /* nor in the middle of a super-segment, which is on the wire */
+      && tso_left == 0
+#endif /* TCP_TSO */
+      ){
       break;
     }
 #if TCP_CWND_DEBUG
@@ -542,6 +553,16 @@ tcp_output(struct tcp_pcb *pcb)
       pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
     }
 
+#if TCP_TSO
+    /* segments already sent as part of a super-segment only need
+       queueing on the unacked list */
+    if (tso_left == 0) {
+      tso_left = tcp_output_tso(seg, pcb, wnd);
+    }
+    if (tso_left > 0) {
+      tso_left--;
+    } else
+#endif /* TCP_TSO */
     tcp_output_segment(seg, pcb);
     pcb->snd_nxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
     if (TCP_SEQ_LT(pcb->snd_max, pcb->snd_nxt)) {
@@ -666,6 +687,109 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 #endif /* LWIP_NETIF_HWADDRHINT*/
 }
 
+#if TCP_TSO
+/**
+ * Called by tcp_output() to send the run of full-sized segments starting
+ * at seg, as far as the window allows, as one super-segment that the
+ * network interface cuts back into segments of pcb->mss. The segments
+ * stay on the unsent queue for tcp_output() to move on.
+ *
+ * @param seg the first tcp_seg to send
+ * @param pcb the tcp_pcb for the TCP connection used to send the segments
+ * @param wnd the window tcp_output() is sending in
+ * @return the number of segments sent, or 0 if seg should go on its own
+ */
+static u16_t
+tcp_output_tso(struct tcp_seg *seg, struct tcp_pcb *pcb, u32_t wnd)
+{
+  struct netif *netif;
+  struct tcp_hdr *tcphdr;
+  struct tcp_seg *s;
+  struct pbuf *p, *q, *r;
+  u16_t n, i, len, skip, left, piece;
+
+  netif = ip_route(&(pcb->remote_ip));
+  if (netif == NULL || !(netif->flags & NETIF_FLAG_TSO) ||
+      ip_addr_isany(&(pcb->local_ip))) {
+    return 0;
+  }
+
+  /* the run: back-to-back segments of a full MSS, without options, SYN
+     or FIN (a fast retransmit puts an old segment ahead of the rest) */
+  n = len = 0;
+  for (s = seg; s != NULL && s->len == pcb->mss && TCPH_HDRLEN(s->tcphdr) == 5 &&
+       (TCPH_FLAGS(s->tcphdr) & (TCP_SYN | TCP_FIN)) == 0 &&
+       ntohl(s->tcphdr->seqno) == ntohl(seg->tcphdr->seqno) + len &&
+       ntohl(s->tcphdr->seqno) - pcb->lastack + s->len <= wnd &&
+       len + s->len <= TCP_TSO_MAX; s = s->next) {
+    n++;
+    len += s->len;
+  }
+  if (n < 2) {
+    return 0;
+  }
+
+  /* a copy of the first segment's header, as the template for all */
+  p = pbuf_alloc(PBUF_IP, TCP_HLEN, PBUF_RAM);
+  if (p == NULL) {
+    return 0;
+  }
+  tcphdr = p->payload;
+  SMEMCPY(tcphdr, seg->tcphdr, TCP_HLEN);
+  tcphdr->ackno = htonl(pcb->rcv_nxt);
+  tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+  tcphdr->chksum = 0;
+
+  /* then references to the data of every segment; the first of each
+     holds the segment's pbuf, which may be freed (acknowledged, purged)
+     while the interface still has the super-segment */
+  for (i = 0, s = seg; i < n; i++, s = s->next) {
+    TCPH_SET_FLAG(tcphdr, TCPH_FLAGS(s->tcphdr) & TCP_PSH);
+    skip = (u16_t)((u8_t *)s->tcphdr - (u8_t *)s->p->payload) + TCP_HLEN;
+    left = s->len;
+    for (q = s->p; q != NULL && left > 0; q = q->next) {
+      if (skip >= q->len) {
+        skip -= q->len;
+        continue;
+      }
+      piece = LWIP_MIN(q->len - skip, left);
+      r = pbuf_alloc(PBUF_RAW, piece, PBUF_REF);
+      if (r == NULL) {
+        pbuf_free(p);
+        return 0;
+      }
+      r->payload = (u8_t *)q->payload + skip;
+      if (left == s->len) {
+        r->ref_of = s->p;
+        pbuf_ref(s->p);
+      }
+      pbuf_cat(p, r);
+      left -= piece;
+      skip = 0;
+    }
+  }
+  p->flags |= PBUF_FLAG_TSO;
+  p->tso_mss = pcb->mss;
+
+  /* Set retransmission timer running if it is not currently enabled */
+  if(pcb->rtime == -1)
+    pcb->rtime = 0;
+
+  if (pcb->rttest == 0) {
+    pcb->rttest = tcp_ticks;
+    pcb->rtseq = ntohl(seg->tcphdr->seqno);
+  }
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output_tso: %"U32_F":%"U32_F" in %"U16_F" segments\n",
+          ntohl(seg->tcphdr->seqno), ntohl(seg->tcphdr->seqno) + len, n));
+  TCP_STATS_INC(tcp.xmit);
+
+  ip_output_if(p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl, pcb->tos,
+      IP_PROTO_TCP, netif);
+  pbuf_free(p);
+  return n;
+}
+#endif /* TCP_TSO */
+
 /**
  * Send a TCP RESET packet (empty segment with RST flag set) either to
  * abort a connection or to show that there is no matching local connection
@@ -246,7 +246,7 @@ udp_input(struct pbuf *p, struct netif *inp)
 #endif /* LWIP_UDPLITE */
     {
 #if CHECKSUM_CHECK_UDP
-      if (udphdr->chksum != 0) {
+      if (udphdr->chksum != 0 && !(p->flags & PBUF_FLAG_L4_CSUM_OK)) {
         if (inet_chksum_pseudo(p, (struct ip_addr *)&(iphdr->src),
                                (struct ip_addr *)&(iphdr->dest),
                                IP_PROTO_UDP, p->tot_len) != 0) {
@@ -725,6 +725,21 @@
 #define TCP_SND_QUEUELEN                (4 * (TCP_SND_BUF/TCP_MSS))
 #endif
 
+/**
+ * TCP_TSO==1: Send runs of full-sized segments to a network interface
+ * with NETIF_FLAG_TSO as one super-segment of up to TCP_TSO_MAX bytes of
+ * data, which the interface cuts back into segments. The super-segment
+ * is a copy of the first segment's header followed by references to
+ * every segment's data, so nothing is copied. Needs CHECKSUM_GEN_TCP==0.
+ */
+#ifndef TCP_TSO
+#define TCP_TSO                         0
+#endif
+
+#ifndef TCP_TSO_MAX
+#define TCP_TSO_MAX                     (0xffff - IP_HLEN - TCP_HLEN)
+#endif
+
 /**
  * TCP_SNDLOWAT: TCP writable space (bytes). This must be less than or equal
  * to TCP_SND_BUF. It is the amount of space which must be available in the
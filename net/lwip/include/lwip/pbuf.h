@@ -60,6 +60,13 @@ typedef enum {
 
 /** indicates this packet's data should be immediately passed to the application */
 #define PBUF_FLAG_PUSH 0x01U
+/** indicates the network card found this packet's IP header checksum right */
+#define PBUF_FLAG_IP_CSUM_OK 0x02U
+/** indicates the network card found this packet's TCP or UDP checksum right */
+#define PBUF_FLAG_L4_CSUM_OK 0x04U
+/** indicates this packet is a TCP super-segment for the network card to cut
+    into segments of tso_mss bytes of data (see TCP_TSO) */
+#define PBUF_FLAG_TSO 0x08U
 
 struct pbuf {
   /** next pbuf in singly linked pbuf chain */
@@ -92,7 +99,13 @@ struct pbuf {
    * the stack itself, or pbuf->next pointers from a chain.
    */
   u16_t ref;
-  
+
+  /** with PBUF_FLAG_TSO, the data in each segment */
+  u16_t tso_mss;
+
+  /** for PBUF_REF, the pbuf whose data the payload points into, which
+      is kept referenced until this pbuf is freed; or NULL */
+  struct pbuf *ref_of;
 };
 
 /* Initializes the pbuf module. This call is empty for now, but may not be in future. */
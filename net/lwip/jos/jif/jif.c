@@ -40,15 +40,56 @@
 #include "lwip/mem.h"
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
+#include "lwip/udp.h"
 #include <lwip/stats.h>
 
 #include <netif/etharp.h>
 
-#define PKTMAP		0x10000000
+/*
+ * Packets handed to the card, which reads them as it sends them, so
+ * they must stay put until then.  The kernel refills a transmit
+ * descriptor only once the card is done with it, so by the time
+ * another ring's worth of fragments have been queued behind a packet,
+ * the card has sent it.  tx_held[] keeps a reference to each packet in
+ * the slot of its last fragment.
+ */
+#define TX_HELD		64	/* The card's transmit ring */
+
+static struct pbuf *tx_held[TX_HELD];
+static int tx_next;
+
+/*
+ * Packets waiting for room in the card's transmit ring, oldest first.
+ * low_level_output() queues rather than blocks, since while it slept
+ * nothing else in the network server could run; the server's main
+ * loop calls jif_flush() once the card has room again.
+ */
+#define TX_PEND		64
+
+static struct tx_pend {
+    struct pbuf *p;
+    int flags;		/* JIF_CSUM_* and JIF_TSO for the first fragment */
+    u16_t mss;
+} tx_pend[TX_PEND];
+static int tx_pend_first, tx_pend_count;
+
+/*
+ * The most the card needs of a frame's headers, which must all be in
+ * its first fragment: Ethernet, IP and TCP headers with options.
+ */
+#define TX_HDRMAX	(14 + 60 + 60)
+
+/*
+ * The jumbo frame low_level_input() is putting together from the pages
+ * it comes in (see JIF_RX_MORE), and whether to drop the rest of it.
+ */
+static struct pbuf *rx_frame;
+static int rx_dropping;
 
 struct jif {
     struct eth_addr *ethaddr;
-    envid_t envid;
 };
 
 static void
@@ -57,8 +98,8 @@ low_level_init(struct netif *netif)
     int r;
 
     netif->hwaddr_len = 6;
-    netif->mtu = 1500;
-    netif->flags = NETIF_FLAG_BROADCAST;
+    netif->mtu = JIF_MTU;
+    netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_TSO;
 
     /*
     // MAC address is hardcoded to eliminate a system call
@@ -89,6 +130,181 @@ low_level_init(struct netif *netif)
 
 }
 
+/*
+ * The IPv4 header in an Ethernet frame of 'len' bytes, or NULL.
+ */
+static struct ip_hdr *
+frame_iphdr(char *frame, int len)
+{
+    struct eth_hdr *ethhdr = (struct eth_hdr *)frame;
+    struct ip_hdr *iphdr = (struct ip_hdr *)(frame + sizeof(struct eth_hdr));
+
+    if (len < (int)(sizeof(struct eth_hdr) + IP_HLEN) ||
+	ethhdr->type != htons(ETHTYPE_IP) || IPH_V(iphdr) != 4 ||
+	IPH_HL(iphdr) * 4 < IP_HLEN ||
+	sizeof(struct eth_hdr) + IPH_HL(iphdr) * 4 > len)
+	return NULL;
+    return iphdr;
+}
+
+/*
+ * tx_offload():
+ *
+ * lwIP leaves the checksums of outgoing packets to the card (see
+ * lwipopts.h).  Set up the frame of 'len' bytes for it: the card sums
+ * the IP header with its checksum field zeroed, and a TCP or UDP
+ * segment starting from the sum of the pseudo header, which it does
+ * not know about.  A fragment carries only part of its segment, so its
+ * TCP or UDP checksum cannot be filled in; lwIP never fragments TCP,
+ * and UDP goes without (checksum 0).  'len' may cover only the start
+ * of the frame.  With 'tso', the frame is a TCP super-segment, whose
+ * pseudo header the card adds each segment's length to.  Returns the
+ * JIF_CSUM_* and JIF_TSO flags, or -1 if the headers the card needs do
+ * not all lie in those 'len' bytes.
+ */
+static int
+tx_offload(char *frame, int len, int tso)
+{
+    struct eth_hdr *ethhdr = (struct eth_hdr *)frame;
+    struct ip_hdr *iphdr;
+    u16_t *chksum, l4len;
+    u32_t sum;
+    char *l4;
+    int i;
+
+    if (len < (int)sizeof(struct eth_hdr))
+	return -1;
+    if (ethhdr->type != htons(ETHTYPE_IP))
+	return 0;
+    if ((iphdr = frame_iphdr(frame, len)) == NULL)
+	return -1;
+    IPH_CHKSUM_SET(iphdr, 0);
+    if (IPH_OFFSET(iphdr) & htons(IP_MF | IP_OFFMASK))
+	return JIF_CSUM_IP;
+
+    l4 = (char *)iphdr + IPH_HL(iphdr) * 4;
+    switch (IPH_PROTO(iphdr)) {
+    case IP_PROTO_TCP:
+	chksum = &((struct tcp_hdr *)l4)->chksum;
+	break;
+    case IP_PROTO_UDP:
+	chksum = &((struct udp_hdr *)l4)->chksum;
+	break;
+    default:
+	return JIF_CSUM_IP;
+    }
+    if ((char *)(chksum + 1) > frame + len)
+	return -1;
+
+    /* Source and destination addresses, protocol, and segment length */
+    tso = tso && IPH_PROTO(iphdr) == IP_PROTO_TCP;
+    l4len = tso ? 0 : ntohs(IPH_LEN(iphdr)) - IPH_HL(iphdr) * 4;
+    sum = htons(IPH_PROTO(iphdr)) + htons(l4len);
+    for (i = 0; i < 4; i++)
+	sum += ((u16_t *)&iphdr->src)[i];
+    while (sum >> 16)
+	sum = (sum & 0xffff) + (sum >> 16);
+    *chksum = sum;
+    return JIF_CSUM_IP | JIF_CSUM_L4 | (tso ? JIF_TSO : 0);
+}
+
+/*
+ * tx_frags():
+ *
+ * Describe the pbuf chain 'p' to the card as fragments in 'txds', one
+ * for each page a pbuf spans.  Returns how many, or -1 if it takes
+ * more than JIF_TX_MAXFRAG.
+ */
+static int
+tx_frags(struct pbuf *p, struct jif_txd *txds)
+{
+    struct pbuf *q;
+    char *va;
+    int n = 0, len, chunk;
+
+    for (q = p; q != NULL; q = q->next)
+	for (va = q->payload, len = q->len; len > 0; va += chunk, len -= chunk) {
+	    if (n == JIF_TX_MAXFRAG)
+		return -1;
+	    chunk = MIN(len, (int)(PGSIZE - PGOFF(va)));
+	    txds[n].jt_va = va;
+	    txds[n].jt_len = chunk;
+	    txds[n].jt_flags = JIF_TX_MORE;
+	    n++;
+	}
+    if (n == 0)
+	return -1;
+    txds[n - 1].jt_flags = 0;
+    return n;
+}
+
+/*
+ * tx_hold():
+ *
+ * Take the next slot of tx_held[] for a fragment just queued, with 'p'
+ * if it ends its packet, and let go of the packet whose slot it was.
+ */
+static void
+tx_hold(struct pbuf *p)
+{
+    if (tx_held[tx_next] != NULL)
+	pbuf_free(tx_held[tx_next]);
+    tx_held[tx_next] = p;
+    tx_next = (tx_next + 1) % TX_HELD;
+}
+
+/*
+ * tx_send():
+ *
+ * Hand the card packet 'q', whose headers tx_offload() has prepared,
+ * with 'flags' and 'mss' for its first fragment.  On success the
+ * packet is held until the card has sent it.  Returns 0, or the error
+ * of sys_tx_batch.
+ */
+static int
+tx_send(struct pbuf *q, int flags, u16_t mss)
+{
+    struct jif_txd txds[JIF_TX_MAXFRAG];
+    int n, i, r;
+
+    if ((n = tx_frags(q, txds)) < 0)
+	return -E_INVAL;
+    txds[0].jt_flags |= flags;
+    txds[0].jt_mss = mss;
+    if ((r = sys_tx_batch(txds, n)) < 0)
+	return r;
+    for (i = 0; i < n; i++)
+	tx_hold(i == n - 1 ? q : NULL);
+    return 0;
+}
+
+/*
+ * jif_flush():
+ *
+ * Send the packets queued while the card's transmit ring was full, as
+ * far as there is room.  Returns how many are still waiting.
+ */
+int
+jif_flush(struct netif *netif)
+{
+    struct tx_pend *tp;
+    int r;
+
+    while (tx_pend_count > 0) {
+	tp = &tx_pend[tx_pend_first];
+	if ((r = tx_send(tp->p, tp->flags, tp->mss)) == -E_E1000_TX_FULL)
+	    break;
+	/* Otherwise it is sent, or a bad packet, or the card is in
+	 * netmap mode */
+	if (r < 0)
+	    pbuf_free(tp->p);
+	tp->p = NULL;
+	tx_pend_first = (tx_pend_first + 1) % TX_PEND;
+	tx_pend_count--;
+    }
+    return tx_pend_count;
+}
+
 /*
  * low_level_output():
  *
@@ -96,37 +312,63 @@ low_level_init(struct netif *netif)
  * contained in the pbuf that is passed to the function. This pbuf
  * might be chained.
  *
+ * The card gathers the packet straight from the pbufs, which we hold
+ * on to until it has sent them.  A chain in too many pieces, or whose
+ * headers are not all in its first page-sized fragment, goes out of a
+ * copy instead.  A TCP super-segment (PBUF_FLAG_TSO) the card cuts
+ * into segments itself.  If the card has no room, the packet waits
+ * for jif_flush().
  */
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
-
-    struct jif *jif;
-    jif = netif->state;
-
-    char *txbuf = pkt->jp_data;
-    int txsize = 0;
-    struct pbuf *q;
-    for (q = p; q != NULL; q = q->next) {
-	/* Send the data from the pbuf to the interface, one pbuf at a
-	   time. The size of the data in each pbuf is kept in the ->len
-	   variable. */
-
-	if (txsize + q->len > 2000)
-	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
-	memcpy(&txbuf[txsize], q->payload, q->len);
-	txsize += q->len;
+    struct jif_txd txds[JIF_TX_MAXFRAG];
+    struct tx_pend *tp;
+    struct pbuf *q = p;
+    int tso = p->flags & PBUF_FLAG_TSO;
+    int flags, skip, r;
+
+    if ((!tso && p->tot_len > netif->mtu + sizeof(struct eth_hdr)) ||
+	p->tot_len > 0xffff - TX_HDRMAX)
+	return ERR_IF;
+
+    if (tx_frags(p, txds) < 0 ||
+	(flags = tx_offload(txds[0].jt_va, txds[0].jt_len, tso)) < 0) {
+	/* Copy into one buffer, with its start moved past a page
+	 * boundary that would split the headers. */
+	if ((q = pbuf_alloc(PBUF_RAW, p->tot_len + TX_HDRMAX, PBUF_RAM)) == NULL)
+	    return ERR_MEM;
+	skip = PGSIZE - PGOFF(q->payload);
+	if (skip < TX_HDRMAX)
+	    pbuf_header(q, -skip);
+	pbuf_realloc(q, p->tot_len);
+	pbuf_copy(q, p);
+	if (tx_frags(q, txds) < 0 ||
+	    (flags = tx_offload(txds[0].jt_va, txds[0].jt_len, tso)) < 0)
+	    flags = 0;
+    } else
+	pbuf_ref(q);
+
+    /* Keep packets in order behind any that are waiting */
+    if (tx_pend_count == 0 &&
+	(r = tx_send(q, flags, tso ? p->tso_mss : 0)) != -E_E1000_TX_FULL) {
+	if (r < 0) {
+	    /* A bad packet, or the card is in netmap mode */
+	    pbuf_free(q);
+	    return ERR_IF;
+	}
+	return ERR_OK;
     }
 
-    pkt->jp_len = txsize;
-
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
-
+    if (tx_pend_count == TX_PEND) {
+	pbuf_free(q);
+	return ERR_MEM;
+    }
+    tp = &tx_pend[(tx_pend_first + tx_pend_count) % TX_PEND];
+    tp->p = q;
+    tp->flags = flags;
+    tp->mss = tso ? p->tso_mss : 0;
+    tx_pend_count++;
     return ERR_OK;
 }
 
@@ -142,27 +384,64 @@ low_level_input(void *va)
 {
     struct jif_pkt *pkt = (struct jif_pkt *)va;
     s16_t len = pkt->jp_len;
+    struct ip_hdr *iphdr;
+    struct pbuf *p;
+
+    if (!rx_dropping) {
+	p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+	if (p == 0) {
+	    if (rx_frame)
+		pbuf_free(rx_frame);
+	    rx_frame = 0;
+	    rx_dropping = 1;
+	} else {
+	    /* We iterate over the pbuf chain until we have read the entire
+	     * packet into the pbuf. */
+	    void *rxbuf = (void *) pkt->jp_data;
+	    int copied = 0;
+	    struct pbuf *q;
+	    for (q = p; q != NULL; q = q->next) {
+		/* Read enough bytes to fill this pbuf in the chain. The
+		 * available data in the pbuf is given by the q->len
+		 * variable. */
+		int bytes = q->len;
+		if (bytes > (len - copied))
+		    bytes = len - copied;
+		memcpy(q->payload, rxbuf + copied, bytes);
+		copied += bytes;
+	    }
+
+	    if (rx_frame)
+		pbuf_cat(rx_frame, p);
+	    else
+		rx_frame = p;
+	}
+    }
 
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+    /* Wait for the rest of a jumbo frame */
+    if (pkt->jp_flags & JIF_RX_MORE)
+	return 0;
+    p = rx_frame;
+    rx_frame = 0;
+    rx_dropping = 0;
     if (p == 0)
 	return 0;
 
-    /* We iterate over the pbuf chain until we have read the entire
-     * packet into the pbuf. */
-    void *rxbuf = (void *) pkt->jp_data;
-    int copied = 0;
-    struct pbuf *q;
-    for (q = p; q != NULL; q = q->next) {
-	/* Read enough bytes to fill this pbuf in the chain. The
-	 * available data in the pbuf is given by the q->len
-	 * variable. */
-	int bytes = q->len;
-	if (bytes > (len - copied))
-	    bytes = len - copied;
-	memcpy(q->payload, rxbuf + copied, bytes);
-	copied += bytes;
+    /* The card found a bad checksum */
+    if (pkt->jp_flags & JIF_CSUM_BAD) {
+	pbuf_free(p);
+	return 0;
     }
 
+    /* Let lwIP skip the checksums the card has checked.  A fragment's
+     * TCP or UDP checksum is checked once it is reassembled. */
+    if (pkt->jp_flags & JIF_CSUM_IP)
+	p->flags |= PBUF_FLAG_IP_CSUM_OK;
+    if ((pkt->jp_flags & JIF_CSUM_L4) &&
+	(iphdr = frame_iphdr(p->payload, p->len)) != NULL &&
+	!(IPH_OFFSET(iphdr) & htons(IP_MF | IP_OFFMASK)))
+	p->flags |= PBUF_FLAG_L4_CSUM_OK;
+
     return p;
 }
 /*
@@ -242,7 +521,6 @@ err_t
 jif_init(struct netif *netif)
 {
     struct jif *jif;
-    envid_t *output_envid; 
 
     jif = mem_malloc(sizeof(struct jif));
 
@@ -251,15 +529,12 @@ jif_init(struct netif *netif)
 	return ERR_MEM;
     }
 
-    output_envid = (envid_t *)netif->state;
-
     netif->state = jif;
     netif->output = jif_output;
     netif->linkoutput = low_level_output;
     memcpy(&netif->name[0], "en", 2);
 
     jif->ethaddr = (struct eth_addr *)&(netif->hwaddr[0]);
-    jif->envid = *output_envid; 
 
     low_level_init(netif);
 
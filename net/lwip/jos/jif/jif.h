@@ -1,4 +1,5 @@
 #include <lwip/netif.h>
 
 void	jif_input(struct netif *netif, void *va);
+int	jif_flush(struct netif *netif);
 err_t	jif_init(struct netif *netif);
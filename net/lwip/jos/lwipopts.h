@@ -22,7 +22,9 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 #define MEM_ALIGNMENT		4
 
-#define MEMP_NUM_PBUF		64
+// TCP super-segments take a PBUF_REF per piece of data, which jif.c
+// holds on to until the card has sent it.
+#define MEMP_NUM_PBUF		128
 #define MEMP_NUM_UDP_PCB	8
 #define MEMP_NUM_TCP_PCB	32
 #define MEMP_NUM_TCP_PCB_LISTEN	16
@@ -35,14 +37,32 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define MEM_SIZE		(PER_TCP_PCB_BUFFER*MEMP_NUM_TCP_SEG + 4096*MEMP_NUM_TCP_SEG)
 
 #define PBUF_POOL_SIZE		512
-#define PBUF_POOL_BUFSIZE	2000
+// A received page holds up to 2048 bytes, the card's buffer size
+#define PBUF_POOL_BUFSIZE	2048
 
-#define TCP_MSS			1460
+// The e1000 inserts outgoing IP, TCP and UDP checksums (see jif.c), and
+// checks incoming ones; lwIP checks only what the card could not.
+#define CHECKSUM_GEN_IP		0
+#define CHECKSUM_GEN_UDP	0
+#define CHECKSUM_GEN_TCP	0
+
+// The network interface's MTU (see jif.c).  Up to 9000 for jumbo
+// frames (MAX_JUMBO_SIZE in inc/ns.h), but only if every host on the
+// link takes them.
+#define JIF_MTU			1500
+
+#define TCP_MSS			(JIF_MTU - 40)
 #define TCP_WND			24000
-#define TCP_SND_BUF		(16 * TCP_MSS)
-// lwip prints a warning if TCP_SND_QUEUELEN < (2 * TCP_SND_BUF/TCP_MSS), 
-// but 16 is faster.. 
-#define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF/TCP_MSS)
+// Sixteen segments' worth, but the send buffer is counted in a u16_t,
+// so with jumbo frames it stops at the largest multiple of the MSS
+// that fits.
+#define TCP_SND_BUF		(TCP_MSS * (0xffff / TCP_MSS < 16 ? 0xffff / TCP_MSS : 16))
+// lwip prints a warning if TCP_SND_QUEUELEN < (2 * TCP_SND_BUF/TCP_MSS)
+#define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF / TCP_MSS)
+// The e1000 cuts super-segments as big as the send buffer back into
+// segments (see jif.c).
+#define TCP_TSO			1
+#define TCP_TSO_MAX		TCP_SND_BUF
 //#define TCP_SND_QUEUELEN	16
 
 // Print error messages when we run out of memory
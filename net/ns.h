@@ -11,9 +11,6 @@
 #define QUEUE_SIZE	20
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
-/* timer.c */
-void timer(envid_t ns_envid, uint32_t initial_to);
-
 /* input.c */
 void input(envid_t ns_envid);
 
@@ -1,6 +1,38 @@
-#include <inc/lib.h>
+#include "ns.h"
 
-extern union Nsipc nsipcbuf;
+// Packets held while the card's transmit ring is full.  Each arrives
+// in its own page, received into one of these slots.
+#define NSLOT	32
+
+static union Nsipc slots[NSLOT] __attribute__((aligned(PGSIZE)));
+static int shead, scount;	// Pending packets are slots[shead..+scount)
+
+// Hand the card as many pending packets as it has room for, in one
+// system call.
+static void
+flush(void)
+{
+	struct jif_txd txds[NSLOT];
+	struct jif_pkt *pkt;
+	int i, r;
+
+	for (i = 0; i < scount; i++) {
+		pkt = &slots[(shead + i) % NSLOT].pkt;
+		txds[i].jt_va = pkt->jp_data;
+		txds[i].jt_len = pkt->jp_len;
+		// One page, one fragment
+		txds[i].jt_flags = pkt->jp_flags & ~JIF_TX_MORE;
+	}
+	if ((r = sys_tx_batch(txds, scount)) == -E_E1000_TX_FULL)
+		return;
+	if (r < 0) {
+		// Drop a bad packet rather than wedge the queue behind it.
+		cprintf("net output sys_tx_batch: %e\n", r);
+		r = 1;
+	}
+	shead = (shead + r) % NSLOT;
+	scount -= r;
+}
 
 void
 output(envid_t ns_envid)
@@ -13,44 +45,33 @@ output(envid_t ns_envid)
 
 	sys_set_service();
 
-	while (true){
-
-	    int result;
-        int perm;
-        bool error = false;
-        if (( result = ipc_recv(&ns_envid, &nsipcbuf, &perm)) < 0 ){
-            cprintf("\nnet output ipc_recv: %e", result);
-            error = true;
-        }
-
-        if (result != NSREQ_OUTPUT){
-            cprintf("\nnet output ipc_recv incorrect result: result %d", result);
-            error = true;
-        }
-
-        if ((perm & (PTE_P|PTE_W|PTE_U)) != (PTE_P|PTE_W|PTE_U)){
-            cprintf("net output ipc_recv incorrect perm: 0x%x", perm);
-            error = true;
-        }
-
-        if (error){
-            continue;
-        }
-
-        char* data = nsipcbuf.pkt.jp_data;
-        uint32_t len = nsipcbuf.pkt.jp_len;
-
-        //cprintf("\n=========OUTPUT envid %x %p len %d",thisenv->env_id, data, len );
-        while (true){
-            if ((result = sys_tx_pkg(data, len)) < 0){
-                if (result == -E_E1000_TX_FULL){
-                    sys_yield();
-                    continue;
-                }
-                panic ("\nnet output sys_tx_pkg %e", result);
-            }
-            break;
-        }
-        //cprintf("\n=========OUTPUT envid %x finished",thisenv->env_id);
+	while (true) {
+		void *slot = &slots[(shead + scount) % NSLOT];
+		uint32_t events;
+		int r;
+
+		// Wait for another packet, or for the card to make room for
+		// the ones we hold, whichever comes first.
+		events = 0;
+		if (scount < NSLOT)
+			events |= WAIT_IPC;
+		if (scount > 0)
+			events |= WAIT_NET_TX;
+		if ((r = sys_wait(events, NULL, 0, slot, 0)) < 0)
+			panic("net output sys_wait: %e", r);
+
+		if (r == WAIT_IPC) {
+			if (thisenv->env_ipc_value != NSREQ_OUTPUT)
+				cprintf("net output ipc_recv incorrect result: %d\n",
+					thisenv->env_ipc_value);
+			else if ((thisenv->env_ipc_perm & (PTE_P|PTE_W|PTE_U))
+				 != (PTE_P|PTE_W|PTE_U))
+				cprintf("net output ipc_recv incorrect perm: 0x%x\n",
+					thisenv->env_ipc_perm);
+			else
+				scount++;
+		}
+		if (scount > 0)
+			flush();
 	}
 }
@@ -43,9 +43,7 @@ static struct timer_thread t_arp;
 static struct timer_thread t_tcpf;
 static struct timer_thread t_tcps;
 
-static envid_t timer_envid;
 static envid_t input_envid;
-static envid_t output_envid;
 
 static bool buse[QUEUE_SIZE];
 static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
@@ -142,7 +140,7 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	thread_wait(&done, 0, (uint32_t)~0);
 	lwip_core_lock();
 
-	lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+	lwip_init(&nif, NULL, ipaddr, netmask, gw);
 
 	start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
 	start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
@@ -160,21 +158,37 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	cprintf("NS: TCP/IP initialized.\n");
 }
 
-static void
-process_timer(envid_t envid) {
-	uint32_t start, now, to;
-
-	if (envid != timer_envid) {
-		cprintf("NS: received timer interrupt from envid %x not timer env\n", envid);
-		return;
+// Give the lwIP timer threads a chance to run if TIMER_INTERVAL has
+// passed since they last did.  Returns how long serve() may sleep
+// before calling this again.
+static uint32_t
+process_timer(void) {
+	static uint32_t next;
+	uint32_t now = sys_time_msec();
+
+	if ((int32_t) (next - now) <= 0) {
+		thread_yield();
+		now = sys_time_msec();
+		next = now + TIMER_INTERVAL;
 	}
+	return next - now;
+}
 
-	start = sys_time_msec();
-	thread_yield();
-	now = sys_time_msec();
+// Like ipc_recv_timeout, but if 'tx' is set, also give up with
+// -E_AGAIN once the card has room for the packets jif has queued.
+static int32_t
+serve_recv(uint32_t *whom, void *va, int *perm, uint32_t to, bool tx)
+{
+	int r;
 
-	to = TIMER_INTERVAL - (now - start);
-	ipc_send(envid, to, 0, 0);
+	if (!tx)
+		return ipc_recv_timeout((int32_t *) whom, va, perm, to);
+
+	if ((r = sys_wait(WAIT_IPC | WAIT_NET_TX, NULL, 0, va, to)) != WAIT_IPC)
+		return r == WAIT_NET_TX ? -E_AGAIN : r;
+	*whom = thisenv->env_ipc_from;
+	*perm = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
 }
 
 struct st_args {
@@ -257,8 +271,8 @@ serve_thread(uint32_t a) {
 void
 serve(void) {
 	int32_t reqno;
-	uint32_t whom;
-	int i, perm;
+	uint32_t whom, to;
+	int i, perm, tx;
 	void *va;
 
 	while (1) {
@@ -268,19 +282,24 @@ serve(void) {
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
+		// Send what lwIP queued while the card's ring was full.
+		lwip_core_lock();
+		tx = jif_flush(&nif);
+		lwip_core_unlock();
+
+		// Sleep until a request arrives, the lwIP timers are due, or
+		// the card has room for the rest.
+		to = process_timer();
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
-		if (debug) {
-			cprintf("ns req %d from %08x\n", reqno, whom);
-		}
-
-		// first take care of requests that do not contain an argument page
-		if (reqno == NSREQ_TIMER) {
-			process_timer(whom);
+		reqno = serve_recv(&whom, va, &perm, to, tx > 0);
+		if (reqno == -E_TIMEOUT || reqno == -E_AGAIN) {
 			put_buffer(va);
 			continue;
 		}
+		if (debug) {
+			cprintf("ns req %d from %08x\n", reqno, whom);
+		}
 
 		// All remaining requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -318,15 +337,6 @@ umain(int argc, char **argv)
 
 	binaryname = "ns";
 
-	// fork off the timer thread which will send us periodic messages
-	timer_envid = fork();
-	if (timer_envid < 0)
-		panic("error forking");
-	else if (timer_envid == 0) {
-		timer(ns_envid, TIMER_INTERVAL);
-		return;
-	}
-
 	// fork off the input thread which will poll the NIC driver for input
 	// packets
 	input_envid = fork();
@@ -337,15 +347,9 @@ umain(int argc, char **argv)
 		return;
 	}
 
-	// fork off the output thread that will send the packets to the NIC
-	// driver
-	output_envid = fork();
-	if (output_envid < 0)
-		panic("error forking");
-	else if (output_envid == 0) {
-		output(ns_envid);
-		return;
-	}
+	// There is no output environment: the network interface hands
+	// packets to the NIC driver itself, straight from lwIP's buffers,
+	// and queues them for serve() while the card's ring is full.
 
 	// lwIP requires a user threading library; start the library and jump
 	// into a thread to continue initialization.
@@ -0,0 +1,154 @@
+// IPC microbenchmarks.
+//
+// Measures round trips between a client and a server environment, with
+// and without a page attached, with both ends pinned to the same CPU or
+// to different CPUs, and with several clients sharing one server.
+// Every result is printed as a single line
+//
+//	ipcbench: test=<name> cpus=<same|cross|any> clients=<n> ops=<n> cycles/op=<n>
+//
+// so that runs before and after an IPC or scheduler change can be
+// compared with grep.  Usage: ipcbench [rounds]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define PAGEVA		((void *) 0xA0000000)
+#define PAGEPERM	(PTE_P|PTE_U)
+#define NCLIENTS	4
+
+static int rounds = 10000;
+
+static void
+report(const char *test, const char *cpus, int clients, uint64_t ops,
+       uint64_t cycles)
+{
+	cprintf("ipcbench: test=%s cpus=%s clients=%d ops=%llu cycles/op=%llu\n",
+		test, cpus, clients, ops, ops ? cycles / ops : 0);
+}
+
+// Pin the calling environment to 'cpu' and get scheduled there.
+static int
+pin(int cpu)
+{
+	int r;
+
+	if ((r = sys_env_set_affinity(0, cpu)) < 0)
+		return r;
+	sys_yield();
+	return 0;
+}
+
+// Client side of a round-trip test: one untimed warm-up round, then
+// 'rounds' timed ones.  Returns the cycles spent in the timed rounds.
+static uint64_t
+client(envid_t server, bool page)
+{
+	uint64_t start = 0;
+	int i;
+
+	for (i = 0; i <= rounds; i++) {
+		if (i == 1)
+			start = read_tsc();
+		ipc_send(server, i, page ? PAGEVA : 0, page ? PAGEPERM : 0);
+		ipc_recv(0, page ? PAGEVA : 0, 0);
+	}
+	return read_tsc() - start;
+}
+
+// Server side: echo 'n' requests back to whoever sent them.
+static void
+server(int n, bool page)
+{
+	envid_t who;
+	int32_t v;
+
+	while (n-- > 0) {
+		v = ipc_recv(&who, page ? PAGEVA : 0, 0);
+		ipc_send(who, v, page ? PAGEVA : 0, page ? PAGEPERM : 0);
+	}
+}
+
+// One client, one server.  'cpus' is "same", "cross" or "any".
+static void
+pingpong(const char *test, const char *cpus, bool page)
+{
+	int server_cpu = -1, client_cpu = -1;
+	envid_t parent = thisenv->env_id, child;
+	uint64_t cycles;
+
+	if (strcmp(cpus, "same") == 0)
+		server_cpu = client_cpu = 0;
+	else if (strcmp(cpus, "cross") == 0)
+		server_cpu = 0, client_cpu = 1;
+
+	if (client_cpu > 0 && sys_env_set_affinity(0, client_cpu) < 0) {
+		cprintf("ipcbench: test=%s cpus=%s skipped (single CPU)\n",
+			test, cpus);
+		return;
+	}
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (client_cpu >= 0)
+			pin(client_cpu);
+		cycles = client(parent, page);
+		report(test, cpus, 1, rounds, cycles);
+		exit();
+	}
+
+	if (server_cpu >= 0)
+		pin(server_cpu);
+	server(rounds + 1, page);
+	wait(child);
+	sys_env_set_affinity(0, -1);
+}
+
+// NCLIENTS clients hammering one server; reports the server's view.
+static void
+fanin(const char *test, bool page)
+{
+	envid_t parent = thisenv->env_id, child[NCLIENTS];
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < NCLIENTS; i++) {
+		if ((child[i] = fork()) < 0)
+			panic("fork: %e", child[i]);
+		if (child[i] == 0) {
+			client(parent, page);
+			exit();
+		}
+	}
+
+	// Absorb the clients' untimed warm-up rounds.
+	server(NCLIENTS, page);
+	start = read_tsc();
+	server(NCLIENTS * rounds, page);
+	report(test, "any", NCLIENTS, (uint64_t) NCLIENTS * rounds,
+	       read_tsc() - start);
+
+	for (i = 0; i < NCLIENTS; i++)
+		wait(child[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	binaryname = "ipcbench";
+	if (argc > 1 && (rounds = strtol(argv[1], 0, 0)) <= 0)
+		panic("usage: ipcbench [rounds]");
+
+	if ((r = sys_page_alloc(0, PAGEVA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	pingpong("value", "same", false);
+	pingpong("value", "cross", false);
+	pingpong("page", "same", true);
+	pingpong("page", "cross", true);
+	fanin("fanin-value", false);
+	fanin("fanin-page", true);
+}
@@ -0,0 +1,45 @@
+// Test buffered console output.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int fd, r;
+
+	// Writes to a console fd are buffered; pieces of a line go out
+	// together, whatever the buffering mode.
+	if ((fd = opencons()) < 0)
+		panic("opencons: %e", fd);
+	if ((r = csetbuf(_IONBF)) < 0)
+		panic("csetbuf: %e", r);
+	cputchar('c');
+	fprintf(fd, "ons ");
+	fprintf(fd, "unbuffered OK\n");
+
+	csetbuf(_IOLBF);
+	fprintf(fd, "cons ");
+	cputchar('l');
+	fprintf(fd, "ine OK\n");
+
+	// cprintf always reaches the console, after anything buffered.
+	csetbuf(_IOFBF);
+	fprintf(fd, "cons ");
+	cprintf("cprintf OK\n");
+
+	// fork flushes first, so the child does not print this again.
+	fprintf(fd, "cons fork");
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		fprintf(fd, " child OK\n");
+		return;
+	}
+	wait(child);
+	fprintf(fd, "cons done OK\n");
+	cflush();
+
+	if (csetbuf(42) != -E_INVAL)
+		panic("csetbuf accepted a bad mode");
+}
@@ -0,0 +1,77 @@
+// Test checksum offload: send a UDP and a TCP packet with their
+// checksums left to the card.  The grade script checks what went out
+// on the wire in the packet capture.
+
+#include <inc/lib.h>
+#include <inc/ns.h>
+#include <inc/nettest.h>
+
+static uint8_t *frame = UTEMP;
+
+// Build an IPv4 packet of protocol 'proto' to 10.0.2.2 whose payload,
+// after an 'l4hlen'-byte header, is 'msg'.  The IP checksum is left 0
+// and the TCP/UDP one seeded with the pseudo header, as the card wants.
+// Returns the frame's length.
+static int
+build(uint8_t proto, int l4hlen, int csumoff, const char *msg)
+{
+	int len = strlen(msg);
+	uint8_t *l4;
+
+	l4 = nettest_ip(frame, proto, l4hlen, len, 4321);
+	memcpy(l4 + l4hlen, msg, len);
+	put16(l4 + csumoff, nettest_pseudo(frame, l4hlen + len));
+	return ETH_HLEN + IP_HLEN + l4hlen + len;
+}
+
+static void
+send(int len, uint32_t flags)
+{
+	struct jif_txd txd;
+	int r;
+
+	txd.jt_va = frame;
+	txd.jt_len = len;
+	txd.jt_flags = flags;
+	while ((r = sys_tx_batch(&txd, 1)) == -E_E1000_TX_FULL)
+		sys_yield();
+	if (r != 1)
+		panic("sys_tx_batch: %e", r);
+	// The card reads the frame when it sends it, so build the next
+	// one in a fresh page.
+	if ((r = sys_page_alloc(0, frame, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct jif_txd txd;
+	uint8_t *tcp;
+	int len, r;
+
+	if ((r = sys_page_alloc(0, frame, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	len = build(17, 8, 6, "checksum offload UDP");
+	put16(frame + ETH_HLEN + IP_HLEN + 4, len - ETH_HLEN - IP_HLEN);
+	send(len, JIF_CSUM_IP | JIF_CSUM_L4);
+
+	len = build(6, 20, 16, "checksum offload TCP");
+	tcp = frame + ETH_HLEN + IP_HLEN;
+	tcp[12] = 5 << 4;	// Header length
+	tcp[13] = 0x18;		// PSH, ACK
+	put16(tcp + 14, 8192);	// Window
+	send(len, JIF_CSUM_IP | JIF_CSUM_L4);
+
+	// Offload needs an IPv4 frame.
+	len = build(17, 8, 6, "not IP");
+	put16(frame + 12, 0x0806);
+	txd.jt_va = frame;
+	txd.jt_len = len;
+	txd.jt_flags = JIF_CSUM_L4;
+	if ((r = sys_tx_batch(&txd, 1)) != -E_INVAL)
+		panic("sys_tx_batch offloaded a non-IP frame: %e", r);
+
+	cprintf("checksum offload sent\n");
+}
@@ -0,0 +1,56 @@
+// Test futex wait/wake across a PTE_SHARE mapping.
+
+#include <inc/lib.h>
+
+#define SHVA	((volatile uint32_t *) 0xA0000000)
+
+void
+umain(int argc, char **argv)
+{
+	volatile uint32_t *word = SHVA, *done = SHVA + 1;
+	unsigned start;
+	envid_t child;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) SHVA, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	// A stale value must not block.
+	if ((r = sys_futex_wait(word, 1, 0)) != -E_AGAIN)
+		panic("futex_wait with stale value returned %e", r);
+
+	// Nobody is waiting yet.
+	if ((r = sys_futex_wake(word, 1)) != 0)
+		panic("futex_wake with no waiters returned %d", r);
+
+	// A wait with a deadline must expire.
+	start = sys_time_msec();
+	if ((r = sys_futex_wait(word, 0, 50)) != -E_TIMEOUT)
+		panic("futex_wait timeout returned %e", r);
+	if (sys_time_msec() - start < 50)
+		panic("futex_wait returned early");
+	cprintf("futex timeout OK\n");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		while (*word == 0)
+			if ((r = sys_futex_wait(word, 0, 0)) < 0 && r != -E_AGAIN)
+				panic("child futex_wait: %e", r);
+		*done = 1;
+		sys_futex_wake(done, 1);
+		return;
+	}
+
+	// Wait until the child is asleep on the futex.
+	while (envs[ENVX(child)].env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+
+	*word = 1;
+	if ((r = sys_futex_wake(word, 1)) != 1)
+		panic("futex_wake woke %d envs, expected 1", r);
+	while (*done == 0)
+		if ((r = sys_futex_wait(done, 0, 1000)) < 0 && r != -E_AGAIN)
+			panic("parent futex_wait: %e", r);
+	cprintf("futex wake OK\n");
+}
@@ -0,0 +1,71 @@
+// Test kernel-scheduled threads sharing one address space.
+
+#include <inc/lib.h>
+
+#define NTHREADS	4
+#define NINCR		10000
+
+static volatile uint32_t counter;
+static volatile bool mapped;
+static envid_t tids[NTHREADS];
+
+static void
+worker(void *arg)
+{
+	int i;
+
+	// thisenv must be the thread itself, not the program's first thread.
+	if (thisenv->env_id != sys_getenvid())
+		panic("thread %d: thisenv is %08x, not %08x", (int) arg,
+		      thisenv->env_id, sys_getenvid());
+
+	for (i = 0; i < NINCR; i++) {
+		__sync_fetch_and_add(&counter, 1);
+		if (i % 1000 == 0)
+			sys_yield();
+	}
+
+	// A page mapped by another thread after we started is visible.
+	while (!mapped)
+		sys_yield();
+	if (*(volatile int *) UTEMP != 1)
+		panic("thread %d: shared page holds %d", (int) arg,
+		      *(volatile int *) UTEMP);
+}
+
+void
+umain(int argc, char **argv)
+{
+	volatile int *shared = (volatile int *) UTEMP;
+	int i, r;
+
+	// Memory mapped after the threads start is visible to them.
+	for (i = 0; i < NTHREADS; i++)
+		if ((tids[i] = kthread_create(worker, (void *) i)) < 0)
+			panic("kthread_create: %e", tids[i]);
+	if ((r = sys_page_alloc(0, (void *) shared, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*shared = 1;
+	mapped = true;
+
+	for (i = 0; i < NTHREADS; i++)
+		if ((r = kthread_join(tids[i])) < 0)
+			panic("kthread_join: %e", r);
+	if (counter != NTHREADS * NINCR)
+		panic("counter is %d, want %d", counter, NTHREADS * NINCR);
+	cprintf("kthreads share memory OK\n");
+
+	// Slots of exited threads are reused.
+	for (i = 0; i < NTHREADS; i++) {
+		while (envs[ENVX(tids[i])].env_id == tids[i]
+		       && envs[ENVX(tids[i])].env_status != ENV_FREE)
+			sys_yield();
+		if ((tids[i] = kthread_create(worker, (void *) i)) < 0)
+			panic("kthread_create again: %e", tids[i]);
+	}
+	for (i = 0; i < NTHREADS; i++)
+		kthread_join(tids[i]);
+	if (counter != 2 * NTHREADS * NINCR)
+		panic("counter is %d, want %d", counter, 2 * NTHREADS * NINCR);
+	cprintf("kthreads reuse OK\n");
+}
@@ -0,0 +1,169 @@
+// Test netmap mode: a child registers as the service environment,
+// attaches to the card, pushes a few rings' worth of frames through the
+// transmit ring, asks the host for its MAC address and finds the reply
+// on the receive ring.  Once the child is gone the card must be back in
+// page mode.
+
+#include <inc/lib.h>
+#include <inc/ns.h>
+#include <inc/nettest.h>
+
+#define NFRAMES		200
+
+static struct netmap_if *nif = (struct netmap_if *) NETMAP_VA;
+static uint8_t mac[6];
+
+static uint32_t
+next(struct netmap_ring *ring, uint32_t i)
+{
+	return (i + 1) % ring->nr_nslots;
+}
+
+// Queue an ARP request on the transmit ring, waiting for room, and
+// hand the card a batch every 16 frames.
+static void
+send(void)
+{
+	struct netmap_ring *ring = &nif->ni_tx;
+	struct netmap_slot *slot;
+	int r;
+
+	while (ring->nr_head == ring->nr_tail) {
+		sys_wait(WAIT_NET_TX, NULL, 0, (void *) UTOP, 100);
+		if ((r = sys_netmap_sync(NETMAP_TX)) < 0)
+			panic("sys_netmap_sync(TX): %e", r);
+	}
+	slot = &ring->nr_slot[ring->nr_head];
+	nettest_arp((uint8_t *) NETMAP_BUF(slot->ns_buf), mac);
+	slot->ns_len = ARP_LEN;
+	ring->nr_head = next(ring, ring->nr_head);
+	if (ring->nr_head % 16 == 0 && (r = sys_netmap_sync(NETMAP_TX)) < 0)
+		panic("sys_netmap_sync(TX): %e", r);
+}
+
+static void
+test_tx(void)
+{
+	struct netmap_ring *ring = &nif->ni_tx;
+	int i, r;
+
+	if (ring->nr_nslots != NETMAP_NTX || ring->nr_head != 0
+	    || ring->nr_tail != NETMAP_NTX - 1)
+		panic("transmit ring starts at %d..%d of %d", ring->nr_head,
+		      ring->nr_tail, ring->nr_nslots);
+
+	// Bad slots go nowhere.
+	ring->nr_slot[0].ns_buf = NETMAP_NBUF;
+	ring->nr_slot[0].ns_len = ARP_LEN;
+	ring->nr_head = 1;
+	if ((r = sys_netmap_sync(NETMAP_TX)) != -E_INVAL)
+		panic("sys_netmap_sync took a bad buffer: %e", r);
+	ring->nr_slot[0].ns_buf = 0;
+	ring->nr_head = NETMAP_NTX;
+	if ((r = sys_netmap_sync(NETMAP_TX)) != -E_INVAL)
+		panic("sys_netmap_sync took a bad head: %e", r);
+	ring->nr_head = 0;
+
+	for (i = 0; i < NFRAMES; i++)
+		send();
+	if ((r = sys_netmap_sync(NETMAP_TX)) < 0)
+		panic("sys_netmap_sync(TX): %e", r);
+
+	// Wait for the card to give back every slot.
+	for (i = 0; next(ring, ring->nr_tail) != ring->nr_head; i++) {
+		if (i == 100)
+			panic("transmit ring stuck at %d..%d", ring->nr_head,
+			      ring->nr_tail);
+		sys_wait(WAIT_NET_TX, NULL, 0, (void *) UTOP, 10);
+		if ((r = sys_netmap_sync(NETMAP_TX)) < 0)
+			panic("sys_netmap_sync(TX): %e", r);
+	}
+	cprintf("netmap tx OK\n");
+}
+
+static void
+test_rx(void)
+{
+	struct netmap_ring *ring = &nif->ni_rx;
+	struct netmap_slot *slot;
+	uint16_t spare = NETMAP_NTX + NETMAP_NRX, tmp;
+	uint8_t *buf;
+	int i, r;
+
+	for (i = 0; i < 100; i++) {
+		while (ring->nr_head != ring->nr_tail) {
+			slot = &ring->nr_slot[ring->nr_head];
+			buf = (uint8_t *) NETMAP_BUF(slot->ns_buf);
+			if (slot->ns_len >= 42 && buf[12] == 0x08
+			    && buf[13] == 0x06 && buf[21] == 2
+			    && memcmp(buf, mac, 6) == 0) {
+				cprintf("netmap rx OK\n");
+				return;
+			}
+			// Swap in a spare buffer, as a consumer keeping
+			// the packet would.
+			tmp = slot->ns_buf;
+			slot->ns_buf = spare;
+			spare = tmp;
+			ring->nr_head = next(ring, ring->nr_head);
+		}
+		sys_wait(WAIT_NET_RX, NULL, 0, (void *) UTOP, 10);
+		if ((r = sys_netmap_sync(NETMAP_RX)) < 0)
+			panic("sys_netmap_sync(RX): %e", r);
+	}
+	panic("no ARP reply on the receive ring");
+}
+
+static void
+child(void)
+{
+	struct jif_txd txd;
+	int r;
+
+	// Not just anybody may take the card.
+	if ((r = sys_netmap_attach()) != -E_BAD_ENV)
+		panic("sys_netmap_attach by a user environment: %e", r);
+	sys_set_service();
+	if ((r = sys_netmap_attach()) < 0)
+		panic("sys_netmap_attach: %e", r);
+	if ((r = sys_netmap_attach()) != -E_BAD_ENV)
+		panic("second sys_netmap_attach: %e", r);
+	txd.jt_va = NETMAP_BUF(0);
+	txd.jt_len = ARP_LEN;
+	txd.jt_flags = 0;
+	if ((r = sys_tx_batch(&txd, 1)) != -E_NOT_SUPP)
+		panic("sys_tx_batch while attached: %e", r);
+	test_tx();
+	test_rx();
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct jif_txd txd;
+	envid_t env;
+	int r;
+
+	nettest_mac(mac);
+
+	if ((env = fork()) < 0)
+		panic("fork: %e", env);
+	if (env == 0) {
+		child();
+		return;
+	}
+	wait(env);
+
+	// The card is back in page mode.
+	if ((r = sys_page_alloc(0, (void *) UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	nettest_arp(UTEMP, mac);
+	txd.jt_va = UTEMP;
+	txd.jt_len = ARP_LEN;
+	txd.jt_flags = 0;
+	while ((r = sys_tx_batch(&txd, 1)) == -E_E1000_TX_FULL)
+		sys_yield();
+	if (r != 1)
+		panic("sys_tx_batch after release: %e", r);
+	cprintf("netmap released OK\n");
+}
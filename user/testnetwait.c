@@ -0,0 +1,58 @@
+// Test several environments waiting on the network card at once: an
+// ARP request to the host must wake every one of them with WAIT_NET_RX.
+
+#include <inc/lib.h>
+#include <inc/ns.h>
+#include <inc/nettest.h>
+
+#define NWAITER		3
+
+// Send an ARP request for 10.0.2.2 from 10.0.2.15.
+static void
+arp_request(void)
+{
+	uint8_t *buf = UTEMP, mac[6];
+	struct jif_txd txd;
+	int r;
+
+	if ((r = sys_page_alloc(0, buf, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	nettest_mac(mac);
+	nettest_arp(buf, mac);
+
+	txd.jt_va = buf;
+	txd.jt_len = ARP_LEN;
+	txd.jt_flags = 0;
+	while ((r = sys_tx_batch(&txd, 1)) == -E_E1000_TX_FULL)
+		sys_yield();
+	if (r != 1)
+		panic("sys_tx_batch: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t waiter[NWAITER];
+	int i, r;
+
+	for (i = 0; i < NWAITER; i++) {
+		if ((waiter[i] = fork()) < 0)
+			panic("fork: %e", waiter[i]);
+		if (waiter[i] == 0) {
+			if ((r = sys_wait(WAIT_NET_RX, NULL, 0, (void *) UTOP, 5000)) != WAIT_NET_RX)
+				panic("rx waiter %d: sys_wait returned %e", i, r);
+			cprintf("rx waiter %d woke\n", i);
+			return;
+		}
+	}
+
+	// Let them all go to sleep before there is anything to see.
+	for (i = 0; i < NWAITER; i++)
+		while (envs[ENVX(waiter[i])].env_status != ENV_NOT_RUNNABLE)
+			sys_yield();
+	arp_request();
+
+	for (i = 0; i < NWAITER; i++)
+		wait(waiter[i]);
+	cprintf("net waiters OK\n");
+}
@@ -0,0 +1,38 @@
+// Test demand-paged spawn: instances of a program share its text pages
+// and get private, correctly initialized data and bss.
+
+#include <inc/lib.h>
+
+int data = 42;
+int bss;
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t text[2];
+	envid_t child, who;
+	int i;
+
+	if (argc > 1) {
+		// Scribble on our data so that a later instance would notice
+		// if it were shared, then report where our text lives.
+		if (data != 42 || bss != 0)
+			panic("child sees data %d bss %d", data, bss);
+		data = bss = 1;
+		ipc_send(thisenv->env_parent_id, PTE_ADDR(uvpt[PGNUM(umain)]), 0, 0);
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if ((child = spawnl("testpagein", "testpagein", "child", 0)) < 0)
+			panic("spawn: %e", child);
+		text[i] = ipc_recv(&who, 0, 0);
+		if (who != child)
+			panic("message from %08x, not child %08x", who, child);
+		wait(child);
+	}
+
+	if (text[0] != text[1])
+		panic("text not shared: %08x vs %08x", text[0], text[1]);
+	cprintf("demand-paged spawn OK\n");
+}
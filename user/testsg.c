@@ -0,0 +1,78 @@
+// Test scatter-gather transmit: send a UDP packet whose headers and
+// payload lie in three fragments on three pages, with its checksums
+// left to the card.  The grade script checks that it went out on the
+// wire in one piece.
+
+#include <inc/lib.h>
+#include <inc/ns.h>
+#include <inc/nettest.h>
+
+#define HDR_LEN		(ETH_HLEN + IP_HLEN + UDP_HLEN)
+
+static const char msg1[] = "scatter-gather ";
+static const char msg2[] = "payload";
+
+static uint8_t *page[3] = { UTEMP, UTEMP + PGSIZE, UTEMP + 2 * PGSIZE };
+
+// Build the Ethernet, IP and UDP headers of a packet to 10.0.2.2 with
+// 'len' bytes of payload in 'hdr'.  The IP checksum is left 0 and the
+// UDP one seeded with the pseudo header, as the card wants.
+static void
+build(uint8_t *hdr, int len)
+{
+	uint8_t *udp = nettest_ip(hdr, 17, UDP_HLEN, len, 4321);
+
+	put16(udp + 4, UDP_HLEN + len);
+	put16(udp + 6, nettest_pseudo(hdr, UDP_HLEN + len));
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct jif_txd txds[JIF_TX_MAXFRAG + 1];
+	int i, r;
+
+	for (i = 0; i < 3; i++)
+		if ((r = sys_page_alloc(0, page[i], PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	build(page[0], strlen(msg1) + strlen(msg2));
+	txds[0].jt_va = page[0];
+	txds[0].jt_len = HDR_LEN;
+	txds[0].jt_flags = JIF_CSUM_IP | JIF_CSUM_L4 | JIF_TX_MORE;
+	// Up against the end of its page
+	txds[1].jt_va = page[1] + PGSIZE - strlen(msg1);
+	txds[1].jt_len = strlen(msg1);
+	txds[1].jt_flags = JIF_TX_MORE;
+	memcpy(txds[1].jt_va, msg1, strlen(msg1));
+	txds[2].jt_va = page[2];
+	txds[2].jt_len = strlen(msg2);
+	txds[2].jt_flags = 0;
+	memcpy(txds[2].jt_va, msg2, strlen(msg2));
+
+	// A packet must end within the batch.
+	if ((r = sys_tx_batch(txds, 2)) != -E_INVAL)
+		panic("sys_tx_batch took an unfinished packet: %e", r);
+
+	while ((r = sys_tx_batch(txds, 3)) == -E_E1000_TX_FULL)
+		sys_yield();
+	if (r != 3)
+		panic("sys_tx_batch: %e", r);
+
+	// No fragment may cross a page boundary.
+	txds[1].jt_len++;
+	if ((r = sys_tx_batch(txds, 3)) != -E_INVAL)
+		panic("sys_tx_batch took a fragment across pages: %e", r);
+
+	// Nor may a packet have too many of them.
+	for (i = 0; i <= JIF_TX_MAXFRAG; i++) {
+		txds[i].jt_va = page[2];
+		txds[i].jt_len = 1;
+		txds[i].jt_flags = JIF_TX_MORE;
+	}
+	txds[JIF_TX_MAXFRAG].jt_flags = 0;
+	if ((r = sys_tx_batch(txds, JIF_TX_MAXFRAG + 1)) != -E_INVAL)
+		panic("sys_tx_batch took %d fragments: %e", JIF_TX_MAXFRAG + 1, r);
+
+	cprintf("scatter-gather sent\n");
+}
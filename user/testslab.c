@@ -0,0 +1,127 @@
+// Test the size-class allocator.
+
+#include <inc/lib.h>
+
+#define NOBJ	1000
+#define HUGE	(8 * 1024 * 1024)
+
+#define NTHREADS	4
+
+static char *objs[NOBJ];
+
+// Allocate and free from several threads at once, each with its own
+// slice of objs[].
+static void
+churn(void *arg)
+{
+	int t = (int) arg, i, j, k;
+	char **mine = objs + t * (NOBJ / NTHREADS);
+
+	for (k = 0; k < 20; k++) {
+		for (i = 0; i < NOBJ / NTHREADS; i++) {
+			if ((mine[i] = malloc(i % 300 + 1)) == 0)
+				panic("thread %d: malloc failed", t);
+			memset(mine[i], t, i % 300 + 1);
+		}
+		for (i = 0; i < NOBJ / NTHREADS; i++) {
+			for (j = 0; j < i % 300 + 1; j++)
+				if (mine[i][j] != (char) t)
+					panic("thread %d: object overwritten", t);
+			free(mine[i]);
+		}
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct MallocStats before, after;
+	envid_t tids[NTHREADS];
+	char *p, *q;
+	int i, j;
+
+	// Objects of many sizes keep their contents.
+	for (i = 0; i < NOBJ; i++) {
+		if ((objs[i] = malloc(i * 7 % 3000 + 1)) == 0)
+			panic("malloc %d failed", i * 7 % 3000 + 1);
+		if ((uintptr_t) objs[i] % 16)
+			panic("malloc returned unaligned %p", objs[i]);
+		memset(objs[i], i, i * 7 % 3000 + 1);
+	}
+	for (i = 0; i < NOBJ; i++)
+		for (j = 0; j < i * 7 % 3000 + 1; j++)
+			if (objs[i][j] != (char) i)
+				panic("object %d overwritten", i);
+
+	// Freed space is reused right away, even with the rest of its
+	// page still in use.
+	p = objs[100];
+	free(p);
+	if ((q = malloc(100 * 7 % 3000 + 1)) != p)
+		panic("freed object not reused: %p, then %p", p, q);
+	for (i = 0; i < NOBJ; i++)
+		free(objs[i]);
+	cprintf("malloc reuse OK\n");
+
+	// calloc zeroes recycled memory; realloc keeps the contents.
+	p = malloc(64);
+	memset(p, 0xff, 64);
+	free(p);
+	if ((q = calloc(4, 16)) != p)
+		panic("calloc did not reuse %p", p);
+	for (i = 0; i < 64; i++)
+		if (q[i] != 0)
+			panic("calloc memory not zeroed");
+	strcpy(q, "hello, realloc");
+	if ((p = realloc(q, 5000)) == 0 || strcmp(p, "hello, realloc") != 0)
+		panic("realloc lost the contents");
+	if (realloc(p, 10) != p)
+		panic("shrinking realloc moved the object");
+	free(p);
+	cprintf("calloc realloc OK\n");
+
+	// A warm heap serves small objects without system calls.
+	malloc_stats(&before);
+	for (i = 0; i < NOBJ; i++)
+		free(malloc(i % 500 + 1));
+	malloc_stats(&after);
+	if (after.ms_nsyscall != before.ms_nsyscall)
+		panic("%d system calls in steady state",
+		      after.ms_nsyscall - before.ms_nsyscall);
+	if (after.ms_inuse != before.ms_inuse)
+		panic("in-use bytes went from %d to %d",
+		      before.ms_inuse, after.ms_inuse);
+
+	// Huge objects: one mapping call and one unmapping call each.
+	if ((p = malloc(HUGE)) == 0)
+		panic("malloc(%d) failed", HUGE);
+	if ((uintptr_t) p % PTSIZE)
+		panic("huge object at %p is not aligned", p);
+	p[0] = p[HUGE - 1] = 1;
+	malloc_stats(&after);
+	if (after.ms_nlarge != before.ms_nlarge + 1
+	    || after.ms_large < before.ms_large + HUGE)
+		panic("huge object not accounted for");
+	free(p);
+	malloc_stats(&after);
+	if (after.ms_nsyscall != before.ms_nsyscall + 2
+	    || after.ms_large != before.ms_large)
+		panic("huge object took %d system calls",
+		      after.ms_nsyscall - before.ms_nsyscall);
+	cprintf("malloc huge OK\n");
+
+	// Threads allocate from their own caches and give them back when
+	// they exit.
+	for (i = 0; i < NTHREADS; i++)
+		if ((tids[i] = kthread_create(churn, (void *) i)) < 0)
+			panic("kthread_create: %e", tids[i]);
+	for (i = 0; i < NTHREADS; i++)
+		kthread_join(tids[i]);
+	malloc_stats(&after);
+	if (after.ms_nmalloc - before.ms_nmalloc
+	    != after.ms_nfree - before.ms_nfree)
+		panic("%d mallocs but %d frees",
+		      after.ms_nmalloc - before.ms_nmalloc,
+		      after.ms_nfree - before.ms_nfree);
+	cprintf("malloc threads OK\n");
+}
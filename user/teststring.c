@@ -0,0 +1,125 @@
+// Test the word-at-a-time and SSE2 string routines against byte loops,
+// at every alignment, with two environments running them at once.
+
+#include <inc/lib.h>
+
+#define BUFSIZE		512
+#define NROUNDS		20
+
+static char a[BUFSIZE + 64], b[BUFSIZE + 64], c[BUFSIZE + 64];
+
+static int
+sign(int x)
+{
+	return x < 0 ? -1 : x > 0;
+}
+
+static void
+fill(char *p, size_t n, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		p[i] = (char) (seed + i * 7 + 1) ?: 1;
+}
+
+static void
+check(int seed)
+{
+	size_t off, n, i, len;
+	char *s;
+	int d;
+
+	for (off = 0; off < 16; off++)
+		for (n = 0; n < BUFSIZE - 16; n += (n < 40 ? 1 : 37)) {
+			// memset and memcpy leave the bytes around them alone.
+			memset(a, 0x5A, sizeof(a));
+			memset(a + off, seed, n);
+			for (i = 0; i < sizeof(a); i++)
+				if (a[i] != (char) (i >= off && i < off + n ? seed : 0x5A))
+					panic("memset(+%d, %d) wrong at %d", off, n, i);
+			fill(b, sizeof(b), seed);
+			memset(c, 0x5A, sizeof(c));
+			memcpy(c + off, b + 3, n);
+			for (i = 0; i < sizeof(c); i++)
+				if (c[i] != (i >= off && i < off + n ? b[i - off + 3] : 0x5A))
+					panic("memcpy(+%d, %d) wrong at %d", off, n, i);
+
+			// Overlapping moves in both directions.
+			fill(a, sizeof(a), seed);
+			memmove(a + off + 5, a + off, n);
+			for (i = 0; i < n; i++)
+				if (a[off + 5 + i] != b[off + i])
+					panic("memmove up(+%d, %d) wrong at %d", off, n, i);
+			fill(a, sizeof(a), seed);
+			memmove(a + off, a + off + 5, n);
+			for (i = 0; i < n; i++)
+				if (a[off + i] != b[off + 5 + i])
+					panic("memmove down(+%d, %d) wrong at %d", off, n, i);
+
+			// A NUL, a difference and a match at the end of n bytes.
+			fill(a, sizeof(a), seed);
+			fill(c, sizeof(c), seed);
+			s = a + off;
+			s[n] = '\0';
+			if (strlen(s) != n || strnlen(s, n / 2) != n / 2)
+				panic("strlen(+%d, %d) wrong", off, n);
+			if (strcmp(s, c + off) >= 0 || strncmp(s, c + off, n) != 0)
+				panic("strcmp(+%d, %d) wrong", off, n);
+			if (n > 0) {
+				len = n - 1;
+				c[off + len] = s[len] + 1;
+				d = (unsigned char) s[len] - (unsigned char) c[off + len];
+				if (sign(memcmp(s, c + off, n)) != sign(d)
+				    || memcmp(s, c + off, len) != 0
+				    || sign(strcmp(s, c + off)) != sign(d))
+					panic("memcmp(+%d, %d) wrong", off, n);
+				s[len] = 'Z';
+				for (i = 0; i < len && s[i] != 'Z'; i++)
+					;
+				if ((char *) memfind(s, 'Z', n) != s + i
+				    || strchr(s, 'Z') != s + i)
+					panic("memfind(+%d, %d) wrong", off, n);
+			}
+			if (memfind(s, '\0', n) != s + n || strchr(s, '\0') != 0)
+				panic("memfind(+%d, %d) past end wrong", off, n);
+		}
+}
+
+static char pg[2][PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+check_pages(int seed)
+{
+	int i;
+
+	fill(pg[0], PGSIZE, seed);
+	page_copy(pg[1], pg[0]);
+	if (memcmp(pg[0], pg[1], PGSIZE) != 0)
+		panic("page_copy wrong");
+	page_zero(pg[1]);
+	for (i = 0; i < PGSIZE; i++)
+		if (pg[1][i] != 0)
+			panic("page_zero wrong at %d", i);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int i;
+
+	// The child and the parent share CPUs, so each must see its own
+	// SSE registers.
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	for (i = 0; i < NROUNDS; i++) {
+		check(child ? 'p' : 'c');
+		check_pages(child ? 'p' : 'c');
+		sys_yield();
+	}
+	if (child == 0)
+		return;
+	wait(child);
+	cprintf("string functions OK\n");
+}
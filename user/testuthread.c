@@ -0,0 +1,103 @@
+// Test user threads multiplexed over several kernel threads.
+
+#include <inc/lib.h>
+
+#define NWORKERS	4
+#define NTHREADS	500
+#define NINCR		20
+#define NITEMS		1000
+#define NPAIRS		4
+#define QSIZE		8
+
+static struct Umutex lock = UMUTEX_INITIALIZER;
+static uint32_t counter;	// Protected by lock
+static struct Uthread *threads[NTHREADS];
+
+static struct Ucond notempty = UCOND_INITIALIZER;
+static struct Ucond notfull = UCOND_INITIALIZER;
+static int queue[QSIZE], qhead, qtail;	// Protected by lock
+static uint32_t consumed;		// Protected by lock
+
+static void
+incr(void *arg)
+{
+	uint32_t c;
+	int i;
+
+	for (i = 0; i < NINCR; i++) {
+		umutex_lock(&lock);
+		c = counter;
+		// Let other threads run, and collide, inside the critical section.
+		if (i % 4 == 0)
+			uthread_yield();
+		counter = c + 1;
+		umutex_unlock(&lock);
+	}
+}
+
+static void
+produce(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NITEMS; i++) {
+		umutex_lock(&lock);
+		while (qtail - qhead == QSIZE)
+			ucond_wait(&notfull, &lock);
+		queue[qtail++ % QSIZE] = i;
+		ucond_signal(&notempty);
+		umutex_unlock(&lock);
+	}
+}
+
+static void
+consume(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NITEMS; i++) {
+		umutex_lock(&lock);
+		while (qtail == qhead)
+			ucond_wait(&notempty, &lock);
+		qhead++;
+		consumed++;
+		ucond_signal(&notfull);
+		umutex_unlock(&lock);
+	}
+}
+
+static void
+run(void *arg)
+{
+	int i, r;
+
+	for (i = 0; i < NTHREADS; i++)
+		if ((r = uthread_create(&threads[i], incr, 0, PGSIZE / 2)) < 0)
+			panic("uthread_create: %e", r);
+	for (i = 0; i < NTHREADS; i++)
+		uthread_join(threads[i]);
+	if (counter != NTHREADS * NINCR)
+		panic("counter is %d, want %d", counter, NTHREADS * NINCR);
+	cprintf("uthreads mutex OK\n");
+
+	// Producers and consumers; their stacks come from the threads above.
+	for (i = 0; i < 2 * NPAIRS; i++)
+		if ((r = uthread_create(&threads[i], i < NPAIRS ? produce : consume,
+					0, PGSIZE / 2)) < 0)
+			panic("uthread_create: %e", r);
+	for (i = 0; i < 2 * NPAIRS; i++)
+		uthread_join(threads[i]);
+	if (consumed != NPAIRS * NITEMS || qhead != qtail)
+		panic("consumed %d, want %d", consumed, NPAIRS * NITEMS);
+	cprintf("uthreads cond OK\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if ((r = uthread_run(run, 0, NWORKERS)) < 0)
+		panic("uthread_run: %e", r);
+	cprintf("uthreads done OK\n");
+}
@@ -0,0 +1,49 @@
+// Test ipc_recv_timeout and waiting on several event sources at once.
+
+#include <inc/lib.h>
+
+#define SHVA	((volatile uint32_t *) 0xA0000000)
+
+void
+umain(int argc, char **argv)
+{
+	volatile uint32_t *word = SHVA;
+	unsigned start;
+	envid_t child, who;
+	int r;
+
+	// Nobody sends to us, so the receive must time out.
+	start = sys_time_msec();
+	if ((r = ipc_recv_timeout(&who, 0, 0, 50)) != -E_TIMEOUT)
+		panic("ipc_recv_timeout returned %e", r);
+	if (sys_time_msec() - start < 50)
+		panic("ipc_recv_timeout returned early");
+	cprintf("ipc timeout OK\n");
+
+	if ((r = sys_page_alloc(0, (void *) SHVA, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	// A futex word that already changed is reported immediately.
+	if ((r = sys_wait(WAIT_IPC|WAIT_FUTEX, word, 1, (void *) UTOP, 0)) != WAIT_FUTEX)
+		panic("sys_wait on stale futex returned %d", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		ipc_send(thisenv->env_parent_id, 42, 0, 0);
+		while (envs[ENVX(thisenv->env_parent_id)].env_status != ENV_NOT_RUNNABLE)
+			sys_yield();
+		*word = 1;
+		sys_futex_wake(word, 1);
+		return;
+	}
+
+	if ((r = sys_wait(WAIT_IPC|WAIT_FUTEX, word, 0, (void *) UTOP, 1000)) != WAIT_IPC)
+		panic("sys_wait for IPC returned %d", r);
+	if (thisenv->env_ipc_value != 42 || thisenv->env_ipc_from != child)
+		panic("sys_wait got the wrong message");
+
+	if ((r = sys_wait(WAIT_IPC|WAIT_FUTEX, word, 0, (void *) UTOP, 1000)) != WAIT_FUTEX)
+		panic("sys_wait for futex returned %d", r);
+	cprintf("multi-source wait OK\n");
+}